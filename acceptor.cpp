@@ -0,0 +1,162 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "acceptor.h"
+#include "metrics.h"
+#include "logger.h"
+
+Acceptor::Acceptor (Player::Manager& manager, Pool& pool, int listener,
+                    size_t delay, int shutdown,
+                    size_t debug_level, Dv::Debugable* debug) :
+Dv::Thread::Thread (false, debug_level, debug), _manager (manager),
+_pool (pool), _fd (listener), _delay (delay),
+_shutdown (shutdown) { }
+
+Acceptor::~Acceptor ()
+{
+  close(_fd);
+}
+
+int Acceptor::listen_socket (int port, int backlog)
+{
+  static const int on(1);
+  static const int off(0);
+  int fd(socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+
+  if ( fd >= 0 )
+    {
+      struct sockaddr_in6 addr;
+
+      memset(&addr, 0, sizeof (addr));
+      addr.sin6_family = AF_INET6;
+      addr.sin6_addr = in6addr_any;
+      addr.sin6_port = htons(port);
+      // Accept IPv4 connections as well
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof (off));
+      if ( setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) == 0
+           && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on)) == 0
+           && bind(fd, reinterpret_cast<sockaddr*> (&addr), sizeof (addr)) == 0
+           && listen(fd, backlog) == 0 )
+        return fd;
+      close(fd);
+    }
+
+  // No IPv6 on this host
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if ( fd >= 0 )
+    {
+      struct sockaddr_in addr;
+
+      memset(&addr, 0, sizeof (addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_ANY);
+      addr.sin_port = htons(port);
+      if ( setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) == 0
+           && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on)) == 0
+           && bind(fd, reinterpret_cast<sockaddr*> (&addr), sizeof (addr)) == 0
+           && listen(fd, backlog) == 0 )
+        return fd;
+      close(fd);
+    }
+  throw std::runtime_error(std::string("unable to listen: ") + strerror(errno));
+}
+
+void Acceptor::refuse (int fd, Admission::Result result)
+{
+  std::string greeting;
+
+  switch (result)
+    {
+      case Admission::AddressFull:
+        Metrics::add(Metrics::RefusedAddress);
+        greeting = "-ERR [IN-USE] too many sessions from your address\r\n";
+        break;
+      case Admission::Backlogged:
+        Metrics::add(Metrics::RefusedBacklog);
+        greeting = "-ERR [SYS/TEMP] server busy, try again later\r\n";
+        break;
+      default:
+        Metrics::add(Metrics::RefusedFull);
+        greeting = "-ERR [SYS/TEMP] too many sessions, try again later\r\n";
+        break;
+    }
+  // The socket is new and non-blocking, the greeting fits in its buffer
+  send(fd, greeting.data(), greeting.size(), MSG_NOSIGNAL);
+  close(fd);
+}
+
+int Acceptor::main ()
+{
+  Router* router(_manager.router());
+  struct pollfd fds[3] = {
+    { _fd, POLLIN, 0 },
+    { _shutdown, POLLIN, 0 },
+    { router ? router->fd() : -1, POLLIN, 0 }
+  };
+
+  while ( !killed() )
+    {
+      if ( poll(fds, 3, -1) < 0 )
+        {
+          if ( errno == EINTR )
+            continue;
+          log() << "acceptor: poll: " << strerror(errno) << std::endl;
+          return 1;
+        }
+      // The shutdown eventfd is never read, so it wakes every acceptor
+      if ( fds[1].revents )
+        return 0;
+
+      // Sessions that another worker moved here, they are logged in
+      Router::Session session;
+      while ( fds[2].revents && router->receive(session) )
+        {
+          Admission::Result result(_manager.admission().admit(session.address,
+                                                              _pool.waiting()));
+
+          if ( result != Admission::Admitted )
+            {
+              Logger::write(Logger::Info, Logger::Refuse, 0, session.address);
+              refuse(session.fd, result);
+              continue;
+            }
+
+          Dv::shared_ptr<Dv::Net::Socket> socket(new Dv::Net::Socket(session.fd, _delay));
+          _pool.submit(Player::adopt(_manager, socket, _delay, session));
+        }
+
+      /* Take all pending connections, another acceptor may beat us to
+       * them. The listening socket is non-blocking, the connections are
+       * not: a player writes its replies through a blocking stream, which
+       * waits while the client's receive window is full. */
+      int fd;
+      while ( (fd = accept4(_fd, 0, 0, SOCK_CLOEXEC)) >= 0 )
+        {
+          // The delay argument makes e.g. getline(socket) time out after
+          // delay millisecs, ensuring that we can often check conditions
+          // in a player's main loop.
+          std::string address(Player::peer_address(fd));
+          Admission::Result result(_manager.admission().admit(address,
+                                                              _pool.waiting()));
+
+          if ( result != Admission::Admitted )
+            {
+              Logger::write(Logger::Info, Logger::Refuse, 0, address);
+              refuse(fd, result);
+              continue;
+            }
+
+          Dv::shared_ptr<Dv::Net::Socket> socket(new Dv::Net::Socket(fd, _delay));
+          _pool.submit(Player::make(_manager, socket, _delay));
+        }
+      if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+           && errno != ECONNABORTED )
+        log() << "acceptor: accept: " << strerror(errno) << std::endl;
+    }
+  return 0;
+}
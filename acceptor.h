@@ -0,0 +1,93 @@
+/*
+ * File:   acceptor.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _ACCEPTOR_H
+#define	_ACCEPTOR_H
+
+#include <dvthread/thread.h>
+
+#include "player.h"
+#include "pool.h"
+
+/** An Acceptor is a thread that accepts connections on its own
+ * listening socket and hands a new Player for each of them to a Pool. Several
+ * acceptors listen on the same port (with SO_REUSEPORT), so the
+ * kernel spreads the incoming connections over them and a login storm
+ * is not serialized on a single thread.
+ *
+ * A connection is first admitted (see Admission). A connection that is
+ * not gets an -ERR greeting and is closed at once, without ever
+ * becoming a player.
+ *
+ * In a worker of a prefork server, the acceptors also take the sessions
+ * that other workers moved here (see Router), they are admitted alike.
+ *
+ * An acceptor waits for connections without timing out; it stops when
+ * the shutdown file descriptor (an eventfd) becomes readable.
+ *
+ * The listening socket is created by the main program (see
+ * Acceptor::listen_socket), so that a port that cannot be used is
+ * reported at once, and so that the master of a prefork server can
+ * hand the same sockets to every worker process.
+ */
+class Acceptor : public Dv::Thread::Thread
+{
+public:
+  /** Constructor for Acceptor
+   * @param manager of the players that will be started
+   * @param pool that runs the players
+   * @param listener the listening socket, non-blocking; the acceptor
+   *   closes it
+   * @param delay millisecs passed on to the sockets and players
+   * @param shutdown file descriptor that becomes readable on shutdown
+   * @param debug_level only if the master debug level is larger
+   *   than this level will debug output be generated
+   * @param debug object (may be 0)
+   */
+  Acceptor (Player::Manager& manager, Pool& pool, int listener,
+            size_t delay, int shutdown, size_t debug_level,
+            Dv::Debugable* debug);
+
+  /** Destructor for Acceptor
+   * Closes the listening socket
+   */
+  ~Acceptor ();
+
+  /** Create a socket listening on all addresses (IPv6 and IPv4)
+   * that shares its port with other sockets of this process.
+   * @param port on which to listen
+   * @param backlog of the listening socket
+   * @return the file descriptor of the socket
+   * @exception std::runtime_error if the socket cannot be set up
+   */
+  static int listen_socket (int port, int backlog);
+
+  /** Greet a connection that is not admitted and close it
+   * @param fd socket of the connection
+   * @param result why it is not admitted
+   */
+  static void refuse (int fd, Admission::Result result);
+
+private:
+  Acceptor (const Acceptor&);
+  Acceptor& operator= (const Acceptor&);
+
+  virtual int main ();
+
+  Player::Manager& _manager;
+
+  Pool& _pool;
+
+  /* The listening socket */
+  int _fd;
+
+  size_t _delay;
+
+  /* Readable when the server shuts down */
+  int _shutdown;
+};
+
+#endif	/* _ACCEPTOR_H */
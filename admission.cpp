@@ -0,0 +1,87 @@
+#include <sstream>
+
+#include "admission.h"
+
+Admission::Admission (size_t sessions, size_t per_address, size_t per_user,
+                      size_t pending, const std::string& directors) :
+_max_sessions (sessions), _max_per_address (per_address),
+_max_per_user (per_user), _max_pending (pending), _sessions (0)
+{
+  std::istringstream iss(directors);
+  std::string address;
+
+  while ( iss >> address )
+    _directors.insert(address);
+}
+
+bool Admission::raise (std::map<std::string, size_t>& counts,
+                       const std::string& key, size_t limit)
+{
+  size_t& count(counts[key]);
+
+  if ( limit && count >= limit )
+    return false;
+  count++;
+  return true;
+}
+
+void Admission::lower (std::map<std::string, size_t>& counts,
+                       const std::string& key)
+{
+  std::map<std::string, size_t>::iterator it(counts.find(key));
+
+  if ( it != counts.end() && --it->second == 0 )
+    counts.erase(it);
+}
+
+Admission::Result Admission::admit (const std::string& address, size_t pending)
+{
+  Lock lock(_mutex);
+
+  if ( _max_sessions && _sessions >= _max_sessions )
+    return Full;
+  if ( _max_pending && pending >= _max_pending )
+    return Backlogged;
+  // A director's sessions count for their clients, see forwarded
+  if ( !director(address) && !raise(_addresses, address, _max_per_address) )
+    return AddressFull;
+  _sessions++;
+  return Admitted;
+}
+
+void Admission::leave (const std::string& address)
+{
+  Lock lock(_mutex);
+
+  _sessions--;
+  lower(_addresses, address);
+}
+
+bool Admission::director (const std::string& address) const
+{
+  // An IPv4 director on a dual-stack socket
+  if ( address.compare(0, 7, "::ffff:") == 0 && address.find('.') != std::string::npos )
+    return _directors.count(address.substr(7)) > 0 || _directors.count(address) > 0;
+  return _directors.count(address) > 0;
+}
+
+bool Admission::forwarded (const std::string& address)
+{
+  Lock lock(_mutex);
+
+  return raise(_addresses, address, _max_per_address);
+}
+
+bool Admission::claim (const std::string& user)
+{
+  Lock lock(_mutex);
+
+  return raise(_users, user, _max_per_user);
+}
+
+void Admission::release (const std::string& user)
+{
+  Lock lock(_mutex);
+
+  lower(_users, user);
+}
@@ -0,0 +1,125 @@
+/*
+ * File:   admission.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _ADMISSION_H
+#define	_ADMISSION_H
+
+#include <string>
+#include <map>
+#include <set>
+#include <cstddef>
+
+#include "sync.h"
+
+/** Admission control: limits on the number of sessions, in total, per
+ * client address and per user. Every limit of 0 means unlimited.
+ *
+ * The acceptors admit a connection before a player is made for it, and
+ * the player leaves when it is destroyed. The manager claims a user
+ * name for a player when the client gives it (USER or APOP) and
+ * releases it when the player is removed, so a user cannot be attacked
+ * with many logins at once.
+ *
+ * The sessions of a director (see Director) all come from its address;
+ * they are not counted for it, but for the address of the client that
+ * the director tells (forwarded). Only the addresses given as directors
+ * are believed.
+ *
+ * An Admission is shared by the acceptors, the players and the manager.
+ */
+class Admission
+{
+public:
+  enum Result
+  {
+    Admitted, /* The connection may start a session */
+    Full, /* Too many sessions */
+    AddressFull, /* Too many sessions from the address */
+    Backlogged /* Too many sessions are waiting for a thread */
+  };
+
+  /** Constructor for Admission
+   * @param sessions Maximum number of sessions
+   * @param per_address Maximum number of sessions per client address
+   * @param per_user Maximum number of sessions per user
+   * @param pending Maximum number of sessions waiting for a thread
+   * @param directors The numeric addresses of the directors, separated
+   *   by spaces
+   */
+  Admission (size_t sessions, size_t per_address, size_t per_user,
+             size_t pending, const std::string& directors = "");
+
+  /** Admit a new connection, if admitted it must leave later
+   * @param address The address of the client
+   * @param pending The number of sessions now waiting for a thread
+   * @return The result of the check
+   */
+  Result admit (const std::string& address, size_t pending);
+
+  /** A session that was admitted ends
+   * @param address The address of the client, the forwarded one if
+   *   there is one
+   */
+  void leave (const std::string& address);
+
+  /** Is an address that of a director?
+   * @param address The numeric address of a peer
+   * @return A bool indicating if it was given as a director
+   */
+  bool director (const std::string& address) const;
+
+  /** A session of a director tells the address of its client, which
+   * counts from now on; the session leaves with that address
+   * @param address The address of the client
+   * @return A bool indicating if the address is below its limit, if not
+   *   the session must end (and leave with the director's address)
+   */
+  bool forwarded (const std::string& address);
+
+  /** Claim a user name for a session, if claimed it must be released
+   * later
+   * @param user The name of the user
+   * @return A bool indicating if the name was claimed
+   */
+  bool claim (const std::string& user);
+
+  /** A session no longer uses a user name
+   * @param user The name of the user
+   */
+  void release (const std::string& user);
+
+private:
+  Admission (const Admission&);
+  Admission& operator= (const Admission&);
+
+  /** Add one to a count, unless it reached its limit
+   * @return A bool indicating if the count was raised
+   */
+  static bool raise (std::map<std::string, size_t>& counts,
+                     const std::string& key, size_t limit);
+
+  /** Take one from a count, the count is removed at zero */
+  static void lower (std::map<std::string, size_t>& counts,
+                     const std::string& key);
+
+  size_t _max_sessions;
+  size_t _max_per_address;
+  size_t _max_per_user;
+  size_t _max_pending;
+
+  size_t _sessions;
+
+  /* Key = address or user name, Value = its number of sessions */
+  std::map<std::string, size_t> _addresses;
+  std::map<std::string, size_t> _users;
+
+  /* Set once, read without the lock */
+  std::set<std::string> _directors;
+
+  Mutex _mutex;
+};
+
+#endif	/* _ADMISSION_H */
@@ -0,0 +1,247 @@
+#include <cctype>
+
+#include "authenticator.h"
+#include "md5.h"
+
+Authenticator::Authenticator (Credentials* store, size_t cache_ttl, double rate,
+                              double burst) :
+_store (store), _cache_ttl (cache_ttl), _rate (rate), _burst (burst),
+_pruned (TokenBucket::now ()) { }
+
+Authenticator::~Authenticator ()
+{
+  delete _store;
+}
+
+bool Authenticator::equal (const std::string& a, const std::string& b)
+{
+  if ( a.size() != b.size() )
+    return false;
+
+  unsigned char diff(0);
+  for ( size_t i = 0; i < a.size(); i++ )
+    diff |= a[i] ^ b[i];
+  return diff == 0;
+}
+
+bool Authenticator::matches (const std::string& secret, const std::string& password)
+{
+  static const std::string plain_prefix("{PLAIN}");
+
+  if ( secret.compare(0, plain_prefix.size(), plain_prefix) == 0 )
+    return equal(secret.substr(plain_prefix.size()), password);
+  return equal(secret, password);
+}
+
+bool Authenticator::throttled (const std::string& address, const std::string& user)
+{
+  std::map<std::string, TokenBucket>::iterator it(_address_buckets.find(address));
+
+  if ( it != _address_buckets.end() && it->second.tokens() < 1 )
+    return true;
+  it = _user_buckets.find(user);
+  return it != _user_buckets.end() && it->second.tokens() < 1;
+}
+
+Authenticator::Result Authenticator::outcome (bool ok, const std::string& address,
+                                              const std::string& user)
+{
+  if ( ok )
+    return Accepted;
+
+  // Buckets only exist for addresses and users that failed recently
+  if ( _address_buckets.find(address) == _address_buckets.end() )
+    _address_buckets[address] = TokenBucket(_rate, _burst);
+  if ( _user_buckets.find(user) == _user_buckets.end() )
+    _user_buckets[user] = TokenBucket(_rate, _burst);
+  _address_buckets[address].take();
+  _user_buckets[user].take();
+  return Rejected;
+}
+
+void Authenticator::prune ()
+{
+  double now(TokenBucket::now());
+
+  if ( now - _pruned < 60 )
+    return;
+  _pruned = now;
+
+  for ( std::map<std::string, double>::iterator it = _verified.begin();
+        it != _verified.end(); )
+    {
+      if ( it->second < now )
+        _verified.erase(it++);
+      else
+        ++it;
+    }
+  for ( std::map<std::string, TokenBucket>::iterator it = _address_buckets.begin();
+        it != _address_buckets.end(); )
+    {
+      if ( it->second.full() )
+        _address_buckets.erase(it++);
+      else
+        ++it;
+    }
+  for ( std::map<std::string, TokenBucket>::iterator it = _user_buckets.begin();
+        it != _user_buckets.end(); )
+    {
+      if ( it->second.full() )
+        _user_buckets.erase(it++);
+      else
+        ++it;
+    }
+}
+
+bool Authenticator::verify (const Check& check, struct crypt_data& data)
+{
+  const char* result(crypt_r(check.password.c_str(), check.hash.c_str(), &data));
+
+  return result && equal(result, check.hash);
+}
+
+Authenticator::Result Authenticator::pass (const std::string& address,
+                                           const std::string& user,
+                                           const std::string& password,
+                                           Check& check)
+{
+  static const std::string crypt_prefix("{CRYPT}");
+
+  if ( !_store )
+    return Accepted;
+  prune();
+
+  // The cache holds a digest of the password, never the password itself
+  std::string key(user + ":" + md5_hex(user + ":" + password));
+  std::map<std::string, double>::iterator it(_verified.find(key));
+
+  if ( it != _verified.end() && it->second > TokenBucket::now() )
+    return Accepted;
+  if ( throttled(address, user) )
+    return Throttled;
+
+  std::string secret;
+
+  if ( !_store->lookup(user, secret) )
+    return outcome(false, address, user);
+  // The hash is checked by the Verifier, off the manager thread
+  if ( secret.compare(0, crypt_prefix.size(), crypt_prefix) == 0 )
+    {
+      check.address = address;
+      check.user = user;
+      check.key = key;
+      check.hash = secret.substr(crypt_prefix.size());
+      check.password = password;
+      return Verifying;
+    }
+
+  bool ok(matches(secret, password));
+
+  if ( ok )
+    _verified[key] = TokenBucket::now() + _cache_ttl;
+  return outcome(ok, address, user);
+}
+
+Authenticator::Result Authenticator::verified (const Check& check, bool ok)
+{
+  if ( ok )
+    _verified[check.key] = TokenBucket::now() + _cache_ttl;
+  return outcome(ok, check.address, check.user);
+}
+
+Authenticator::Result Authenticator::apop (const std::string& address,
+                                           const std::string& user,
+                                           const std::string& banner,
+                                           const std::string& digest)
+{
+  static const std::string plain_prefix("{PLAIN}");
+
+  if ( !_store )
+    return Accepted;
+  prune();
+  if ( throttled(address, user) )
+    return Throttled;
+
+  std::string secret;
+  bool ok(false);
+
+  // APOP needs the password itself, a hashed secret cannot be used
+  if ( _store->lookup(user, secret)
+       && secret.compare(0, 7, "{CRYPT}") != 0 )
+    {
+      if ( secret.compare(0, plain_prefix.size(), plain_prefix) == 0 )
+        secret.erase(0, plain_prefix.size());
+
+      std::string lower(digest);
+      for ( size_t i = 0; i < lower.size(); i++ )
+        lower[i] = tolower(lower[i]);
+      ok = equal(md5_hex(banner + secret), lower);
+    }
+  return outcome(ok, address, user);
+}
+
+Verifier::Verifier (Listener& listener, size_t debug_level, Dv::Debugable* debug) :
+Dv::Thread::Thread (false, debug_level, debug), _listener (listener),
+_stopping (false) { }
+
+void Verifier::verify (Player* player, const Authenticator::Check& check)
+{
+  Lock lock(_mutex);
+  Job job = { player, check, false };
+
+  _queue.push_back(job);
+  _ready.signal();
+}
+
+bool Verifier::take (Player*& player, Authenticator::Check& check, bool& ok)
+{
+  Lock lock(_mutex);
+
+  if ( _done.empty() )
+    return false;
+  player = _done.front().player;
+  check = _done.front().check;
+  ok = _done.front().ok;
+  _done.pop_front();
+  return true;
+}
+
+void Verifier::stop ()
+{
+  Lock lock(_mutex);
+
+  _stopping = true;
+  _queue.clear();
+  _ready.broadcast();
+}
+
+int Verifier::main ()
+{
+  // crypt(3) is not reentrant, crypt_r keeps its state here
+  struct crypt_data* data(new crypt_data());
+
+  while ( true )
+    {
+      Job job;
+      {
+        Lock lock(_mutex);
+
+        while ( _queue.empty() && !_stopping )
+          _ready.wait(_mutex);
+        if ( _stopping )
+          break;
+        job = _queue.front();
+        _queue.pop_front();
+      }
+
+      job.ok = Authenticator::verify(job.check, *data);
+      {
+        Lock lock(_mutex);
+
+        _done.push_back(job);
+      }
+      _listener.verified();
+    }
+  delete data;
+  return 0;
+}
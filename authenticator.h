@@ -0,0 +1,221 @@
+/*
+ * File:   authenticator.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _AUTHENTICATOR_H
+#define	_AUTHENTICATOR_H
+
+#include <string>
+#include <map>
+#include <deque>
+#include <cstddef>
+#include <crypt.h>
+
+#include <dvthread/thread.h>
+
+#include "credentials.h"
+#include "tokenbucket.h"
+#include "sync.h"
+
+class Player;
+
+/** The Authenticator checks the credentials given with PASS or APOP.
+ *
+ * Checking a crypt(3) hash is expensive, and clients poll often with
+ * the same password. A successful check is therefore remembered for a
+ * short time: a later login with the same user and password only costs
+ * a digest and a map lookup.
+ *
+ * Each failed login takes a token from a bucket for the client's address
+ * and one for the user. While either bucket is empty, logins are refused
+ * before anything expensive is done.
+ *
+ * The hash itself is not checked by the Authenticator: Authenticator::pass
+ * returns Verifying with a Check, which the Verifier thread makes, and
+ * its outcome is recorded by Authenticator::verified. An Authenticator is
+ * used by the manager thread only.
+ */
+class Authenticator
+{
+public:
+  enum Result
+  {
+    Accepted, /* The credentials are correct */
+    Rejected, /* Unknown user or wrong password */
+    Throttled, /* Too many failed logins recently */
+    Verifying /* The password must be checked against a crypt(3) hash */
+  };
+
+  /** A password to check against a crypt(3) hash, see Verifier */
+  struct Check
+  {
+    std::string address;
+    std::string user;
+    /* The key of the login in the cache of verified logins */
+    std::string key;
+    std::string hash;
+    std::string password;
+  };
+
+  /** Constructor for Authenticator
+   * @param store The credentials, the authenticator owns them.
+   *   If 0, any password is accepted.
+   * @param cache_ttl Seconds a successful check is remembered
+   * @param rate Failed logins allowed per second (per address and user)
+   * @param burst Failed logins allowed in a row (per address and user)
+   */
+  Authenticator (Credentials* store, size_t cache_ttl, double rate, double burst);
+
+  /** Destructor for Authenticator
+   * Deletes the credential store
+   */
+  ~Authenticator ();
+
+  /** Check a password given with USER/PASS
+   * @param address The address of the client
+   * @param user The name of the user
+   * @param password The password
+   * @param check Set to what must be checked if the result is Verifying
+   * @return The result of the check
+   */
+  Result pass (const std::string& address, const std::string& user,
+               const std::string& password, Check& check);
+
+  /** Record the outcome of a check made by Authenticator::verify
+   * @param check The check
+   * @param ok Did the password match the hash?
+   * @return The result of the login
+   */
+  Result verified (const Check& check, bool ok);
+
+  /** Check a password against a crypt(3) hash, on any thread
+   * @param check The check, see Authenticator::pass
+   * @param data Work space of crypt_r, of the calling thread
+   * @return A bool indicating if the password matches
+   */
+  static bool verify (const Check& check, struct crypt_data& data);
+
+  /** Check a digest given with APOP
+   * @param address The address of the client
+   * @param user The name of the user
+   * @param banner The timestamp the server sent in its greeting
+   * @param digest The MD5 digest of banner and the user's secret
+   * @return The result of the check
+   */
+  Result apop (const std::string& address, const std::string& user,
+               const std::string& banner, const std::string& digest);
+
+private:
+  Authenticator (const Authenticator&);
+  Authenticator& operator= (const Authenticator&);
+
+  /** Are logins for this address or user refused at the moment? */
+  bool throttled (const std::string& address, const std::string& user);
+
+  /** Record the outcome of a check
+   * @return The result to report
+   */
+  Result outcome (bool ok, const std::string& address, const std::string& user);
+
+  /** Remove buckets that are full again, they remember nothing */
+  void prune ();
+
+  /** Check a password against a secret that is not hashed, see
+   * Credentials */
+  static bool matches (const std::string& secret, const std::string& password);
+
+  /** Compare two strings in time that depends only on their sizes */
+  static bool equal (const std::string& a, const std::string& b);
+
+  Credentials* _store;
+
+  size_t _cache_ttl;
+
+  double _rate;
+  double _burst;
+
+  /* Key = user and digest of password, Value = when the entry expires */
+  std::map<std::string, double> _verified;
+
+  /* Buckets of failed logins, per address and per user */
+  std::map<std::string, TokenBucket> _address_buckets;
+  std::map<std::string, TokenBucket> _user_buckets;
+
+  /* When the maps were last pruned */
+  double _pruned;
+};
+
+/** A thread that checks passwords against their crypt(3) hashes for the
+ * manager. A hash is made to be slow, and the manager thread handles
+ * the commands of all sessions: it only queues the check here and
+ * finishes the login when the Verifier tells it the check is done
+ * (see Manager::verified). Meanwhile the client waits for its reply to
+ * PASS, the other sessions do not.
+ */
+class Verifier : public Dv::Thread::Thread
+{
+public:
+  /** Is told when a check is done */
+  class Listener
+  {
+  public:
+    virtual ~Listener () { }
+
+    /** Called by the Verifier thread, once or more for each check; the
+     * results are then taken with Verifier::take */
+    virtual void verified () = 0;
+  };
+
+  /** Constructor for Verifier
+   * @param listener Is told when a check is done
+   * @param debug_level only if the master debug level is larger
+   *   than this level will debug output be generated
+   * @param debug object (may be 0)
+   */
+  Verifier (Listener& listener, size_t debug_level, Dv::Debugable* debug);
+
+  /** Queue a check
+   * @param player The player whose login it is, only passed back
+   * @param check The check, see Authenticator::pass
+   */
+  void verify (Player* player, const Authenticator::Check& check);
+
+  /** Take the result of a check that is done
+   * @param player Set to the player of the check
+   * @param check Set to the check
+   * @param ok Set to whether the password matched
+   * @return false if no check is done
+   */
+  bool take (Player*& player, Authenticator::Check& check, bool& ok);
+
+  /** Stop the thread, checks that are still queued are not made */
+  void stop ();
+
+private:
+  Verifier (const Verifier&);
+  Verifier& operator= (const Verifier&);
+
+  int main ();
+
+  struct Job
+  {
+    Player* player;
+    Authenticator::Check check;
+    bool ok;
+  };
+
+  Listener& _listener;
+
+  Mutex _mutex;
+  /* Signalled when a check is queued or the thread stops */
+  Condition _ready;
+
+  std::deque<Job> _queue;
+  std::deque<Job> _done;
+
+  bool _stopping;
+};
+
+#endif	/* _AUTHENTICATOR_H */
@@ -14,6 +14,7 @@ Dv::Util::enum_parser<Command>::enum_table[] = {
   { PASS, "pass"},
   { STAT, "stat"},
   { QUIT, "quit"},
+  { ABORT, "abort"},
   { RETR, "retr"},
   { DELE, "dele"},
   { LIST, "list"},
@@ -21,6 +22,14 @@ Dv::Util::enum_parser<Command>::enum_table[] = {
   { UIDL, "uidl"},
   { TOP, "top"},
   { RSET, "rset"},
+  { APOP, "apop"},
+  { STATS, "stats"},
+  { CAPA, "capa"},
+  { XUIDL, "xuidl"},
+  { IDLE, "idle"},
+  { XMETA, "xmeta"},
+  { ADOPT, "adopt"},
+  { XADDR, "xaddr"},
   { SHUTDOWN, "shutdown"}
 };
 
@@ -17,6 +17,7 @@ enum Command
   PASS, /* Enter a password to log in */
   STAT, /* Get information of the messages in the player's maildrop */
   QUIT, /* The player disconnects */
+  ABORT, /* The player ends without updating its maildrop, e.g. on a timeout */
   RETR, /* Retrieve a message from the player's maildrop */
   DELE, /* Delete a message from the player's maildrop */
   LIST, /* List a/the message(s) in the player's maildrop */
@@ -24,6 +25,14 @@ enum Command
   UIDL, /* Get the uidl from a/the message(s) */
   TOP, /* Get the top n lines from a message */
   RSET, /* Unmark all messages as deleted */
+  APOP, /* Log in with a username and a digest of the password */
+  STATS, /* Show the metrics of the server */
+  CAPA, /* List the capabilities of the server (RFC 2449) */
+  XUIDL, /* Get the uidl of the messages added after a cursor */
+  IDLE, /* Wait for new mail, until the next command */
+  XMETA, /* Get the size, uidl and a summary of the headers of the messages */
+  ADOPT, /* Take over a session that another worker moved here */
+  XADDR, /* A director tells the address of its client */
   SHUTDOWN /* Shut down the server */
 };
 
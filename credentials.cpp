@@ -0,0 +1,163 @@
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "credentials.h"
+
+Credentials* Credentials::make (const std::string& kind, const std::string& path)
+{
+  if ( kind == "file" )
+    return new FileCredentials(path);
+  if ( kind == "cdb" )
+    return new CdbCredentials(path);
+  return 0;
+}
+
+FileCredentials::FileCredentials (const std::string& path) :
+_path (path), _mtime (0)
+{
+  load();
+  if ( _mtime == 0 )
+    throw std::runtime_error("unable to open credentials: " + _path);
+}
+
+void FileCredentials::load ()
+{
+  struct stat st;
+
+  if ( stat(_path.c_str(), &st) != 0 || st.st_mtime == _mtime )
+    return;
+
+  std::ifstream in_file(_path.c_str());
+  std::string line;
+
+  if ( !in_file.is_open() )
+    return;
+  _secrets.clear();
+  while ( getline(in_file, line) )
+    {
+      std::string::size_type colon(line.find(':'));
+
+      if ( line.empty() || line[0] == '#' || colon == std::string::npos )
+        continue;
+      _secrets[line.substr(0, colon)] = line.substr(colon + 1);
+    }
+  _mtime = st.st_mtime;
+}
+
+bool FileCredentials::lookup (const std::string& user, std::string& secret)
+{
+  load();
+
+  std::map<std::string, std::string>::const_iterator it(_secrets.find(user));
+
+  if ( it == _secrets.end() )
+    return false;
+  secret = it->second;
+  return true;
+}
+
+CdbCredentials::CdbCredentials (const std::string& path) :
+_path (path), _inode (0), _mtime (0), _data (0), _size (0)
+{
+  load();
+}
+
+CdbCredentials::~CdbCredentials ()
+{
+  if ( _data )
+    munmap(const_cast<unsigned char*> (_data), _size);
+}
+
+void CdbCredentials::load ()
+{
+  struct stat st;
+
+  if ( stat(_path.c_str(), &st) != 0 )
+    {
+      if ( _data )
+        return; // keep using the old one
+      throw std::runtime_error("unable to open credentials: " + _path);
+    }
+  if ( _data && st.st_ino == _inode && st.st_mtime == _mtime )
+    return;
+
+  int fd(open(_path.c_str(), O_RDONLY));
+  void* data(MAP_FAILED);
+
+  // A cdb file starts with a table of 256 hash table positions
+  if ( fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= 2048 )
+    data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if ( fd >= 0 )
+    close(fd);
+  if ( data == MAP_FAILED )
+    {
+      if ( _data )
+        return;
+      throw std::runtime_error("unable to open credentials: " + _path);
+    }
+
+  if ( _data )
+    munmap(const_cast<unsigned char*> (_data), _size);
+  _data = static_cast<const unsigned char*> (data);
+  _size = st.st_size;
+  _inode = st.st_ino;
+  _mtime = st.st_mtime;
+}
+
+unsigned int CdbCredentials::number (size_t pos) const
+{
+  return _data[pos] | (_data[pos + 1] << 8) | (_data[pos + 2] << 16)
+          | (static_cast<unsigned int> (_data[pos + 3]) << 24);
+}
+
+bool CdbCredentials::lookup (const std::string& user, std::string& secret)
+{
+  load();
+
+  unsigned int hash(5381);
+  for ( size_t i = 0; i < user.size(); i++ )
+    hash = ((hash << 5) + hash) ^ static_cast<unsigned char> (user[i]);
+
+  /* Each of the 256 hash tables is a (position, number of slots) pair.
+   * The bounds are checked by subtraction, a corrupt database must not
+   * make a sum wrap around */
+  size_t table(number((hash & 255) * 8));
+  size_t slots(number((hash & 255) * 8 + 4));
+
+  if ( slots == 0 || table > _size || slots > (_size - table) / 8 )
+    return false;
+
+  size_t slot((hash >> 8) % slots);
+  for ( size_t probe = 0; probe < slots; probe++ )
+    {
+      size_t pos(table + slot * 8);
+      size_t record(number(pos + 4));
+
+      // An empty slot ends the probe sequence
+      if ( record == 0 )
+        return false;
+      if ( number(pos) == hash && record <= _size && _size - record >= 8 )
+        {
+          size_t key_size(number(record));
+          size_t data_size(number(record + 4));
+          size_t left(_size - record - 8);
+
+          if ( key_size == user.size()
+               && key_size <= left && data_size <= left - key_size
+               && user.compare(0, key_size,
+                               reinterpret_cast<const char*> (_data + record + 8),
+                               key_size) == 0 )
+            {
+              secret.assign(reinterpret_cast<const char*> (_data + record + 8 + key_size),
+                            data_size);
+              return true;
+            }
+        }
+      slot = (slot + 1) % slots;
+    }
+  return false;
+}
@@ -0,0 +1,116 @@
+/*
+ * File:   credentials.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _CREDENTIALS_H
+#define	_CREDENTIALS_H
+
+#include <string>
+#include <map>
+#include <cstddef>
+#include <sys/types.h>
+
+/** A store of credentials: it maps a user name to a secret. A secret is
+ * either "{CRYPT}" followed by a crypt(3) hash, or "{PLAIN}" (or no
+ * prefix at all) followed by the password itself. Only users with a
+ * plain secret can use APOP.
+ */
+class Credentials
+{
+public:
+  virtual ~Credentials () { }
+
+  /** Find the secret of a user
+   * @param user The name of the user
+   * @param secret Set to the secret of the user if found
+   * @return A bool indicating if the user was found
+   */
+  virtual bool lookup (const std::string& user, std::string& secret) = 0;
+
+  /** Factory method to create a store from the configuration
+   * @param kind "file" or "cdb", anything else means no store
+   * @param path String representing the path to the store
+   * @return The new store, 0 if there is none
+   * @exception std::runtime_error If the store cannot be opened
+   */
+  static Credentials* make (const std::string& kind, const std::string& path);
+};
+
+/** Credentials kept in a text file with one "user:secret" line per user.
+ * Empty lines and lines starting with '#' are ignored. The file is
+ * read again when it changes.
+ */
+class FileCredentials : public Credentials
+{
+public:
+  /** Constructor for FileCredentials
+   * @param path String representing the path to the file
+   * @exception std::runtime_error If the file can't be opened
+   */
+  FileCredentials (const std::string& path);
+
+  bool lookup (const std::string& user, std::string& secret);
+
+private:
+  /** Read the file again if it has been modified */
+  void load ();
+
+  std::string _path;
+
+  /* Modification time of the file when it was read */
+  time_t _mtime;
+
+  /* Key = user name, Value = secret */
+  std::map<std::string, std::string> _secrets;
+};
+
+/** Credentials kept in a constant database (the cdb format of
+ * D. J. Bernstein) with the user name as key and the secret as data.
+ * A lookup costs two hashed probes in a memory mapped file, no matter
+ * how many users there are. The database is opened again when it is
+ * replaced (cdb files are rebuilt and renamed into place).
+ */
+class CdbCredentials : public Credentials
+{
+public:
+  /** Constructor for CdbCredentials
+   * @param path String representing the path to the database
+   * @exception std::runtime_error If the database can't be opened
+   */
+  CdbCredentials (const std::string& path);
+
+  /** Destructor for CdbCredentials
+   * Unmaps the database
+   */
+  ~CdbCredentials ();
+
+  bool lookup (const std::string& user, std::string& secret);
+
+private:
+  CdbCredentials (const CdbCredentials&);
+  CdbCredentials& operator= (const CdbCredentials&);
+
+  /** Map the database again if it has been replaced
+   * @exception std::runtime_error If the database can't be opened
+   */
+  void load ();
+
+  /**
+   * @param pos Offset in the database
+   * @return The 32 bit little endian number at pos
+   */
+  unsigned int number (size_t pos) const;
+
+  std::string _path;
+
+  /* Inode and modification time of the mapped database */
+  ino_t _inode;
+  time_t _mtime;
+
+  const unsigned char* _data;
+  size_t _size;
+};
+
+#endif	/* _CREDENTIALS_H */
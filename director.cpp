@@ -0,0 +1,624 @@
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+
+#include <dvutil/strings.h> // for Dv::String::trim
+
+#include "director.h"
+#include "tokenbucket.h"
+#include "logger.h"
+
+namespace
+{
+  // Octets moved by one splice
+  const size_t chunk(64 * 1024);
+
+  // Longest line a client may send before USER
+  const size_t line_limit(1024);
+
+  /**
+   * @return The numeric address of the peer of a socket, empty if
+   *   unknown
+   */
+  std::string peer_address (int fd)
+  {
+    struct sockaddr_storage peer;
+    socklen_t size(sizeof (peer));
+    char host[NI_MAXHOST];
+
+    if ( getpeername(fd, reinterpret_cast<sockaddr*> (&peer), &size) == 0
+         && getnameinfo(reinterpret_cast<sockaddr*> (&peer), size, host,
+                        sizeof (host), 0, 0, NI_NUMERICHOST) == 0 )
+      return host;
+    return "";
+  }
+}
+
+Director::HealthCheck::HealthCheck (Director& director, size_t interval,
+                                    size_t debug_level, Dv::Debugable* debug) :
+Dv::Thread::Thread (false, debug_level, debug), _director (director),
+_interval (interval ? interval : 1) { }
+
+int Director::HealthCheck::main ()
+{
+  while ( !killed() )
+    {
+      _director.check();
+      // Sleep in steps, so that killing the thread takes little time
+      for ( size_t i = 0; i < _interval * 10 && !killed(); i++ )
+        usleep(100000);
+    }
+  return 0;
+}
+
+Director::Director (const std::vector<int>& listeners, const std::string& backends,
+                    size_t vnodes, size_t interval, size_t timeout,
+                    size_t max_sessions, int shutdown, size_t debug_level,
+                    Dv::Debugable* debug) :
+Dv::Thread::Thread (false, debug_level, debug), _listeners (listeners),
+_ring (vnodes), _timeout (timeout), _max_sessions (max_sessions),
+_shutdown (shutdown), _epoll (epoll_create1 (EPOLL_CLOEXEC)),
+_health (*this, interval, debug_level, debug)
+{
+  if ( _epoll < 0 )
+    throw std::runtime_error(std::string("unable to create epoll: ") + strerror(errno));
+
+  std::istringstream iss(backends);
+  std::string spec;
+
+  while ( iss >> spec )
+    {
+      std::string::size_type slash(spec.find('/'));
+      size_t weight(slash == std::string::npos ? 1 : strtoul(spec.c_str() + slash + 1, 0, 10));
+      std::string name(spec.substr(0, slash));
+      std::string::size_type colon(name.rfind(':'));
+
+      if ( colon == std::string::npos )
+        throw std::runtime_error("backend without port: " + spec);
+
+      std::string host(name.substr(0, colon));
+      std::string port(name.substr(colon + 1));
+
+      if ( host.size() > 1 && host[0] == '[' && host[host.size() - 1] == ']' )
+        host = host.substr(1, host.size() - 2);
+
+      struct addrinfo hints;
+      struct addrinfo* result;
+
+      memset(&hints, 0, sizeof (hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      if ( getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 )
+        throw std::runtime_error("unable to resolve backend: " + spec);
+
+      Backend backend;
+
+      backend.name = name;
+      memcpy(&backend.address, result->ai_addr, result->ai_addrlen);
+      backend.length = result->ai_addrlen;
+      backend.up = true;
+      freeaddrinfo(result);
+      _backends.push_back(backend);
+      _ring.add(name, weight);
+    }
+
+  // The listening sockets are told apart by their number
+  _listening.resize(_listeners.size());
+  for ( size_t i = 0; i < _listeners.size(); i++ )
+    {
+      struct epoll_event event;
+
+      _listening[i].session = 0;
+      _listening[i].side = i;
+      event.events = EPOLLIN;
+      event.data.ptr = &_listening[i];
+      epoll_ctl(_epoll, EPOLL_CTL_ADD, _listeners[i], &event);
+    }
+
+  struct epoll_event event;
+
+  event.events = EPOLLIN;
+  event.data.ptr = 0;
+  epoll_ctl(_epoll, EPOLL_CTL_ADD, _shutdown, &event);
+  _health.start();
+}
+
+Director::~Director ()
+{
+  while ( !_sessions.empty() )
+    close_session(**_sessions.begin());
+  for ( size_t i = 0; i < _closed.size(); i++ )
+    delete _closed[i];
+  for ( size_t i = 0; i < _listeners.size(); i++ )
+    close(_listeners[i]);
+  close(_epoll);
+}
+
+int Director::main ()
+{
+  struct epoll_event events[64];
+
+  while ( !killed() )
+    {
+      int n(epoll_wait(_epoll, events, 64, 1000));
+
+      if ( n < 0 )
+        {
+          if ( errno == EINTR )
+            continue;
+          log() << "director: epoll: " << strerror(errno) << std::endl;
+          break;
+        }
+
+      bool stopping(false);
+
+      for ( int i = 0; i < n; i++ )
+        {
+          Endpoint* end(static_cast<Endpoint*> (events[i].data.ptr));
+
+          // The shutdown eventfd is never read
+          if ( !end )
+            stopping = true;
+          else if ( !end->session )
+            accept_all(_listeners[end->side]);
+          else if ( end->session->state != Closed )
+            handle(*end->session, end->side, events[i].events);
+        }
+      expire();
+      // No event refers to them any more
+      for ( size_t i = 0; i < _closed.size(); i++ )
+        delete _closed[i];
+      _closed.clear();
+      if ( stopping )
+        break;
+    }
+  _health.kill();
+  _health.join();
+  return 0;
+}
+
+void Director::accept_all (int listener)
+{
+  int fd;
+
+  while ( (fd = accept4(listener, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0 )
+    {
+      if ( _sessions.size() >= _max_sessions )
+        {
+          send_line(fd, "-ERR [SYS/TEMP] too many sessions, try again later");
+          close(fd);
+          continue;
+        }
+
+      Session* session(new Session);
+
+      session->fd[Client] = fd;
+      session->fd[Server] = -1;
+      session->address = peer_address(fd);
+      session->state = Authorizing;
+      session->backend = -1;
+      session->deadline = TokenBucket::now() + _timeout;
+      for ( int d = 0; d < 2; d++ )
+        {
+          session->pipe[d][0] = session->pipe[d][1] = -1;
+          session->pending[d] = 0;
+          session->eof[d] = false;
+          session->end[d].session = session;
+          session->end[d].side = d;
+        }
+      _sessions.insert(session);
+
+      struct epoll_event event;
+
+      event.events = EPOLLIN;
+      event.data.ptr = &session->end[Client];
+      epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event);
+      send_line(fd, "+OK POP3 director ready");
+    }
+  if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+       && errno != ECONNABORTED )
+    log() << "director: accept: " << strerror(errno) << std::endl;
+}
+
+void Director::handle (Session& session, int side, uint32_t events)
+{
+  if ( session.state == Relaying )
+    {
+      if ( !transfer(session, Client) || !transfer(session, Server)
+           || (session.eof[Client] && session.eof[Server]
+               && !session.pending[Client] && !session.pending[Server]) )
+        close_session(session);
+      else
+        watch(session);
+      return;
+    }
+  if ( side == Client )
+    {
+      // Before relaying, only a hangup is reported after USER
+      if ( session.state == Authorizing )
+        authorize(session);
+      else
+        close_session(session);
+      return;
+    }
+
+  int fd(session.fd[Server]);
+  std::string line;
+
+  switch (session.state)
+    {
+      case Connecting:
+        {
+          int error(0);
+          socklen_t length(sizeof (error));
+
+          if ( getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error )
+            unavailable(session);
+          else
+            {
+              session.state = Greeting;
+              watch(session);
+            }
+        }
+        break;
+      case Greeting:
+      case Forwarding:
+      case Answering:
+        if ( !receive(fd, session.reply) )
+          {
+            unavailable(session);
+            return;
+          }
+        if ( !take_line(session.reply, line) )
+          return;
+        if ( session.state == Greeting )
+          {
+            if ( line.compare(0, 3, "+OK") != 0 )
+              {
+                unavailable(session);
+                return;
+              }
+            // The backend limits and throttles by the client's address
+            send_line(fd, "XADDR " + session.address);
+            session.state = Forwarding;
+          }
+        else if ( session.state == Forwarding )
+          {
+            // After the prompt the backend writes before it reads
+            while ( line.compare(0, 2, "> ") == 0 )
+              line.erase(0, 2);
+            // Refused for the address, or the backend does not trust us
+            if ( line.compare(0, 3, "+OK") != 0 )
+              {
+                send_line(session.fd[Client], line);
+                close_session(session);
+                return;
+              }
+            send_line(fd, "USER " + session.user);
+            session.state = Answering;
+          }
+        else
+          {
+            // The reply is the client's, whatever it is
+            send_line(session.fd[Client], line);
+            relay(session);
+          }
+        break;
+      default:
+        break;
+    }
+}
+
+void Director::authorize (Session& session)
+{
+  int fd(session.fd[Client]);
+  std::string line;
+
+  if ( !receive(fd, session.input) )
+    {
+      close_session(session);
+      return;
+    }
+  while ( session.state == Authorizing && take_line(session.input, line) )
+    {
+      std::string::size_type space(line.find(' '));
+      std::string command(line.substr(0, space));
+      std::string argument(space == std::string::npos ? "" : line.substr(space + 1));
+
+      for ( size_t i = 0; i < command.size(); i++ )
+        command[i] = toupper(command[i]);
+      Dv::String::trim(argument);
+      if ( command == "USER" && !argument.empty() )
+        {
+          session.user = argument;
+          if ( !route(session) )
+            send_line(fd, "-ERR [SYS/TEMP] no mail server available, try again later");
+        }
+      else if ( command == "QUIT" )
+        {
+          send_line(fd, "+OK bye");
+          close_session(session);
+          return;
+        }
+      else if ( command == "CAPA" )
+        send_line(fd, "+OK\r\nUSER\r\nRESP-CODES\r\n.");
+      else if ( command == "APOP" )
+        send_line(fd, "-ERR APOP is not supported here, use USER");
+      else
+        send_line(fd, "-ERR use 'user <username>' first");
+    }
+  if ( session.state == Authorizing && session.input.size() > line_limit )
+    close_session(session);
+}
+
+bool Director::route (Session& session)
+{
+  int backend(_ring.lookup(session.user, usable()));
+
+  if ( backend < 0 )
+    return false;
+
+  int fd(connect_to(_backends[backend]));
+
+  if ( fd < 0 )
+    {
+      Logger::write(Logger::Error, Logger::Failure, 0,
+                    "unable to connect to " + _backends[backend].name);
+      return false;
+    }
+  session.backend = backend;
+  session.fd[Server] = fd;
+  session.state = Connecting;
+  session.deadline = TokenBucket::now() + _timeout;
+
+  struct epoll_event event;
+
+  event.events = EPOLLOUT;
+  event.data.ptr = &session.end[Server];
+  epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event);
+  watch(session);
+  return true;
+}
+
+void Director::relay (Session& session)
+{
+  for ( int d = 0; d < 2; d++ )
+    if ( pipe2(session.pipe[d], O_NONBLOCK | O_CLOEXEC) != 0 )
+      {
+        close_session(session);
+        return;
+      }
+  session.state = Relaying;
+  // What was sent ahead is passed on, it is short
+  if ( !session.input.empty() )
+    send(session.fd[Server], session.input.data(), session.input.size(), MSG_NOSIGNAL);
+  if ( !session.reply.empty() )
+    send(session.fd[Client], session.reply.data(), session.reply.size(), MSG_NOSIGNAL);
+  session.input.clear();
+  session.reply.clear();
+  watch(session);
+}
+
+bool Director::transfer (Session& session, int from)
+{
+  int to(1 - from);
+  ssize_t n;
+
+  if ( !session.pending[from] && !session.eof[from] )
+    {
+      n = splice(session.fd[from], 0, session.pipe[from][1], 0, chunk,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if ( n == 0 )
+        {
+          // The pipe is empty, the other side may see the end at once
+          session.eof[from] = true;
+          shutdown(session.fd[to], SHUT_WR);
+        }
+      else if ( n > 0 )
+        session.pending[from] = n;
+      else if ( errno != EAGAIN )
+        return false;
+    }
+  if ( session.pending[from] )
+    {
+      n = splice(session.pipe[from][0], 0, session.fd[to], 0, session.pending[from],
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if ( n > 0 )
+        session.pending[from] -= n;
+      else if ( n < 0 && errno != EAGAIN )
+        return false;
+    }
+  return true;
+}
+
+void Director::watch (Session& session)
+{
+  uint32_t events[2] = { 0, 0 };
+
+  switch (session.state)
+    {
+      case Authorizing:
+        events[Client] = EPOLLIN;
+        break;
+      case Connecting:
+        events[Server] = EPOLLOUT;
+        break;
+      case Greeting:
+      case Forwarding:
+      case Answering:
+        events[Server] = EPOLLIN;
+        break;
+      case Relaying:
+        // Read a side only once its pipe is empty
+        for ( int d = 0; d < 2; d++ )
+          {
+            if ( !session.pending[d] && !session.eof[d] )
+              events[d] |= EPOLLIN;
+            if ( session.pending[d] )
+              events[1 - d] |= EPOLLOUT;
+          }
+        break;
+      default:
+        return;
+    }
+  for ( int d = 0; d < 2; d++ )
+    if ( session.fd[d] >= 0 )
+      {
+        struct epoll_event event;
+
+        event.events = events[d];
+        event.data.ptr = &session.end[d];
+        epoll_ctl(_epoll, EPOLL_CTL_MOD, session.fd[d], &event);
+      }
+}
+
+void Director::close_session (Session& session)
+{
+  if ( session.state == Relaying )
+    Logger::write(Logger::Info, Logger::Close, 0,
+                  session.user + " via " + _backends[session.backend].name);
+  session.state = Closed;
+  for ( int d = 0; d < 2; d++ )
+    {
+      // Closing the sockets takes them out of the epoll set
+      if ( session.fd[d] >= 0 )
+        close(session.fd[d]);
+      if ( session.pipe[d][0] >= 0 )
+        close(session.pipe[d][0]);
+      if ( session.pipe[d][1] >= 0 )
+        close(session.pipe[d][1]);
+    }
+  _sessions.erase(&session);
+  _closed.push_back(&session);
+}
+
+void Director::unavailable (Session& session)
+{
+  Logger::write(Logger::Error, Logger::Failure, 0,
+                "backend " + _backends[session.backend].name + " did not answer");
+  send_line(session.fd[Client], "-ERR [SYS/TEMP] mail server unavailable, try again later");
+  close_session(session);
+}
+
+void Director::expire ()
+{
+  double now(TokenBucket::now());
+  std::vector<Session*> late;
+
+  for ( std::set<Session*>::iterator it = _sessions.begin(); it != _sessions.end(); ++it )
+    if ( (*it)->state != Relaying && (*it)->deadline < now )
+      late.push_back(*it);
+  for ( size_t i = 0; i < late.size(); i++ )
+    {
+      if ( late[i]->state == Authorizing )
+        close_session(*late[i]);
+      else
+        unavailable(*late[i]);
+    }
+}
+
+bool Director::receive (int fd, std::string& buffer)
+{
+  char data[4096];
+  ssize_t n(recv(fd, data, sizeof (data), 0));
+
+  if ( n > 0 )
+    buffer.append(data, n);
+  return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+}
+
+bool Director::take_line (std::string& buffer, std::string& line)
+{
+  std::string::size_type end(buffer.find('\n'));
+
+  if ( end == std::string::npos )
+    return false;
+  line = buffer.substr(0, end);
+  buffer.erase(0, end + 1);
+  if ( !line.empty() && line[line.size() - 1] == '\r' )
+    line.erase(line.size() - 1);
+  return true;
+}
+
+void Director::send_line (int fd, const std::string& line)
+{
+  std::string text(line + "\r\n");
+
+  send(fd, text.data(), text.size(), MSG_NOSIGNAL);
+}
+
+int Director::connect_to (const Backend& backend)
+{
+  int fd(socket(backend.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+
+  if ( fd < 0 )
+    return -1;
+  if ( connect(fd, reinterpret_cast<const sockaddr*> (&backend.address), backend.length) == 0
+       || errno == EINPROGRESS )
+    return fd;
+  close(fd);
+  return -1;
+}
+
+bool Director::probe (const Backend& backend)
+{
+  int fd(connect_to(backend));
+
+  if ( fd < 0 )
+    return false;
+
+  struct pollfd connected = { fd, POLLOUT, 0 };
+  int error(0);
+  socklen_t length(sizeof (error));
+  std::string greeting, line;
+  double deadline(TokenBucket::now() + _timeout);
+  bool up(false);
+
+  if ( poll(&connected, 1, _timeout * 1000) == 1
+       && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && !error )
+    {
+      struct pollfd readable = { fd, POLLIN, 0 };
+
+      while ( !take_line(greeting, line) && TokenBucket::now() < deadline
+              && poll(&readable, 1, 100) >= 0 )
+        if ( readable.revents && !receive(fd, greeting) )
+          break;
+      up = line.compare(0, 3, "+OK") == 0;
+      if ( up )
+        send_line(fd, "QUIT");
+    }
+  close(fd);
+  return up;
+}
+
+void Director::check ()
+{
+  for ( size_t i = 0; i < _backends.size(); i++ )
+    {
+      bool up(probe(_backends[i]));
+      Lock lock(_mutex);
+
+      if ( up != _backends[i].up )
+        Logger::write(Logger::Error, Logger::Failure, 0,
+                      "backend " + _backends[i].name + (up ? " is up" : " is down"));
+      _backends[i].up = up;
+    }
+}
+
+std::vector<bool> Director::usable ()
+{
+  Lock lock(_mutex);
+  std::vector<bool> up(_backends.size());
+
+  for ( size_t i = 0; i < _backends.size(); i++ )
+    up[i] = _backends[i].up;
+  return up;
+}
@@ -0,0 +1,245 @@
+/*
+ * File:   director.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _DIRECTOR_H
+#define	_DIRECTOR_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <cstddef>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <dvthread/thread.h>
+
+#include "sync.h"
+#include "hashring.h"
+
+/** A director sends each user to one of several backend pop3 servers,
+ * so that the maildrops can be spread over several mail stores.
+ *
+ * The director greets the client and answers until the client gives
+ * USER. The user's backend is found by consistent hashing of the name
+ * (see HashRing), skipping backends that are down. The director
+ * connects to the backend, tells it the address of the client (XADDR,
+ * which a backend only believes from the directors in its config),
+ * passes USER on, returns its reply, and from then on only relays the
+ * session: the octets go from one socket to the
+ * other through a pipe with splice(2), without being copied to the
+ * director. APOP is refused, since its digest covers the greeting of
+ * the backend, which the client never saw.
+ *
+ * A single thread runs all sessions with epoll, none blocks. A second
+ * thread checks every backend on a schedule: a backend is up when it
+ * accepts a connection and greets with +OK.
+ *
+ * The backends must be able to open the maildrops of the users they
+ * get, also those of a backend that is down, or these users cannot
+ * log in while it is.
+ */
+class Director : public Dv::Thread::Thread
+{
+public:
+  /** Constructor for Director
+   * @param listeners The listening sockets, non-blocking; the director
+   *   closes them
+   * @param backends The backends, separated by spaces, each as
+   *   host:port or host:port/weight (an IPv6 host in brackets)
+   * @param vnodes Points on the ring per unit of weight
+   * @param interval Seconds between two checks of a backend
+   * @param timeout Seconds a client has to give USER, and a backend to
+   *   connect and reply
+   * @param max_sessions Most sessions at once, others are refused
+   * @param shutdown file descriptor that becomes readable on shutdown
+   * @param debug_level only if the master debug level is larger
+   *   than this level will debug output be generated
+   * @param debug object (may be 0)
+   * @exception std::runtime_error If a backend cannot be resolved or
+   *   epoll cannot be set up
+   */
+  Director (const std::vector<int>& listeners, const std::string& backends,
+            size_t vnodes, size_t interval, size_t timeout, size_t max_sessions,
+            int shutdown, size_t debug_level, Dv::Debugable* debug);
+
+  /** Destructor for Director
+   * Closes the listening sockets and the sessions that are left
+   */
+  ~Director ();
+
+private:
+  Director (const Director&);
+  Director& operator= (const Director&);
+
+  /** A backend server */
+  struct Backend
+  {
+    /* host:port, as configured */
+    std::string name;
+    struct sockaddr_storage address;
+    socklen_t length;
+    bool up;
+  };
+
+  /** Checks the backends, see Director */
+  class HealthCheck : public Dv::Thread::Thread
+  {
+  public:
+    HealthCheck (Director& director, size_t interval, size_t debug_level,
+                 Dv::Debugable* debug);
+
+  private:
+    HealthCheck (const HealthCheck&);
+    HealthCheck& operator= (const HealthCheck&);
+
+    int main ();
+
+    Director& _director;
+    size_t _interval;
+  };
+
+  enum State
+  {
+    Authorizing, /* Waiting for USER */
+    Connecting, /* To the backend */
+    Greeting, /* Waiting for the greeting of the backend */
+    Forwarding, /* Waiting for the backend's reply to XADDR */
+    Answering, /* Waiting for the backend's reply to USER */
+    Relaying, /* Splicing both ways */
+    Closed /* Deleted after the events at hand */
+  };
+
+  /* The two sockets of a session, also the directions of relaying:
+   * from the socket of that side to the other one */
+  enum Side
+  {
+    Client,
+    Server
+  };
+
+  struct Session;
+
+  /** What an epoll event is about: a socket of a session, or a
+   * listening socket if session is 0 */
+  struct Endpoint
+  {
+    Session* session;
+    int side;
+  };
+
+  struct Session
+  {
+    int fd[2];
+    State state;
+    /* What the client sent before relaying */
+    std::string input;
+    /* What the backend sent before relaying */
+    std::string reply;
+    std::string user;
+    /* The numeric address of the client, told to the backend */
+    std::string address;
+    int backend;
+    /* Before relaying, the session is closed after this time */
+    double deadline;
+    /* The pipes of both directions, and the octets in each */
+    int pipe[2][2];
+    size_t pending[2];
+    /* Has the socket of a side reached its end? */
+    bool eof[2];
+    Endpoint end[2];
+  };
+
+  int main ();
+
+  /** Accept the connections waiting on a listening socket */
+  void accept_all (int listener);
+
+  /** Handle an event on a socket of a session */
+  void handle (Session& session, int side, uint32_t events);
+
+  /** Handle the command lines of a client, before USER */
+  void authorize (Session& session);
+
+  /** Connect to the backend of the user of a session
+   * @return false if no backend is up
+   */
+  bool route (Session& session);
+
+  /** Start relaying, the backend replied to USER */
+  void relay (Session& session);
+
+  /** Move what can be moved in one direction
+   * @param from The side that is read
+   * @return false if the session failed
+   */
+  bool transfer (Session& session, int from);
+
+  /** Tell epoll which events a session waits for */
+  void watch (Session& session);
+
+  /** Close a session, it is deleted later */
+  void close_session (Session& session);
+
+  /** Close the sessions that did not get to relaying in time */
+  void expire ();
+
+  /** Tell the client that its backend cannot be reached, and close
+   * the session */
+  void unavailable (Session& session);
+
+  /** Read what a socket has into a buffer
+   * @return false if the socket is closed or failed
+   */
+  static bool receive (int fd, std::string& buffer);
+
+  /** Take a line out of a buffer
+   * @param line Set to the line, without its line ending
+   * @return false if the buffer holds no whole line
+   */
+  static bool take_line (std::string& buffer, std::string& line);
+
+  /** Send a short line, the socket buffer holds it */
+  static void send_line (int fd, const std::string& line);
+
+  /** Start connecting to a backend
+   * @return A non-blocking socket, -1 if it failed at once
+   */
+  static int connect_to (const Backend& backend);
+
+  /** Is the backend up? Checks it, blocking, called by the HealthCheck */
+  bool probe (const Backend& backend);
+
+  /** Check all backends once, called by the HealthCheck */
+  void check ();
+
+  /**
+   * @return For each backend, is it up?
+   */
+  std::vector<bool> usable ();
+
+  std::vector<int> _listeners;
+  std::vector<Endpoint> _listening;
+
+  std::vector<Backend> _backends;
+  HashRing _ring;
+
+  size_t _timeout;
+  size_t _max_sessions;
+
+  int _shutdown;
+  int _epoll;
+
+  std::set<Session*> _sessions;
+  /* Closed during the events at hand */
+  std::vector<Session*> _closed;
+
+  /* Guards Backend::up */
+  Mutex _mutex;
+
+  HealthCheck _health;
+};
+
+#endif	/* _DIRECTOR_H */
@@ -0,0 +1,195 @@
+#include <cctype>
+#include <cmath>
+#include <sstream>
+#include <algorithm>
+
+#include "fairqueue.h"
+#include "tokenbucket.h"
+
+namespace
+{
+  // Cost of a command that has not been seen yet, about a status line
+  const double initial_cost(64);
+
+  // Weight of a new reply in the average cost of its command
+  const double weight(0.125);
+
+  // Seconds an idle flow keeps its statistics
+  const double idle_flow(300);
+}
+
+FairQueue::FairQueue (size_t quantum) :
+_quantum (quantum ? quantum : 1), _pruned (TokenBucket::now ()) { }
+
+void FairQueue::push (const std::string& flow, const Player::Message& message,
+                      Player::MailBox* mbox, unsigned long session,
+                      unsigned long sequence)
+{
+  Request request;
+
+  request.message = message;
+  request.mbox = mbox;
+  request.flow = flow;
+  request.pushed = TokenBucket::now();
+  request.session = session;
+  request.sequence = sequence;
+
+  std::istringstream iss(message.second);
+  iss >> request.command;
+  for ( size_t i = 0; i < request.command.size(); i++ )
+    request.command[i] = tolower(request.command[i]);
+
+  Lock lock(_mutex);
+  Flow& f(_flows[flow]);
+
+  if ( f.requests.empty() )
+    _round.push_back(flow);
+  f.requests.push_back(request);
+  f.most = std::max(f.most, f.requests.size());
+  f.active = request.pushed;
+}
+
+double FairQueue::cost (const std::string& command) const
+{
+  std::map<std::string, double>::const_iterator it(_costs.find(command));
+
+  return it == _costs.end() ? initial_cost : it->second;
+}
+
+bool FairQueue::pop (Request& request)
+{
+  Lock lock(_mutex);
+  // Flows passed over since a request was last taken
+  size_t skipped(0);
+
+  while ( !_round.empty() )
+    {
+      Flow& f(_flows[_round.front()]);
+      double c(cost(f.requests.front().command));
+
+      if ( !f.turn )
+        {
+          f.deficit += _quantum;
+          f.turn = true;
+        }
+      if ( c <= f.deficit )
+        {
+          f.deficit -= c;
+          request = f.requests.front();
+          f.requests.pop_front();
+          if ( f.requests.empty() )
+            {
+              // An idle flow saves nothing up
+              f.deficit = 0;
+              f.turn = false;
+              _round.pop_front();
+            }
+          prune(request.pushed);
+          return true;
+        }
+
+      // The flow's turn is over
+      f.turn = false;
+      _round.push_back(_round.front());
+      _round.pop_front();
+
+      // If no flow could afford its next request during a whole round,
+      // give all of them the quanta of the rounds it takes until one can.
+      if ( ++skipped == _round.size() )
+        {
+          double rounds(-1);
+
+          for ( size_t i = 0; i < _round.size(); i++ )
+            {
+              Flow& g(_flows[_round[i]]);
+              double needed(std::ceil((cost(g.requests.front().command) - g.deficit)
+                                      / _quantum) - 1);
+
+              if ( rounds < 0 || needed < rounds )
+                rounds = needed;
+            }
+          for ( size_t i = 0; i < _round.size(); i++ )
+            _flows[_round[i]].deficit += std::max(rounds, 0.0) * _quantum;
+          skipped = 0;
+        }
+    }
+  return false;
+}
+
+void FairQueue::charge (const Request& request, size_t octets, double now)
+{
+  Lock lock(_mutex);
+  std::map<std::string, double>::iterator it(_costs.find(request.command));
+
+  if ( it == _costs.end() )
+    _costs[request.command] = octets;
+  else
+    it->second += weight * (octets - it->second);
+
+  std::map<std::string, Flow>::iterator f(_flows.find(request.flow));
+
+  if ( f != _flows.end() )
+    {
+      f->second.served++;
+      f->second.octets += octets;
+      f->second.waited += now - request.pushed;
+      f->second.active = now;
+    }
+}
+
+void FairQueue::prune (double now)
+{
+  if ( now - _pruned < 60 )
+    return;
+  _pruned = now;
+
+  for ( std::map<std::string, Flow>::iterator it = _flows.begin();
+        it != _flows.end(); )
+    {
+      if ( it->second.requests.empty() && now - it->second.active > idle_flow )
+        _flows.erase(it++);
+      else
+        ++it;
+    }
+}
+
+std::string FairQueue::report (bool flows)
+{
+  Lock lock(_mutex);
+  std::ostringstream oss;
+  // The totals of all flows
+  size_t waiting(0), most(0);
+  unsigned long served(0), octets(0);
+  double waited(0);
+
+  for ( std::map<std::string, Flow>::const_iterator it = _flows.begin();
+        it != _flows.end(); ++it )
+    {
+      const Flow& f(it->second);
+      std::string prefix("queue." + it->first + ".");
+
+      waiting += f.requests.size();
+      most = std::max(most, f.most);
+      served += f.served;
+      octets += f.octets;
+      waited += f.waited;
+      if ( !flows )
+        continue;
+      oss << prefix << "waiting " << f.requests.size() << "\r\n"
+              << prefix << "most.waiting " << f.most << "\r\n"
+              << prefix << "served " << f.served << "\r\n"
+              << prefix << "octets " << f.octets << "\r\n"
+              << prefix << "wait.micros "
+              << static_cast<unsigned long> (f.waited * 1000000) << "\r\n";
+    }
+  if ( flows )
+    return oss.str();
+  oss << "queue.flows " << _flows.size() << "\r\n"
+          << "queue.waiting " << waiting << "\r\n"
+          << "queue.most.waiting " << most << "\r\n"
+          << "queue.served " << served << "\r\n"
+          << "queue.octets " << octets << "\r\n"
+          << "queue.wait.micros "
+          << static_cast<unsigned long> (waited * 1000000) << "\r\n";
+  return oss.str();
+}
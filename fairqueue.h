@@ -0,0 +1,138 @@
+/*
+ * File:   fairqueue.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _FAIRQUEUE_H
+#define	_FAIRQUEUE_H
+
+#include <string>
+#include <deque>
+#include <map>
+#include <cstddef>
+
+#include "player.h"
+#include "sync.h"
+
+/** The queue of requests waiting for the manager. Requests are grouped
+ * in flows, one per user (or per address before a user has logged in),
+ * and the flows are served by deficit round robin: each turn a flow
+ * receives a quantum of octets and may have requests handled as long
+ * as their estimated cost fits in what it has saved up. A user with a
+ * long backlog of RETR and LIST requests therefore cannot delay the
+ * NOOP or STAT of another user by more than one round.
+ *
+ * The cost of a request is the number of octets its reply is expected
+ * to take, a moving average of the replies to earlier requests with
+ * the same command.
+ *
+ * Players push requests, the manager thread pops them.
+ */
+class FairQueue
+{
+public:
+  /** A request waiting in the queue */
+  struct Request
+  {
+    Player::Message message;
+    Player::MailBox* mbox;
+    /* The command word, lowercase */
+    std::string command;
+    /* The flow the request belongs to */
+    std::string flow;
+    /* When the request was pushed */
+    double pushed;
+    /* The session and the number of the command in it, see Trace */
+    unsigned long session;
+    unsigned long sequence;
+  };
+
+  /** Constructor for FairQueue
+   * @param quantum Octets a flow receives each turn
+   */
+  FairQueue (size_t quantum);
+
+  /** Add a request to the queue
+   * @param flow The name of the flow
+   * @param message The request of the player
+   * @param mbox Mailbox for the reply, may be 0
+   * @param session The number of the player's session
+   * @param sequence The number of the command in the session
+   */
+  void push (const std::string& flow, const Player::Message& message,
+             Player::MailBox* mbox, unsigned long session = 0,
+             unsigned long sequence = 0);
+
+  /** Take the next request to handle
+   * @param request Set to the request
+   * @return false if the queue is empty
+   */
+  bool pop (Request& request);
+
+  /** Record the size of the reply to a request, this refines the
+   * cost of later requests with the same command
+   * @param request The request that was handled
+   * @param octets Size of its reply
+   * @param now When it was handled, see TokenBucket::now
+   */
+  void charge (const Request& request, size_t octets, double now);
+
+  /** The state of the flows, in the format of Metrics::report
+   * @param flows Report each flow? The names of the flows are those of
+   *   users and client addresses, they are not for the clients to see
+   * @return A line "queue.<flow>.<stat> value" for every statistic, or
+   *   "queue.<stat> value" for the totals of all flows
+   */
+  std::string report (bool flows = false);
+
+private:
+  FairQueue (const FairQueue&);
+  FairQueue& operator= (const FairQueue&);
+
+  struct Flow
+  {
+    Flow () : deficit (0), turn (false), most (0), served (0), octets (0),
+    waited (0), active (0) { }
+
+    std::deque<Request> requests;
+    /* Octets saved up, only while the flow has requests */
+    double deficit;
+    /* Has the flow received its quantum this turn? */
+    bool turn;
+    /* Largest number of requests that were waiting at once */
+    size_t most;
+    /* Totals of the handled requests */
+    unsigned long served;
+    unsigned long octets;
+    double waited;
+    /* When a request of the flow was last pushed or charged */
+    double active;
+  };
+
+  /** The expected cost of a request with this command, the queue is
+   * locked */
+  double cost (const std::string& command) const;
+
+  /** Forget flows that have been idle for a while, the queue is
+   * locked */
+  void prune (double now);
+
+  size_t _quantum;
+
+  /* Key = name of flow, Value = its requests and statistics */
+  std::map<std::string, Flow> _flows;
+
+  /* The flows with waiting requests, in the order they are served */
+  std::deque<std::string> _round;
+
+  /* Key = command word, Value = average size of its replies */
+  std::map<std::string, double> _costs;
+
+  /* When the flows were last pruned */
+  double _pruned;
+
+  Mutex _mutex;
+};
+
+#endif	/* _FAIRQUEUE_H */
@@ -0,0 +1,226 @@
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+
+#include "flightrecorder.h"
+#include "fairqueue.h"
+
+namespace
+{
+  // Storage time of this thread, see FlightRecorder::storage
+  __thread uint64_t storage_micros(0);
+  // Storage timers that are running in this thread
+  __thread unsigned int storage_depth(0);
+
+  /**
+   * @return Seconds the wall clock is ahead of CLOCK_MONOTONIC
+   */
+  double wall_offset ()
+  {
+    struct timespec real, monotonic;
+
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    return (real.tv_sec - monotonic.tv_sec) + (real.tv_nsec - monotonic.tv_nsec) / 1e9;
+  }
+
+  const double offset(wall_offset());
+
+  // Most slow commands listed in one dump
+  const size_t max_slow(100);
+
+  bool earlier (const FlightRecorder::Sample& a, const FlightRecorder::Sample& b)
+  {
+    return a.start < b.start;
+  }
+}
+
+FlightRecorder::Storage::Storage () : _begin (storage_depth++ ? 0 : now())
+{
+}
+
+FlightRecorder::Storage::~Storage ()
+{
+  if ( --storage_depth == 0 )
+    storage_micros += now() - _begin;
+}
+
+FlightRecorder::FlightRecorder (FairQueue& queue, const std::string& path,
+                                size_t size, size_t threshold, size_t window,
+                                size_t debug_level, Dv::Debugable* debug) :
+Dv::Thread::Thread (false, debug_level, debug), _queue (queue), _path (path),
+_slots (new Slot[size ? size : 1]), _size (size ? size : 1), _recorded (0),
+_threshold (threshold * 1000), _window (window), _stopping (false)
+{
+  for ( size_t i = 0; i < _size; i++ )
+    _slots[i].sequence = 0;
+}
+
+FlightRecorder::~FlightRecorder ()
+{
+  delete [] _slots;
+}
+
+uint64_t FlightRecorder::now ()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t> (ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+double FlightRecorder::wall (uint64_t monotonic)
+{
+  return offset + monotonic / 1e6;
+}
+
+uint32_t FlightRecorder::storage ()
+{
+  uint64_t micros(storage_micros);
+
+  storage_micros = 0;
+  return std::min(micros, static_cast<uint64_t> (0xffffffffUL));
+}
+
+void FlightRecorder::record (const Sample& sample)
+{
+  unsigned long n(__sync_fetch_and_add(&_recorded, 1));
+  Slot& slot(_slots[n % _size]);
+
+  // Readers ignore the slot while the sequence number is odd
+  __atomic_store_n(&slot.sequence, 2 * n + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot.sample = sample;
+  __atomic_store_n(&slot.sequence, 2 * n + 2, __ATOMIC_RELEASE);
+
+  if ( !_threshold || sample.total < _threshold )
+    return;
+
+  Lock lock(_mutex);
+
+  // The queue as it is right after the first slow command
+  if ( _slow.empty() )
+    _snapshot = _queue.report(true);
+  if ( _slow.size() < max_slow )
+    _slow.push_back(sample);
+  _ready.signal();
+}
+
+void FlightRecorder::stop ()
+{
+  Lock lock(_mutex);
+
+  _stopping = true;
+  _ready.broadcast();
+}
+
+int FlightRecorder::main ()
+{
+  while ( true )
+    {
+      {
+        Lock lock(_mutex);
+
+        while ( _slow.empty() && !_stopping )
+          _ready.wait(_mutex);
+        if ( _slow.empty() )
+          return 0;
+      }
+
+      // Let the commands after the slow one finish, unless stopping
+      struct timespec pause = { 0, 100000000 };
+
+      for ( double waited = 0; waited < _window; waited += 0.1 )
+        {
+          {
+            Lock lock(_mutex);
+
+            if ( _stopping )
+              break;
+          }
+          nanosleep(&pause, 0);
+        }
+      dump();
+    }
+}
+
+void FlightRecorder::dump ()
+{
+  std::vector<Sample> slow;
+  std::string snapshot;
+  {
+    Lock lock(_mutex);
+
+    slow.swap(_slow);
+    snapshot.swap(_snapshot);
+  }
+  snapshot.erase(std::remove(snapshot.begin(), snapshot.end(), '\r'), snapshot.end());
+
+  double from(slow.front().start), to(slow.front().start);
+
+  for ( size_t i = 0; i < slow.size(); i++ )
+    {
+      from = std::min(from, slow[i].start);
+      to = std::max(to, slow[i].start + slow[i].total / 1e6);
+    }
+  from -= _window;
+  to += _window;
+
+  // Copy the samples in the window, skipping those being overwritten
+  std::vector<Sample> samples;
+  unsigned long recorded(__atomic_load_n(&_recorded, __ATOMIC_ACQUIRE));
+  unsigned long first(recorded > _size ? recorded - _size : 0);
+
+  for ( unsigned long n = first; n < recorded; n++ )
+    {
+      const Slot& slot(_slots[n % _size]);
+      unsigned long sequence(__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE));
+      Sample sample(slot.sample);
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if ( sequence != 2 * n + 2
+           || __atomic_load_n(&slot.sequence, __ATOMIC_RELAXED) != sequence )
+        continue;
+      if ( sample.start >= from && sample.start <= to )
+        samples.push_back(sample);
+    }
+  std::sort(samples.begin(), samples.end(), earlier);
+
+  std::ofstream out(_path.c_str(), std::ios_base::app);
+
+  if ( !out )
+    {
+      log() << "flight recorder: unable to write " << _path << std::endl;
+      return;
+    }
+
+  char line[256];
+  char stamp[64];
+  struct tm tm;
+  time_t seconds;
+
+  seconds = static_cast<time_t> (slow.front().start);
+  localtime_r(&seconds, &tm);
+  strftime(stamp, sizeof (stamp), "%Y-%m-%d %H:%M:%S", &tm);
+  out << "=== " << slow.size() << " slow command(s) from " << stamp
+          << ", threshold " << _threshold / 1000 << " ms\n"
+          << "--- queue\n" << snapshot
+          << "--- commands (micros, * = slow)\n"
+          << "time session/command verb total queue manager storage reply bytes\n";
+  for ( size_t i = 0; i < samples.size(); i++ )
+    {
+      const Sample& s(samples[i]);
+
+      seconds = static_cast<time_t> (s.start);
+      localtime_r(&seconds, &tm);
+      strftime(stamp, sizeof (stamp), "%H:%M:%S", &tm);
+      snprintf(line, sizeof (line), "%s.%06ld #%lu/%lu %.8s %u %u %u %u %u %llu%s\n",
+               stamp, static_cast<long> ((s.start - seconds) * 1e6), s.session,
+               s.command, s.verb, s.total, s.queue, s.manager, s.storage, s.reply,
+               static_cast<unsigned long long> (s.bytes),
+               s.total >= _threshold ? " *" : "");
+      out << line;
+    }
+}
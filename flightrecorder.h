@@ -0,0 +1,169 @@
+/*
+ * File:   flightrecorder.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _FLIGHTRECORDER_H
+#define	_FLIGHTRECORDER_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include <dvthread/thread.h>
+
+#include "sync.h"
+
+class FairQueue;
+
+/** Keeps the timings of the most recent commands, always, so that a
+ * command that is slow can be explained afterwards.
+ *
+ * Each command that a player executes leaves a Sample in a ring that
+ * all threads share: a slot is claimed with a single atomic addition
+ * and guarded by a sequence number, so recording takes no lock. When a
+ * command takes longer than the threshold, the recorder notes the state
+ * of the manager's queue at once; a while later its thread writes all
+ * samples from the window around the slow command to the flight file.
+ * Further slow commands in that window are part of the same dump.
+ */
+class FlightRecorder : public Dv::Thread::Thread
+{
+public:
+  /** The timing of a command, in microseconds */
+  struct Sample
+  {
+    /* When the command line was read, seconds since the epoch */
+    double start;
+    unsigned long session;
+    unsigned long command;
+    /* The command word, without arguments */
+    char verb[8];
+    /* From queueing the command to flushing the reply */
+    uint32_t total;
+    /* Waiting in the manager's queue */
+    uint32_t queue;
+    /* Handling by the manager, storage included */
+    uint32_t manager;
+    /* From the manager's reply to flushing it: the player waking up
+     * and writing, storage included */
+    uint32_t reply;
+    /* Spent in storage calls, see FlightRecorder::Storage: those of
+     * the manager (see Player::timed) and those of the player, each
+     * thread counts its own */
+    uint32_t storage;
+    /* Octets written to the client */
+    uint64_t bytes;
+  };
+
+  /** Measures a storage call, e.g. opening a maildrop or reading a
+   * message file: its time is added to the storage time of the thread
+   * (see FlightRecorder::storage). A Storage within another one adds
+   * nothing, the outer one already counts its time.
+   */
+  class Storage
+  {
+  public:
+    Storage ();
+
+    ~Storage ();
+
+  private:
+    Storage (const Storage&);
+    Storage& operator= (const Storage&);
+
+    uint64_t _begin;
+  };
+
+  /** Constructor for FlightRecorder
+   * @param queue The manager's queue, its state is noted when a
+   *   command is slow
+   * @param path String representing the path to the flight file,
+   *   dumps are appended to it
+   * @param size Number of samples in the ring
+   * @param threshold Millisecs a command may take before it is
+   *   dumped, 0 to never dump
+   * @param window Seconds before and after a slow command that are
+   *   dumped
+   * @param debug_level only if the master debug level is larger
+   *   than this level will debug output be generated
+   * @param debug object (may be 0)
+   */
+  FlightRecorder (FairQueue& queue, const std::string& path, size_t size,
+                  size_t threshold, size_t window, size_t debug_level,
+                  Dv::Debugable* debug);
+
+  /** Destructor for FlightRecorder
+   * Frees the ring
+   */
+  ~FlightRecorder ();
+
+  /** Record the timing of a command, may be called by any thread
+   * @param sample The timing
+   */
+  void record (const Sample& sample);
+
+  /** Take the storage time of this thread since the last call
+   * @return Microseconds spent in storage calls
+   */
+  static uint32_t storage ();
+
+  /**
+   * @return The time in microseconds, from CLOCK_MONOTONIC
+   */
+  static uint64_t now ();
+
+  /** The wall clock time of a time from now, without reading the wall
+   * clock: it is offset by the difference between the clocks when the
+   * server started
+   * @param monotonic Microseconds, see FlightRecorder::now
+   * @return Seconds since the epoch
+   */
+  static double wall (uint64_t monotonic);
+
+  /** Stop the thread, a dump that is pending is written first */
+  void stop ();
+
+private:
+  FlightRecorder (const FlightRecorder&);
+  FlightRecorder& operator= (const FlightRecorder&);
+
+  /** A slot of the ring: the sequence number is odd while the sample
+   * is written, and tells which sample it holds */
+  struct Slot
+  {
+    unsigned long sequence;
+    Sample sample;
+  };
+
+  int main ();
+
+  /** Append the samples around the slow commands to the flight file */
+  void dump ();
+
+  FairQueue& _queue;
+  std::string _path;
+
+  Slot* _slots;
+  size_t _size;
+  /* Number of samples recorded */
+  unsigned long _recorded;
+
+  uint32_t _threshold;
+  double _window;
+
+  Mutex _mutex;
+  /* Signalled when a command is slow or the thread stops */
+  Condition _ready;
+
+  /* The slow commands of the pending dump */
+  std::vector<Sample> _slow;
+  /* The state of the queue when the first of them finished */
+  std::string _snapshot;
+
+  bool _stopping;
+};
+
+#endif	/* _FLIGHTRECORDER_H */
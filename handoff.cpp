@@ -0,0 +1,185 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+namespace
+{
+  /** Fill in the address of a Unix socket
+   * @return false if the path is too long
+   */
+  bool unix_address (const std::string& path, struct sockaddr_un& addr)
+  {
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    if ( path.size() >= sizeof (addr.sun_path) )
+      return false;
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+  }
+
+  // Millisecs a handover may take, the other side is a local process
+  const int handoff_timeout(5000);
+}
+
+Handoff::Handoff (const std::string& path) : _path (path), _fd (-1), _given (false)
+{
+  if ( _path.empty() )
+    return;
+
+  struct sockaddr_un addr;
+
+  if ( !unix_address(_path, addr) )
+    throw std::runtime_error("handoff path too long: " + _path);
+  _fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  // An old server that handed over no longer accepts at the path
+  unlink(_path.c_str());
+
+  // Only the user of the server may connect, see Handoff::give
+  mode_t mask(umask(0077));
+  bool bound(_fd >= 0 && bind(_fd, reinterpret_cast<sockaddr*> (&addr), sizeof (addr)) == 0);
+
+  umask(mask);
+  if ( !bound || listen(_fd, 1) != 0 )
+    {
+      std::string error(strerror(errno));
+
+      if ( _fd >= 0 )
+        close(_fd);
+      throw std::runtime_error("unable to listen at " + _path + ": " + error);
+    }
+}
+
+Handoff::~Handoff ()
+{
+  if ( _fd < 0 )
+    return;
+  close(_fd);
+  if ( !_given )
+    unlink(_path.c_str());
+}
+
+void Handoff::forget ()
+{
+  if ( _fd >= 0 )
+    close(_fd);
+  _fd = -1;
+  _given = true;
+}
+
+bool Handoff::give (const std::vector<int>& sockets)
+{
+  int fd(accept4(_fd, 0, 0, SOCK_CLOEXEC));
+  struct ucred peer;
+  socklen_t length(sizeof (peer));
+
+  // The sockets are never given to another user
+  if ( fd < 0 || sockets.empty() || sockets.size() > MaxSockets
+       || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0
+       || peer.uid != geteuid() )
+    {
+      if ( fd >= 0 )
+        close(fd);
+      return false;
+    }
+
+  // The number of sockets goes along, the descriptors in the control data
+  unsigned char count(sockets.size());
+  struct iovec iov = { &count, sizeof (count) };
+  char control[CMSG_SPACE(MaxSockets * sizeof (int))];
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof (msg));
+  memset(control, 0, sizeof (control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sockets.size() * sizeof (int));
+
+  struct cmsghdr* cmsg(CMSG_FIRSTHDR(&msg));
+
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sockets.size() * sizeof (int));
+  memcpy(CMSG_DATA(cmsg), &sockets[0], sockets.size() * sizeof (int));
+
+  bool sent(sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof (count));
+
+  // The new server says it has them, so that no connection is lost
+  struct pollfd ack = { fd, POLLIN, 0 };
+  char ok(0);
+
+  sent = sent && poll(&ack, 1, handoff_timeout) == 1
+          && read(fd, &ok, sizeof (ok)) == sizeof (ok) && ok == '+';
+  close(fd);
+  if ( sent )
+    {
+      // The new server listens at the path from now on
+      close(_fd);
+      _fd = -1;
+      _given = true;
+    }
+  return sent;
+}
+
+bool Handoff::take (const std::string& path, std::vector<int>& sockets)
+{
+  struct sockaddr_un addr;
+  int fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+
+  if ( fd < 0 || !unix_address(path, addr)
+       || connect(fd, reinterpret_cast<sockaddr*> (&addr), sizeof (addr)) != 0 )
+    {
+      if ( fd >= 0 )
+        close(fd);
+      return false;
+    }
+
+  unsigned char count(0);
+  struct iovec iov = { &count, sizeof (count) };
+  char control[CMSG_SPACE(MaxSockets * sizeof (int))];
+  struct msghdr msg;
+  struct pollfd ready = { fd, POLLIN, 0 };
+
+  memset(&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+  if ( poll(&ready, 1, handoff_timeout) != 1
+       || recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof (count) )
+    {
+      close(fd);
+      return false;
+    }
+
+  size_t before(sockets.size());
+
+  for ( struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg) )
+    if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS )
+      {
+        size_t n((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int));
+        const int* fds(reinterpret_cast<const int*> (CMSG_DATA(cmsg)));
+
+        sockets.insert(sockets.end(), fds, fds + n);
+      }
+
+  char ok('+');
+  bool taken(sockets.size() - before == count
+             && write(fd, &ok, sizeof (ok)) == sizeof (ok));
+
+  close(fd);
+  if ( !taken )
+    {
+      for ( size_t i = before; i < sockets.size(); i++ )
+        close(sockets[i]);
+      sockets.resize(before);
+    }
+  return taken;
+}
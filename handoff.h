@@ -0,0 +1,91 @@
+/*
+ * File:   handoff.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _HANDOFF_H
+#define	_HANDOFF_H
+
+#include <string>
+#include <vector>
+
+/** Hands the listening sockets over from a running server to a new one,
+ * so that the server can be restarted without ever refusing a
+ * connection.
+ *
+ * A running server listens on a Unix socket at a fixed path. A new
+ * server first connects to it: if the old one is there, it sends its
+ * listening sockets over the connection (SCM_RIGHTS), stops accepting
+ * and drains its sessions (see pop3server.cpp). Connections that wait
+ * in the listen queues are accepted by the new server, which then
+ * listens at the path in turn.
+ *
+ * Whoever gets the listening sockets serves the clients, so the socket
+ * is only for the user the server runs as: it is created with mode
+ * 0600 (its directory must not let others replace it), and a peer
+ * running as another user is refused.
+ *
+ * The caches that make a maildrop quick to open (the uidlog, the header
+ * cache and the wire forms) are files, so the new server finds them
+ * warm as well.
+ */
+class Handoff
+{
+public:
+  /** Constructor for Handoff, listens at the path for a new server;
+   * whatever was there before is removed
+   * @param path String representing the path of the Unix socket,
+   *   "" to never hand over
+   * @exception std::runtime_error If the socket cannot be set up
+   */
+  Handoff (const std::string& path);
+
+  /** Destructor for Handoff
+   * Removes the socket, unless the sockets were handed over (the path
+   * then belongs to the new server)
+   */
+  ~Handoff ();
+
+  /**
+   * @return The listening Unix socket, readable when a new server
+   *   connects; -1 if there is none
+   */
+  int fd () const
+  {
+    return _fd;
+  }
+
+  /** Hand the listening sockets over to a new server that connected
+   * @param sockets The listening sockets, they stay open here
+   * @return false if no new server was waiting or it went away
+   */
+  bool give (const std::vector<int>& sockets);
+
+  /** Take the listening sockets over from a running server
+   * @param path String representing the path of its Unix socket
+   * @param sockets The sockets are appended to this
+   * @return false if no server listens at the path
+   */
+  static bool take (const std::string& path, std::vector<int>& sockets);
+
+  /** Close the listening Unix socket, in a child process that
+   * inherited it */
+  void forget ();
+
+private:
+  Handoff (const Handoff&);
+  Handoff& operator= (const Handoff&);
+
+  /* Most sockets handed over at once */
+  enum { MaxSockets = 64 };
+
+  std::string _path;
+
+  int _fd;
+
+  /* Were the sockets handed over? */
+  bool _given;
+};
+
+#endif	/* _HANDOFF_H */
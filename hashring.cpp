@@ -0,0 +1,48 @@
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+#include "hashring.h"
+#include "md5.h"
+
+HashRing::HashRing (size_t vnodes) : _vnodes (vnodes ? vnodes : 1), _backends (0) { }
+
+uint64_t HashRing::point (const std::string& text)
+{
+  // The first 64 bits of the digest
+  return strtoull(md5_hex(text).substr(0, 16).c_str(), 0, 16);
+}
+
+void HashRing::add (const std::string& name, size_t weight)
+{
+  int backend(_backends++);
+
+  for ( size_t i = 0; i < weight * _vnodes; i++ )
+    {
+      std::ostringstream oss;
+
+      oss << name << "#" << i;
+      _points.push_back(std::make_pair(point(oss.str()), backend));
+    }
+  std::sort(_points.begin(), _points.end());
+}
+
+int HashRing::lookup (const std::string& key, const std::vector<bool>& usable) const
+{
+  if ( _points.empty() )
+    return -1;
+
+  std::vector<std::pair<uint64_t, int> >::const_iterator it
+          (std::lower_bound(_points.begin(), _points.end(),
+                            std::make_pair(point(key), -1)));
+
+  // Walk around the ring to the first point of a usable backend
+  for ( size_t i = 0; i < _points.size(); i++, it++ )
+    {
+      if ( it == _points.end() )
+        it = _points.begin();
+      if ( static_cast<size_t> (it->second) < usable.size() && usable[it->second] )
+        return it->second;
+    }
+  return -1;
+}
@@ -0,0 +1,66 @@
+/*
+ * File:   hashring.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _HASHRING_H
+#define	_HASHRING_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <stdint.h>
+
+/** Consistent hashing of user names onto backends (see Director).
+ *
+ * Every backend has a number of points on a ring of 64 bit hashes, in
+ * proportion to its weight. A user belongs to the first point at or
+ * after the hash of its name. Adding or removing a backend therefore
+ * only moves the users of its own points; a backend that is down is
+ * skipped, its users go to the next points on the ring.
+ */
+class HashRing
+{
+public:
+  /** Constructor for HashRing
+   * @param vnodes Points on the ring per unit of weight
+   */
+  HashRing (size_t vnodes);
+
+  /** Add a backend, it gets the next number (from 0)
+   * @param name Identifies the backend, e.g. "host:port"; its points
+   *   depend on it alone, not on the other backends
+   * @param weight Its share of the users, relative to the others
+   */
+  void add (const std::string& name, size_t weight);
+
+  /** Find the backend of a user
+   * @param key The name of the user
+   * @param usable For each backend, may it be chosen?
+   * @return The number of the backend, -1 if none is usable
+   */
+  int lookup (const std::string& key, const std::vector<bool>& usable) const;
+
+  /**
+   * @return The number of backends
+   */
+  size_t size () const
+  {
+    return _backends;
+  }
+
+private:
+  /** The position of a text on the ring, from its MD5 digest */
+  static uint64_t point (const std::string& text);
+
+  size_t _vnodes;
+
+  size_t _backends;
+
+  /* The points, sorted, each with the number of its backend */
+  std::vector<std::pair<uint64_t, int> > _points;
+};
+
+#endif	/* _HASHRING_H */
@@ -0,0 +1,171 @@
+/*
+ * File:   indexbench.cpp
+ * Author: Wouter Van Rossem
+ *
+ * Measures the memory a Maildrop takes for its index, and compares it
+ * with the layout it replaced: a heap object per message, with a vtable
+ * and the full path of its file, and a vector of pointers to them.
+ *
+ * Without a folder, a Maildir with the given number of messages is
+ * made in /tmp (some names with octets above 0x7f, which must be found
+ * like the others) and removed afterwards.
+ *
+ *   indexbench [messages [folder]]
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "maildrop.h"
+
+/** A message as it was kept before the name pool */
+class OldMessage
+{
+public:
+  OldMessage (unsigned int number, const std::string& file_path) :
+  _number (number), _deleted (false), _file_path (file_path), _size (0) { }
+
+  virtual ~OldMessage () { }
+
+private:
+  unsigned int _number;
+  bool _deleted;
+  std::string _file_path;
+  mutable unsigned long _size;
+};
+
+/**
+ * @return Octets allocated on the heap
+ */
+static size_t
+heap ()
+{
+  struct mallinfo2 info(mallinfo2());
+
+  return info.uordblks + info.hblkhd;
+}
+
+/**
+ * @return Seconds since some fixed time
+ */
+static double
+seconds ()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Make up the names of the messages in a Maildir, "new/" and "cur/"
+ * @param messages The number of messages
+ * @return Their names, relative to the folder
+ */
+static std::vector<std::string>
+make_names (size_t messages)
+{
+  std::vector<std::string> names;
+
+  for ( size_t i = 0; i < messages; i++ )
+    {
+      std::ostringstream oss;
+
+      // Some names sort by an octet above 0x7f
+      oss << (i % 2 ? "cur/" : "new/") << 1700000000 + i / 100
+              << (i % 10 == 0 ? ".\xc3\xa9M" : ".M") << i << "P" << getpid()
+              << ".host,S=4096" << (i % 2 ? ":2,S" : "");
+      names.push_back(oss.str());
+    }
+  return names;
+}
+
+int
+main (int argc, char* argv[])
+{
+  size_t messages(argc > 1 ? atoi(argv[1]) : 100000);
+  std::string folder(argc > 2 ? argv[2] : "");
+  std::vector<std::string> names;
+
+  if ( folder.empty() )
+    {
+      char tmp[] = "/tmp/indexbenchXXXXXX";
+
+      if ( !mkdtemp(tmp) )
+        {
+          std::cerr << "indexbench: unable to make a folder" << std::endl;
+          return 1;
+        }
+      folder = std::string(tmp) + "/";
+      mkdir((folder + "new").c_str(), 0700);
+      mkdir((folder + "cur").c_str(), 0700);
+      mkdir((folder + "tmp").c_str(), 0700);
+      names = make_names(messages);
+      for ( size_t i = 0; i < names.size(); i++ )
+        close(open((folder + names[i]).c_str(), O_WRONLY | O_CREAT, 0600));
+    }
+
+  size_t before(heap());
+  double begin(seconds());
+  Maildrop* maildrop(new Maildrop(folder));
+  double opened(seconds());
+  size_t index(heap() - before);
+  size_t count(maildrop->nr_of_messages());
+
+  // Every unique name in the log must be found again
+  std::vector<int> numbers;
+  std::string next;
+  bool found(maildrop->added_since("", numbers, next) && numbers.size() == count);
+
+  delete maildrop;
+
+  // The old layout, with the same paths
+  std::vector<std::string> paths(make_names(count));
+
+  before = heap();
+
+  std::vector<OldMessage*> old;
+
+  for ( size_t i = 0; i < paths.size(); i++ )
+    old.push_back(new OldMessage(i, folder + paths[i]));
+
+  size_t old_index(heap() - before);
+
+  for ( size_t i = 0; i < old.size(); i++ )
+    delete old[i];
+
+  if ( !names.empty() )
+    {
+      for ( size_t i = 0; i < names.size(); i++ )
+        unlink((folder + names[i]).c_str());
+      unlink((folder + ".uidlog").c_str());
+      rmdir((folder + "new").c_str());
+      rmdir((folder + "cur").c_str());
+      rmdir((folder + "tmp").c_str());
+      rmdir(folder.c_str());
+    }
+
+  std::cout << std::fixed << std::setprecision(1)
+          << count << " messages, opened in " << (opened - begin) * 1000 << " ms\n"
+          << "index: " << index / 1048576.0 << " MB ("
+          << index / std::max(count, static_cast<size_t> (1)) << " octets a message)\n"
+          << "old layout: " << old_index / 1048576.0 << " MB ("
+          << old_index / std::max(count, static_cast<size_t> (1)) << " octets a message)"
+          << std::endl;
+  if ( !found )
+    {
+      std::cerr << "indexbench: not every message was found by its unique name" << std::endl;
+      return 1;
+    }
+  return 0;
+}
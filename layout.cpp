@@ -0,0 +1,71 @@
+#include <sys/stat.h>
+
+#include "layout.h"
+#include "md5.h"
+
+Layout::Layout (const std::string& top, size_t levels, size_t width,
+                size_t cache_size) :
+_top (top), _levels (levels), _width (width ? width : 2),
+_cache_size (cache_size)
+{
+  if ( _top.empty() || _top[_top.size() - 1] != '/' )
+    _top += '/';
+  // An MD5 digest has 32 digits
+  if ( _levels * _width > 32 )
+    _levels = 32 / _width;
+}
+
+bool Layout::valid (const std::string& user)
+{
+  return !user.empty() && user[0] != '.'
+          && user.find('/') == std::string::npos
+          && user.find('\0') == std::string::npos;
+}
+
+bool Layout::level (const std::string& name) const
+{
+  if ( _levels == 0 || name.size() != _width )
+    return false;
+  return name.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
+
+std::string Layout::directory (const std::string& user) const
+{
+  std::string path(_top);
+
+  if ( _levels )
+    {
+      std::string digest(md5_hex(user));
+
+      for ( size_t i = 0; i < _levels; i++ )
+        path += digest.substr(i * _width, _width) + "/";
+    }
+  return path + user + "/";
+}
+
+bool Layout::resolve (const std::string& user, std::string& path)
+{
+  if ( !valid(user) )
+    return false;
+
+  std::map<std::string, std::string>::const_iterator it(_cache.find(user));
+
+  if ( it != _cache.end() )
+    {
+      path = it->second;
+      return true;
+    }
+
+  struct stat st;
+  std::string dir(directory(user));
+
+  // Users without a maildrop are not remembered, they may get one
+  if ( stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) )
+    return false;
+  if ( _cache.size() >= _cache_size )
+    _cache.clear();
+  if ( _cache_size )
+    _cache[user] = dir;
+  path = dir;
+  return true;
+}
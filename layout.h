@@ -0,0 +1,85 @@
+/*
+ * File:   layout.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _LAYOUT_H
+#define	_LAYOUT_H
+
+#include <string>
+#include <map>
+#include <cstddef>
+
+/** Where the maildrop of a user is located under the top directory.
+ *
+ * With a million users in a single directory, every lookup searches a
+ * huge directory and the kernel has to cache all of its entries. The
+ * maildrops are therefore spread over levels of directories named after
+ * the MD5 digest of the user name: with 2 levels of width 2, the maildrop
+ * of "alice" is top/63/84/alice/. With 0 levels, the layout is flat:
+ * top/alice/.
+ *
+ * The maildrops that were found are remembered, a later login of the same
+ * user does not look them up again. The cache is simply emptied when it
+ * is full.
+ *
+ * A Layout is used by the manager thread only.
+ */
+class Layout
+{
+public:
+  /** Constructor for Layout
+   * @param top String representing the top directory
+   * @param levels Number of levels of directories above a maildrop
+   * @param width Number of hexadecimal digits of a level's name
+   * @param cache_size Number of maildrops to remember
+   */
+  Layout (const std::string& top, size_t levels, size_t width,
+          size_t cache_size);
+
+  /** Find the maildrop of a user
+   * @param user The name of the user
+   * @param path Set to the path of the maildrop, ending in '/'
+   * @return A bool indicating if the user has a maildrop
+   */
+  bool resolve (const std::string& user, std::string& path);
+
+  /**
+   * @param user The name of a user, which must be valid
+   * @return The path where the maildrop of the user belongs, ending in '/'
+   */
+  std::string directory (const std::string& user) const;
+
+  /**
+   * @param user The name of a user
+   * @return A bool indicating if the name can be used as a directory
+   *   name, i.e. it is not empty, has no '/' and does not start with '.'
+   */
+  static bool valid (const std::string& user);
+
+  /**
+   * @return The top directory, ending in '/'
+   */
+  const std::string& top () const
+  {
+    return _top;
+  }
+
+  /**
+   * @param name The name of a directory
+   * @return A bool indicating if the name could be that of a level
+   */
+  bool level (const std::string& name) const;
+
+private:
+  std::string _top;
+  size_t _levels;
+  size_t _width;
+  size_t _cache_size;
+
+  /* Key = user name, Value = path of the maildrop */
+  std::map<std::string, std::string> _cache;
+};
+
+#endif	/* _LAYOUT_H */
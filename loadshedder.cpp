@@ -0,0 +1,18 @@
+#include "loadshedder.h"
+
+LoadShedder::LoadShedder (double target, double interval) :
+_target (target), _interval (interval), _above_until (0), _overloaded (false) { }
+
+bool LoadShedder::overloaded (double sojourn, double now)
+{
+  if ( _target <= 0 || sojourn < _target )
+    {
+      _above_until = 0;
+      _overloaded = false;
+    }
+  else if ( _above_until == 0 )
+    _above_until = now + _interval;
+  else if ( now >= _above_until )
+    _overloaded = true;
+  return _overloaded;
+}
@@ -0,0 +1,49 @@
+/*
+ * File:   loadshedder.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _LOADSHEDDER_H
+#define	_LOADSHEDDER_H
+
+/** Decides when the manager is overloaded, from the time requests
+ * waited in its queue (as CoDel does for packets). A queue that is
+ * busy for a moment is fine: the server is only overloaded once no
+ * request got through faster than the target during a whole interval.
+ * It stays overloaded until a request waits less than the target again.
+ *
+ * While overloaded, the manager refuses new logins and expensive
+ * commands at once, instead of letting players give up on requests
+ * it has not even started yet.
+ *
+ * A LoadShedder is used by the manager thread only.
+ */
+class LoadShedder
+{
+public:
+  /** Constructor for LoadShedder
+   * @param target Seconds a request may wait, 0 means never overloaded
+   * @param interval Seconds the wait must stay above target
+   */
+  LoadShedder (double target, double interval);
+
+  /** Record the wait of a request that is about to be handled
+   * @param sojourn Seconds the request waited in the queue
+   * @param now The current time, see TokenBucket::now
+   * @return A bool indicating if the server is overloaded
+   */
+  bool overloaded (double sojourn, double now);
+
+private:
+  double _target;
+  double _interval;
+
+  /* When the wait will have been above target for an interval,
+   * 0 if it is below target */
+  double _above_until;
+
+  bool _overloaded;
+};
+
+#endif	/* _LOADSHEDDER_H */
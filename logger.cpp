@@ -0,0 +1,255 @@
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+namespace
+{
+  // Records in the ring of a thread
+  const unsigned long ring_size(256);
+
+  const char* events[] = {
+    "connect",
+    "refuse",
+    "command",
+    "reply",
+    "close",
+    "failure"
+  };
+}
+
+/* A record takes two cache lines */
+struct Logger::Record
+{
+  struct timespec time;
+  unsigned long session;
+  unsigned char level;
+  unsigned char event;
+  unsigned short length;
+  char text[100];
+};
+
+struct Logger::Ring
+{
+  Ring () : head (0), tail (0), dropped (0), owned (true), next (0) { }
+
+  Record records[ring_size];
+  /* Number of records written, only changed by the owner */
+  unsigned long head;
+  /* Number of records taken, only changed by the writer */
+  unsigned long tail;
+  /* Records that did not fit since the writer last looked */
+  unsigned long dropped;
+  /* Is a thread using the ring? */
+  bool owned;
+  Ring* next;
+};
+
+volatile int Logger::_level(Logger::Off);
+pthread_key_t Logger::_key;
+bool Logger::_keyed(false);
+Logger::Ring* Logger::_rings(0);
+Mutex Logger::_mutex;
+
+Logger::Ring* Logger::ring ()
+{
+  static __thread Ring* current(0);
+
+  if ( current )
+    return current;
+
+  Lock lock(_mutex);
+
+  if ( !_keyed )
+    _keyed = pthread_key_create(&_key, release) == 0;
+  // A ring of a thread that ended can be used once it is empty
+  for ( Ring* r = _rings; r && !current; r = r->next )
+    if ( !r->owned && r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) )
+      {
+        r->owned = true;
+        current = r;
+      }
+  if ( !current )
+    {
+      current = new Ring;
+      current->next = _rings;
+      _rings = current;
+    }
+  if ( _keyed )
+    pthread_setspecific(_key, current);
+  return current;
+}
+
+void Logger::release (void* ring)
+{
+  Lock lock(_mutex);
+
+  static_cast<Ring*> (ring)->owned = false;
+}
+
+void Logger::record (Level level, Event event, unsigned long session,
+                     const std::string& text)
+{
+  Ring* r(ring());
+  unsigned long head(r->head);
+
+  if ( head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= ring_size )
+    {
+      __sync_fetch_and_add(&r->dropped, 1);
+      Metrics::add(Metrics::LogDropped);
+      return;
+    }
+
+  Record& rec(r->records[head % ring_size]);
+
+  clock_gettime(CLOCK_REALTIME, &rec.time);
+  rec.session = session;
+  rec.level = level;
+  rec.event = event;
+  rec.length = std::min(text.size(), sizeof (rec.text));
+  memcpy(rec.text, text.data(), rec.length);
+  // Publish the record to the writer
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+size_t Logger::drain (std::string& text)
+{
+  Ring* rings;
+  {
+    Lock lock(_mutex);
+
+    rings = _rings;
+  }
+
+  // Rings are only added in front, so the list from here on is fixed
+  std::vector<Record> records;
+  unsigned long dropped(0);
+
+  for ( Ring* r = rings; r; r = r->next )
+    {
+      unsigned long head(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE));
+      unsigned long tail(r->tail);
+
+      for ( ; tail != head; ++tail )
+        records.push_back(r->records[tail % ring_size]);
+      __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+      dropped += __sync_fetch_and_and(&r->dropped, 0);
+    }
+
+  // Each ring is in order, the threads are not
+  std::stable_sort(records.begin(), records.end(), earlier);
+  for ( size_t i = 0; i < records.size(); i++ )
+    format(records[i], text);
+  if ( dropped )
+    {
+      char line[64];
+
+      snprintf(line, sizeof (line), "logger: dropped %lu records\n", dropped);
+      text += line;
+    }
+  return records.size();
+}
+
+void Logger::format (const Record& record, std::string& text)
+{
+  char stamp[64];
+  // Room for the longest stamp, microseconds, session and event
+  char line[160];
+  struct tm tm;
+
+  localtime_r(&record.time.tv_sec, &tm);
+  strftime(stamp, sizeof (stamp), "%Y-%m-%d %H:%M:%S", &tm);
+  snprintf(line, sizeof (line), "%s.%06ld #%lu %s ", stamp,
+           record.time.tv_nsec / 1000, record.session,
+           events[record.event]);
+  text += line;
+
+  std::string details(record.text, record.length);
+
+  // Never write a password to the log
+  if ( record.event == Command && details.size() > 4
+       && strncasecmp(details.c_str(), "pass", 4) == 0 && details[4] == ' ' )
+    details = details.substr(0, 4) + " ********";
+  // Keep one record on one line
+  for ( size_t i = 0; i < details.size(); i++ )
+    if ( details[i] == '\n' || details[i] == '\r' )
+      details[i] = ' ';
+  text += details;
+  text += '\n';
+}
+
+bool Logger::earlier (const Record& a, const Record& b)
+{
+  return a.time.tv_sec < b.time.tv_sec
+          || (a.time.tv_sec == b.time.tv_sec && a.time.tv_nsec < b.time.tv_nsec);
+}
+
+Logger::Writer::Writer (const std::string& path, int level, size_t interval,
+                        size_t debug_level, Dv::Debugable* debug) :
+Dv::Thread::Thread (false, debug_level, debug),
+_fd (open (path.c_str (), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640)),
+_interval (interval)
+{
+  if ( _fd < 0 )
+    throw std::runtime_error("unable to open log: " + path);
+  _level = level;
+}
+
+Logger::Writer::~Writer ()
+{
+  _level = Off;
+  close(_fd);
+}
+
+void Logger::Writer::append (const std::string& text)
+{
+  size_t done(0);
+
+  while ( done < text.size() )
+    {
+      ssize_t n(::write(_fd, text.data() + done, text.size() - done));
+
+      if ( n < 0 && errno == EINTR )
+        continue;
+      if ( n <= 0 )
+        {
+          log() << "logger: write: " << strerror(errno) << std::endl;
+          return;
+        }
+      done += n;
+    }
+}
+
+int Logger::Writer::main ()
+{
+  struct timespec pause;
+
+  pause.tv_sec = _interval / 1000;
+  pause.tv_nsec = (_interval % 1000) * 1000000;
+
+  while ( !killed() )
+    {
+      std::string text;
+
+      drain(text);
+      if ( text.empty() )
+        nanosleep(&pause, 0);
+      else
+        append(text);
+    }
+
+  // Write what was logged before the writer was killed
+  std::string text;
+  drain(text);
+  append(text);
+  return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * File:   logger.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _LOGGER_H
+#define	_LOGGER_H
+
+#include <string>
+#include <cstddef>
+
+#include <dvthread/thread.h>
+
+#include "sync.h"
+
+/** The log of what the sessions do: connections, commands and replies.
+ *
+ * A thread that logs does not format or write anything: it copies a
+ * fixed size record into a ring buffer of its own, which needs no lock
+ * as only that thread writes to it. A Logger::Writer thread takes the
+ * records from all rings, formats them and appends them to the log file
+ * in batches. If a ring is full, the record is dropped and counted.
+ *
+ * An event that is above the log level costs a single comparison.
+ * Only command lines and reply status lines are logged, never message
+ * bodies, and the password of a PASS command is hidden.
+ */
+class Logger
+{
+public:
+  enum Level
+  {
+    Off,
+    Error, /* Failures */
+    Info, /* Sessions that start, end or are refused */
+    Debug /* Commands and replies */
+  };
+
+  enum Event
+  {
+    Connect, /* text = address of the client */
+    Refuse, /* text = address of the client */
+    Command, /* text = command line */
+    Reply, /* text = status line */
+    Close, /* text = name of the user */
+    Failure /* text = what went wrong */
+  };
+
+  /**
+   * @param level The level of an event
+   * @return A bool indicating if events of this level are logged
+   */
+  static bool enabled (Level level)
+  {
+    return level <= _level;
+  }
+
+  /** Log an event, if its level is enabled
+   * @param level The level of the event
+   * @param event What happened
+   * @param session Number of the session, 0 if none
+   * @param text Details, cut off if longer than a record holds
+   */
+  static void write (Level level, Event event, unsigned long session,
+                     const std::string& text)
+  {
+    if ( enabled(level) )
+      record(level, event, session, text);
+  }
+
+  /** The thread that writes the log file. Events are only logged while
+   * it exists.
+   */
+  class Writer : public Dv::Thread::Thread
+  {
+  public:
+    /** Constructor for Writer, opens the log file
+     * @param path String representing the path to the log file
+     * @param level Events up to this level are logged
+     * @param interval Millisecs to sleep when there is nothing to write
+     * @param debug_level only if the master debug level is larger
+     *   than this level will debug output be generated
+     * @param debug object (may be 0)
+     * @exception std::runtime_error If the file can't be opened
+     */
+    Writer (const std::string& path, int level, size_t interval,
+            size_t debug_level, Dv::Debugable* debug);
+
+    /** Destructor for Writer
+     * Stops logging and closes the log file
+     */
+    ~Writer ();
+
+  private:
+    Writer (const Writer&);
+    Writer& operator= (const Writer&);
+
+    /** Write the records until killed, then write what is left */
+    int main ();
+
+    /** Append text to the log file */
+    void append (const std::string& text);
+
+    int _fd;
+    size_t _interval;
+  };
+
+private:
+  struct Record;
+  struct Ring;
+
+  /** Copy an event into the ring of this thread */
+  static void record (Level level, Event event, unsigned long session,
+                      const std::string& text);
+
+  /** The ring of this thread, registered at first use */
+  static Ring* ring ();
+
+  /** Format the records in all rings, oldest first
+   * @param text Formatted records are appended to this
+   * @return The number of records taken
+   */
+  static size_t drain (std::string& text);
+
+  /** Order of records by time */
+  static bool earlier (const Record& a, const Record& b);
+
+  /** Format a single record */
+  static void format (const Record& record, std::string& text);
+
+  /** Forget the ring of a thread that ends, see pthread_key_create */
+  static void release (void* ring);
+
+  static volatile int _level;
+
+  /* Tells a thread that ends to release its ring */
+  static pthread_key_t _key;
+  static bool _keyed;
+
+  /* All rings, a ring is never freed but reused by a later thread */
+  static Ring* _rings;
+  static Mutex _mutex;
+};
+
+#endif	/* _LOGGER_H */
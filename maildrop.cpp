@@ -1,128 +1,898 @@
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <dvutil/strings.h> // for Dv::String::trim
+
 #include "maildrop.h"
+#include "wire.h"
+#include "wirecache.h"
+#include "trace.h"
+#include "flightrecorder.h"
+#include "logger.h"
+
+namespace
+{
+  // Dead names in the log that make it worth rewriting
+  const size_t log_slack(1000);
 
-// See man 3 for information on opendir and readdir
+  const char* log_name(".uidlog");
 
-Maildrop::Maildrop (std::string folderpath) :
-_folder_path (folderpath)
+  const char* headers_name(".headers");
+
+  // The headers of a message are looked for in its first octets only
+  const size_t header_limit(64 * 1024);
+
+  // The headers in a summary, and the longest value kept of each
+  const char* summary_fields[] = { "date", "from", "subject", "message-id" };
+  const size_t summary_nr_of_fields(4);
+  const size_t summary_value_limit(256);
+
+  /** Read the headers of a message file and summarize them, see
+   * Maildrop::summary */
+  std::string summarize (int fd)
+  {
+    std::string text;
+    char buffer[8192];
+    ssize_t n;
+
+    while ( text.size() < header_limit
+            && text.find("\n\n") == std::string::npos
+            && text.find("\n\r\n") == std::string::npos
+            && (n = read(fd, buffer, sizeof (buffer))) > 0 )
+      text.append(buffer, n);
+
+    std::string values[summary_nr_of_fields];
+    std::string::size_type begin(0), end;
+    int field(-1); // the header being unfolded, -1 if not summarized
+
+    while ( begin < text.size() )
+      {
+        end = text.find('\n', begin);
+        if ( end == std::string::npos )
+          end = text.size();
+
+        std::string line(text.substr(begin, end - begin));
+
+        begin = end + 1;
+        if ( !line.empty() && line[line.size() - 1] == '\r' )
+          line.erase(line.size() - 1);
+        if ( line.empty() )
+          break; // end of the headers
+        if ( line[0] == ' ' || line[0] == '\t' )
+          {
+            if ( field >= 0 )
+              values[field] += line;
+            continue;
+          }
+        field = -1;
+
+        std::string::size_type colon(line.find(':'));
+
+        if ( colon == std::string::npos )
+          continue;
+
+        std::string header(line.substr(0, colon));
+
+        for ( size_t i = 0; i < header.size(); i++ )
+          header[i] = tolower(header[i]);
+        for ( size_t i = 0; i < summary_nr_of_fields; i++ )
+          if ( header == summary_fields[i] && values[i].empty() )
+            {
+              field = i;
+              values[i] = line.substr(colon + 1);
+            }
+      }
+
+    std::string summary;
+
+    for ( size_t i = 0; i < summary_nr_of_fields; i++ )
+      {
+        std::string& value(values[i]);
+
+        // One line, the tabs separate the values
+        for ( size_t j = 0; j < value.size(); j++ )
+          if ( value[j] == '\t' || value[j] == '\r' )
+            value[j] = ' ';
+        Dv::String::trim(value);
+        if ( i )
+          summary += '\t';
+        summary += value.substr(0, summary_value_limit);
+      }
+    return summary;
+  }
+}
+
+struct Maildrop::ByUniqueName
 {
-  using namespace std;
+  ByUniqueName (const Maildrop& maildrop) : _maildrop (maildrop) { }
 
-  DIR *dp; // pointer to the directory
-  struct dirent *ep;
+  /** The unique name of a message, up to the returned end */
+  const char* unique (const Record& r, const char*& end) const
+  {
+    const char* name(&_maildrop._index->names[r.name]);
+    const char* slash(strchr(name, '/'));
+
+    if ( slash )
+      name = slash + 1;
+    end = _maildrop._index->maildir ? name + strcspn(name, ",:") : name + strlen(name);
+    return name;
+  }
+
+  /** Compare two names like std::string::compare does, the octets as
+   * unsigned: find_message searches with this order, a name with an
+   * octet above 0x7f must sort the same way */
+  static int compare (const char* a, size_t a_size, const char* b, size_t b_size)
+  {
+    int c(memcmp(a, b, std::min(a_size, b_size)));
+
+    if ( c != 0 )
+      return c;
+    return a_size < b_size ? -1 : (a_size > b_size ? 1 : 0);
+  }
+
+  bool operator() (const Record& a, const Record& b) const
+  {
+    const char* a_end;
+    const char* b_end;
+    const char* a_name(unique(a, a_end));
+    const char* b_name(unique(b, b_end));
+
+    return compare(a_name, a_end - a_name, b_name, b_end - b_name) < 0;
+  }
+
+  const Maildrop& _maildrop;
+};
 
-  dp = opendir(_folder_path.c_str());
+// See man 3 for information on fdopendir and readdir
+
+Maildrop::Maildrop (std::string folderpath) :
+_index (new Index), _visible (0), _deleted (0)
+{
+  TRACE_SPAN("maildrop.open");
+  FlightRecorder::Storage storage;
+
+  _index->sessions = 1;
+  _index->expunged = 0;
+  _index->sorted = 0;
+  _index->folder_path = folderpath;
+  _index->dir_fd = open(folderpath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  _index->maildir = false;
+  _index->logged = false;
+  _index->stale_summaries = 0;
   // Can we open the directory?
-  if ( dp != NULL )
+  if ( _index->dir_fd < 0 )
     {
-      // Each message will get a subsequent number
-      int msg_counter(0);
+      delete _index;
+      throw std::runtime_error("unable to open maildrop folder");
+    }
+
+  struct stat cur, fresh;
 
-      /* Add all the messages file in the folder to the maildrop
-       * readdir returns pointer to dirent */
-      while ( (ep = readdir(dp)) )
+  _index->maildir = fstatat(_index->dir_fd, "cur", &cur, 0) == 0 && S_ISDIR(cur.st_mode)
+          && fstatat(_index->dir_fd, "new", &fresh, 0) == 0 && S_ISDIR(fresh.st_mode);
+  try
+    {
+      if ( _index->maildir )
         {
-          // needed so that messages won't be created for "." and ".."
-          if ( !(ep->d_name[0] == '.') )
-            {
-              _messages.push_back(new Message(msg_counter,
-                                              /* ep->d_name retuns the name of
-                                               * current file */
-                                              _folder_path + ep->d_name));
-              msg_counter++;
-            }
+          read_directory("cur");
+          read_directory("new");
         }
-      closedir(dp);
+      else
+        read_directory("");
+    }
+  catch (std::runtime_error&)
+    {
+      close(_index->dir_fd);
+      delete _index;
+      throw;
+    }
+  // Number the messages in the order of their unique names
+  std::sort(_index->records.begin(), _index->records.end(), ByUniqueName(*this));
+  _index->sorted = _index->records.size();
+  _visible = _index->records.size();
+  _deletions.assign(_visible, false);
+}
+
+Maildrop::Maildrop (const Maildrop& orig) :
+_index (orig._index), _visible (0), _deleted (0)
+{
+  Lock lock(_index->mutex);
+
+  _index->sessions++;
+  _visible = orig._visible;
+  _deletions.assign(_visible, false);
+}
+
+size_t Maildrop::sessions () const
+{
+  Lock lock(_index->mutex);
+
+  return _index->sessions;
+}
+
+int Maildrop::read_directory (const std::string& subdir, bool known)
+{
+  // readdir needs a descriptor of its own, closedir closes it
+  int fd(subdir.empty() ? dup(_index->dir_fd)
+         : openat(_index->dir_fd, subdir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  DIR *dp(fd >= 0 ? fdopendir(fd) : NULL); // pointer to the directory
+  struct dirent *ep;
+  std::string prefix(subdir.empty() ? "" : subdir + "/");
+  int added(0);
+
+  if ( dp == NULL )
+    {
+      if ( fd >= 0 )
+        close(fd);
+      throw std::runtime_error("unable to open maildrop folder");
+    }
+
+  /* Add all the messages file in the folder to the maildrop, each
+   * will get a subsequent number. readdir returns pointer to dirent */
+  while ( (ep = readdir(dp)) )
+    {
+      // needed so that messages won't be created for "." and ".."
+      if ( ep->d_name[0] == '.'
+           || (known && find_message(unique_name(ep->d_name)) >= 0) )
+        continue;
+      add_message(prefix + ep->d_name);
+      added++;
+    }
+  closedir(dp);
+  return added;
+}
+
+int Maildrop::refresh ()
+{
+  Lock lock(_index->mutex);
+  size_t first(_index->records.size());
+  int added(0);
+
+  if ( _index->maildir )
+    {
+      // A message may have moved from "new" to "cur" meanwhile
+      added += read_directory("new", true);
+      added += read_directory("cur", true);
     }
   else
-    throw runtime_error("unable to open maildrop folder");
+    added += read_directory("", true);
+
+  // Keep the log of unique names up to date, see Maildrop::update_log
+  if ( _index->logged && added )
+    {
+      int fd(openat(_index->dir_fd, log_name, O_WRONLY | O_APPEND | O_CLOEXEC));
+      std::string text;
+
+      for ( size_t i = first; i < _index->records.size(); i++ )
+        {
+          _index->records[i].flags |= Logged;
+          text += unique_name(i) + "\n";
+        }
+      // Failing that, the log is brought up to date from scratch
+      if ( fd < 0 || write(fd, text.data(), text.size())
+           != static_cast<ssize_t> (text.size()) )
+        {
+          for ( size_t i = 0; i < _index->records.size(); i++ )
+            _index->records[i].flags &= ~Logged;
+          _index->logged = false;
+        }
+      if ( fd >= 0 )
+        close(fd);
+    }
+
+  // Another session may have added messages this one does not see yet
+  added = _index->records.size() - _visible;
+  _visible = _index->records.size();
+  _deletions.resize(_visible, false);
+  return added;
 }
 
 Maildrop::~Maildrop ()
 {
-  for ( int i = 0; i < nr_of_messages(true); i++ )
+  TRACE_SPAN("maildrop.update");
+  FlightRecorder::Storage storage;
+  std::string failed;
+  bool last;
+
+  {
+    Lock lock(_index->mutex);
+
+    last = --_index->sessions == 0;
+    write_summaries();
+    failed = update(last);
+  }
+  if ( last )
     {
-      delete _messages.at(i); /* If the message was marked as deleted,
-                               * it will be deleted from the filesystem now */
+      close(_index->dir_fd);
+      delete _index;
     }
+  if ( !failed.empty() )
+    Logger::write(Logger::Error, Logger::Failure, 0, "unable to delete message: " + failed);
 }
 
-void Maildrop::add_message (Message* message)
+std::string Maildrop::update (bool last)
 {
-  _messages.push_back(message);
+  std::string failed;
+
+  /* The messages marked as deleted are deleted from the filesystem, and
+   * from the index for the other sessions */
+  for ( size_t i = 0; i < _visible; i++ )
+    if ( _deletions[i] && !(_index->records[i].flags & Expunged) )
+      {
+        if ( unlinkat(_index->dir_fd, name(i), 0) != 0 )
+          {
+            failed = path(i);
+            continue;
+          }
+        WireCache::remove(path(i));
+        _index->records[i].flags |= Expunged;
+        _index->expunged++;
+      }
+  if ( !last )
+    return failed;
+  for ( size_t i = 0; i < _index->records.size(); i++ )
+    if ( (_index->records[i].flags & (Changed | Expunged)) == Changed )
+      rename_message(i);
+  return failed;
 }
 
-Message* Maildrop::retrieve_message (int msg_nr) const
+void Maildrop::rename_message (unsigned int msg_nr)
 {
-  if ( msg_nr < nr_of_messages(true) )
+  const Record& r(_index->records[msg_nr]);
+  std::string old_name(name(msg_nr));
+  std::string::size_type slash(old_name.find('/'));
+  std::string stem(old_name.substr(slash + 1,
+                                   old_name.find(':') - slash - 1));
+  std::ostringstream oss;
+
+  // Sizes that are not yet in the name are added to it
+  oss << "cur/" << stem;
+  if ( stem.find(",S=") == std::string::npos )
     {
-      Message* msg(_messages.at(msg_nr));
+      struct stat st;
 
-      if ( msg->deleted() )
-        return false;
-      else
-        return msg;
+      if ( fstatat(_index->dir_fd, old_name.c_str(), &st, 0) == 0 )
+        oss << ",S=" << st.st_size;
     }
-  else
-    return false;
+  if ( stem.find(",W=") == std::string::npos && r.size )
+    oss << ",W=" << r.size;
+  oss << ":2,";
+  for ( int i = 0; i < 26; i++ )
+    if ( r.flags & (Letters << i) )
+      oss << static_cast<char> ('A' + i);
+
+  std::string new_name(oss.str());
+
+  if ( new_name == old_name
+       || renameat(_index->dir_fd, old_name.c_str(), _index->dir_fd, new_name.c_str()) != 0 )
+    return;
+
+  // The wire form moves along with the message
+  std::string from(path(msg_nr));
+  std::string to(_index->folder_path + new_name);
+
+  if ( WireCache::make_directory(to) )
+    rename(WireCache::wire_path(from).c_str(), WireCache::wire_path(to).c_str());
 }
 
-bool Maildrop::delete_message (int msg_nr)
+void Maildrop::add_message (const std::string& name)
 {
-  if ( msg_nr <= nr_of_messages(true) )
+  Record record = { static_cast<uint32_t> (_index->names.size()), 0, 0 };
+
+  if ( _index->maildir )
     {
-      Message* msg(_messages.at(msg_nr));
+      std::string::size_type info(name.find(":2,"));
+      std::string::size_type wire(name.find(",W="));
 
-      if ( msg->deleted() )
-        return false;
-      else
-        {
-          msg->deleted(true);
-          return true;
-        }
+      if ( name.compare(0, 4, "new/") == 0 )
+        record.flags |= Fresh;
+      for ( size_t i = info; info != std::string::npos && i < name.size(); i++ )
+        if ( name[i] >= 'A' && name[i] <= 'Z' )
+          record.flags |= Letters << (name[i] - 'A');
+      // The size on the wire need not be computed
+      if ( wire != std::string::npos && wire < info )
+        record.size = strtoull(name.c_str() + wire + 3, 0, 10);
     }
+  _index->names.insert(_index->names.end(), name.begin(), name.end());
+  _index->names.push_back(0);
+  _index->records.push_back(record);
+}
+
+Message Maildrop::retrieve_message (int msg_nr)
+{
+  Lock lock(_index->mutex);
+
+  if ( msg_nr >= 0 && msg_nr < nr_of_messages(true) && !deleted(msg_nr) )
+    return Message(this, msg_nr);
   else
+    return Message();
+}
+
+bool Maildrop::delete_message (int msg_nr)
+{
+  Message msg(retrieve_message(msg_nr));
+
+  if ( !msg.valid() )
     return false;
+  msg.deleted(true);
+  return true;
 }
 
 int Maildrop::nr_of_messages (bool deleted) const
 {
-  /* If deleted = true we just give the size of the messages vector
-   * Otherwise we calculate size */
-  if ( !deleted )
-    {
-      int nr_of_msgs(0);
+  /* If deleted = true we just give the number of records */
+  if ( deleted )
+    return _visible;
+
+  Lock lock(_index->mutex);
+
+  // Other sessions may have deleted some of them
+  if ( !_index->expunged )
+    return _visible - _deleted;
+
+  int count(0);
+
+  for ( size_t i = 0; i < _visible; i++ )
+    if ( !this->deleted(i) )
+      count++;
+  return count;
+}
+
+void Maildrop::measure (size_t first, size_t last)
+{
+  // The numbers and paths of the messages without a size
+  std::vector<std::pair<unsigned int, std::string> > unknown;
 
-      for ( unsigned int i = 0; i < _messages.size(); i++ )
+  {
+    Lock lock(_index->mutex);
+
+    // The header cache has the sizes on the wire of the messages it knows
+    if ( _index->summary.empty() && !_index->records.empty() )
+      load_summaries();
+    for ( size_t i = first; i < last && i < _visible; i++ )
+      if ( !_index->records[i].size && !deleted(i) )
+        unknown.push_back(std::make_pair(i, path(i)));
+  }
+  if ( unknown.empty() )
+    return;
+
+  TRACE_SPAN("message.size");
+  FlightRecorder::Storage storage;
+  std::vector<unsigned long> sizes(unknown.size(), 0);
+  std::vector<bool> counted(unknown.size(), false);
+
+  for ( size_t i = 0; i < unknown.size(); i++ )
+    {
+      try
+        {
+          if ( !WireCache::lookup(unknown[i].second, sizes[i]) )
+            {
+              sizes[i] = WireEncoder::wire_size(unknown[i].second);
+              counted[i] = true;
+            }
+        }
+      catch (std::runtime_error&)
         {
-          if ( !_messages.at(i)->deleted() )
-            nr_of_msgs++;
+          // Moved away by another program, it is computed again later
+          sizes[i] = 0;
         }
-      return nr_of_msgs;
     }
-  else
-    return _messages.size();
+
+  Lock lock(_index->mutex);
+  std::ostringstream oss;
+
+  for ( size_t i = 0; i < unknown.size(); i++ )
+    {
+      Record& r(_index->records[unknown[i].first]);
+
+      /* Another session may have measured it meanwhile; 0 means not
+       * yet computed (an empty message is simply computed again) */
+      if ( r.size || !sizes[i] )
+        continue;
+      r.size = sizes[i];
+      if ( counted[i] )
+        oss << unique_name(unknown[i].first) << "\t" << r.size << "\n";
+    }
+  _index->unsaved += oss.str();
 }
 
-unsigned long Maildrop::size () const
+unsigned long Maildrop::wire_size (unsigned int msg_nr)
 {
-  unsigned long size;
+  measure(msg_nr, msg_nr + 1);
+
+  Lock lock(_index->mutex);
 
-  for ( int i = 0; i < nr_of_messages(false); i++ )
+  return _index->records[msg_nr].size;
+}
+
+unsigned long Maildrop::size ()
+{
+  measure(0, nr_of_messages(true));
+
+  Lock lock(_index->mutex);
+  unsigned long size(0);
+
+  for ( size_t i = 0; i < _visible; i++ )
     {
-      if ( !_messages.at(i)->deleted() )
-        size += _messages.at(i)->size();
+      if ( !deleted(i) )
+        size += _index->records[i].size;
     }
   return size;
 }
 
-std::vector<Message*> Maildrop::messages (bool deleted) const
+unsigned long Maildrop::file_size (int msg_nr) const
+{
+  Lock lock(_index->mutex);
+  struct stat st;
+
+  if ( _index->records[msg_nr].size )
+    return _index->records[msg_nr].size;
+  if ( fstatat(_index->dir_fd, name(msg_nr), &st, 0) != 0 )
+    return 0;
+  return st.st_size;
+}
+
+void Maildrop::reset ()
+{
+  Lock lock(_index->mutex);
+
+  _deletions.assign(_visible, false);
+  _deleted = 0;
+}
+
+void Maildrop::seen (int msg_nr)
+{
+  Lock lock(_index->mutex);
+  Record& r(_index->records[msg_nr]);
+  uint32_t seen(Letters << ('S' - 'A'));
+
+  if ( _index->maildir && !(r.flags & seen) )
+    r.flags |= seen | Changed;
+}
+
+std::string Maildrop::unique_name (unsigned int msg_nr) const
+{
+  return unique_name(std::string(name(msg_nr)));
+}
+
+std::string Maildrop::unique_name (const std::string& file_name) const
+{
+  std::string unique(file_name);
+
+  unique.erase(0, unique.find('/') + 1);
+  if ( _index->maildir )
+    return unique.substr(0, unique.find_first_of(",:"));
+  return unique;
+}
+
+int Maildrop::find_message (const std::string& uid) const
+{
+  // The records are sorted by unique name, up to the refreshed ones
+  ByUniqueName order(*this);
+  size_t low(0), high(_index->sorted);
+
+  while ( low < high )
+    {
+      size_t middle(low + (high - low) / 2);
+      const char* end;
+      const char* name(order.unique(_index->records[middle], end));
+      int c(ByUniqueName::compare(name, end - name, uid.data(), uid.size()));
+
+      if ( c == 0 )
+        return middle;
+      if ( c < 0 )
+        low = middle + 1;
+      else
+        high = middle;
+    }
+  for ( size_t i = _index->sorted; i < _index->records.size(); i++ )
+    if ( unique_name(i) == uid )
+      return i;
+  return -1;
+}
+
+bool Maildrop::update_log ()
+{
+  int fd(openat(_index->dir_fd, log_name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600));
+  std::string log;
+  char buffer[64 * 1024];
+  ssize_t n;
+
+  if ( fd < 0 )
+    return false;
+  while ( (n = read(fd, buffer, sizeof (buffer))) > 0 )
+    log.append(buffer, n);
+
+  // Mark the messages that are in the log, keep their names in order
+  std::vector<std::string> live;
+  size_t dead(0);
+  std::string::size_type begin(0), end;
+
+  while ( (end = log.find('\n', begin)) != std::string::npos )
+    {
+      std::string uid(log.substr(begin, end - begin));
+      int msg_nr(find_message(uid));
+
+      if ( msg_nr >= 0 && !(_index->records[msg_nr].flags & Logged) )
+        {
+          _index->records[msg_nr].flags |= Logged;
+          live.push_back(uid);
+        }
+      else
+        dead++;
+      begin = end + 1;
+    }
+
+  // Append the new messages, in the order of their unique names
+  std::string added;
+
+  for ( size_t i = 0; i < _index->records.size(); i++ )
+    if ( !(_index->records[i].flags & Logged) )
+      {
+        _index->records[i].flags |= Logged;
+        live.push_back(unique_name(i));
+        added += live.back() + "\n";
+      }
+
+  bool ok(added.empty() || write(fd, added.data(), added.size())
+          == static_cast<ssize_t> (added.size()));
+  close(fd);
+
+  // Rewrite the log when most of it is about messages that are gone;
+  // this invalidates the cursors, since the new log is another file
+  if ( ok && dead > live.size() && dead > log_slack )
+    {
+      std::string tmp_name(std::string(log_name) + ".tmp");
+      std::string text;
+
+      for ( size_t i = 0; i < live.size(); i++ )
+        text += live[i] + "\n";
+      fd = openat(_index->dir_fd, tmp_name.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      if ( fd >= 0 )
+        {
+          bool written(write(fd, text.data(), text.size())
+                       == static_cast<ssize_t> (text.size()));
+
+          close(fd);
+          if ( !written || renameat(_index->dir_fd, tmp_name.c_str(), _index->dir_fd, log_name) != 0 )
+            unlinkat(_index->dir_fd, tmp_name.c_str(), 0);
+        }
+    }
+  return ok;
+}
+
+bool Maildrop::added_since (const std::string& cursor, std::vector<int>& numbers,
+                            std::string& next)
+{
+  Lock lock(_index->mutex);
+
+  if ( !_index->logged )
+    _index->logged = update_log();
+  if ( !_index->logged )
+    return false;
+
+  // A cursor is the inode of the log and an offset in it
+  int fd(openat(_index->dir_fd, log_name, O_RDONLY | O_CLOEXEC));
+  struct stat st;
+  unsigned long inode(0), offset(0);
+  char dot(0);
+
+  if ( fd < 0 )
+    return false;
+  if ( fstat(fd, &st) != 0
+       || (!cursor.empty()
+           && (!(std::istringstream(cursor) >> inode >> dot >> offset) || dot != '.'
+               || inode != st.st_ino || offset > static_cast<unsigned long> (st.st_size))) )
+    {
+      close(fd);
+      return false;
+    }
+
+  // The cursor must be at the start of a line
+  std::string log(st.st_size - offset + (offset ? 1 : 0), 0);
+  off_t from(offset ? offset - 1 : 0);
+  bool ok(log.empty() || pread(fd, &log[0], log.size(), from)
+          == static_cast<ssize_t> (log.size()));
+
+  close(fd);
+  if ( !ok || (offset && log[0] != '\n') )
+    return false;
+
+  std::string::size_type begin(offset ? 1 : 0), end;
+
+  while ( (end = log.find('\n', begin)) != std::string::npos )
+    {
+      int msg_nr(find_message(log.substr(begin, end - begin)));
+
+      if ( msg_nr >= 0 && static_cast<size_t> (msg_nr) < _visible && !deleted(msg_nr) )
+        numbers.push_back(msg_nr);
+      begin = end + 1;
+    }
+
+  std::ostringstream oss;
+  oss << st.st_ino << "." << st.st_size;
+  next = oss.str();
+  return true;
+}
+
+std::vector<Message> Maildrop::messages (bool deleted)
 {
-  std::vector<Message*> msgs;
+  Lock lock(_index->mutex);
+  std::vector<Message> msgs;
 
-  for ( int i = 0; i < nr_of_messages(true); i++ )
+  for ( size_t i = 0; i < _visible; i++ )
     {
-      if ( !_messages.at(i)->deleted() || deleted )
-        msgs.push_back(_messages.at(i));
+      if ( !this->deleted(i) || deleted )
+        msgs.push_back(Message(this, i));
     }
   return msgs;
 }
+
+void Maildrop::load_summaries ()
+{
+  int fd(openat(_index->dir_fd, headers_name, O_RDONLY | O_CLOEXEC));
+  std::string text;
+  char buffer[64 * 1024];
+  ssize_t n;
+
+  _index->summary.assign(_index->records.size(), 0);
+  if ( fd < 0 )
+    return;
+  while ( (n = read(fd, buffer, sizeof (buffer))) > 0 )
+    text.append(buffer, n);
+  close(fd);
+
+  /* Each line is the unique name, the size on the wire and the
+   * summary; a line without a summary has only the size, see
+   * Maildrop::measure */
+  std::string::size_type begin(0), end;
+
+  while ( (end = text.find('\n', begin)) != std::string::npos )
+    {
+      std::string::size_type uid_end(text.find('\t', begin));
+      std::string::size_type size_end(uid_end < end ? text.find('\t', uid_end + 1)
+                                       : std::string::npos);
+      int msg_nr(uid_end < end ? find_message(text.substr(begin, uid_end - begin)) : -1);
+
+      bool summarized(size_end < end);
+
+      if ( msg_nr >= 0 && !_index->records[msg_nr].size )
+        _index->records[msg_nr].size = strtoull(text.c_str() + uid_end + 1, 0, 10);
+      if ( msg_nr >= 0 && summarized && !_index->summary[msg_nr] )
+        {
+          _index->summary[msg_nr] = _index->summaries.size() + 1;
+          _index->summaries.insert(_index->summaries.end(), text.begin() + size_end + 1,
+                            text.begin() + end);
+          _index->summaries.push_back(0);
+        }
+      else if ( msg_nr < 0 || summarized )
+        _index->stale_summaries++;
+      begin = end + 1;
+    }
+}
+
+std::string Maildrop::summary (unsigned int msg_nr)
+{
+  // The size goes along in the header cache
+  measure(msg_nr, msg_nr + 1);
+
+  std::string file;
+
+  {
+    Lock lock(_index->mutex);
+
+    if ( _index->summary.empty() )
+      load_summaries();
+    // Messages may have been added by Maildrop::refresh
+    if ( _index->summary.size() < _index->records.size() )
+      _index->summary.resize(_index->records.size(), 0);
+    if ( _index->summary[msg_nr] )
+      return &_index->summaries[_index->summary[msg_nr] - 1];
+    file = name(msg_nr);
+  }
+
+  // Read without the lock, like Maildrop::measure does
+  std::string text;
+
+  {
+    TRACE_SPAN("message.headers");
+    FlightRecorder::Storage storage;
+    int fd(openat(_index->dir_fd, file.c_str(), O_RDONLY | O_CLOEXEC));
+
+    if ( fd < 0 )
+      return "\t\t\t";
+    text = summarize(fd);
+    close(fd);
+  }
+
+  Lock lock(_index->mutex);
+
+  // Another session may have read it meanwhile
+  if ( _index->summary[msg_nr] )
+    return &_index->summaries[_index->summary[msg_nr] - 1];
+
+  std::ostringstream oss;
+
+  oss << unique_name(msg_nr) << "\t" << _index->records[msg_nr].size << "\t" << text << "\n";
+  _index->unsaved += oss.str();
+  _index->summary[msg_nr] = _index->summaries.size() + 1;
+  _index->summaries.insert(_index->summaries.end(), text.begin(), text.end());
+  _index->summaries.push_back(0);
+  return text;
+}
+
+void Maildrop::save_summaries ()
+{
+  Lock lock(_index->mutex);
+
+  write_summaries();
+}
+
+void Maildrop::write_summaries ()
+{
+  size_t live(0);
+
+  for ( size_t i = 0; i < _index->records.size(); i++ )
+    if ( (i < _index->summary.size() && _index->summary[i]) || _index->records[i].size )
+      live++;
+
+  // Rewrite the cache when most of it is about messages that are gone
+  if ( _index->stale_summaries > live && _index->stale_summaries > log_slack )
+    {
+      std::string tmp_name(std::string(headers_name) + ".tmp");
+      std::ostringstream oss;
+
+      for ( size_t i = 0; i < _index->records.size(); i++ )
+        {
+          const Record& r(_index->records[i]);
+
+          if ( r.flags & Expunged )
+            continue;
+          if ( i < _index->summary.size() && _index->summary[i] )
+            oss << unique_name(i) << "\t" << r.size << "\t"
+                    << &_index->summaries[_index->summary[i] - 1] << "\n";
+          else if ( r.size )
+            oss << unique_name(i) << "\t" << r.size << "\n";
+        }
+
+      std::string text(oss.str());
+      int fd(openat(_index->dir_fd, tmp_name.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+
+      if ( fd < 0 )
+        return;
+
+      bool written(write(fd, text.data(), text.size())
+                   == static_cast<ssize_t> (text.size()));
+
+      close(fd);
+      if ( written && renameat(_index->dir_fd, tmp_name.c_str(), _index->dir_fd, headers_name) == 0 )
+        {
+          _index->stale_summaries = 0;
+          _index->unsaved.clear();
+        }
+      else
+        unlinkat(_index->dir_fd, tmp_name.c_str(), 0);
+      return;
+    }
+
+  if ( _index->unsaved.empty() )
+    return;
+
+  int fd(openat(_index->dir_fd, headers_name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600));
+
+  // The cache is merely a hint, the lines are read again next time
+  if ( fd >= 0 && write(fd, _index->unsaved.data(), _index->unsaved.size()) >= 0 )
+    _index->unsaved.clear();
+  if ( fd >= 0 )
+    close(fd);
+}
@@ -11,14 +11,58 @@
 #include <vector>
 #include <string>
 #include <fstream>
+#include <stdint.h>
 #include <sys/types.h>
 #include <dirent.h>
 
 #include "message.h"
+#include "sync.h"
 
 /** The Maildrop class represents a maildrop of a user.
- * All the messages are stored in a vector.
- * The path to the folder of the maildrop is stored
+ *
+ * A maildrop may hold a million messages, so it does not keep an
+ * object per message. All file names are stored one after the other in
+ * a single pool, and every message has a fixed size Record with the
+ * offset of its name, its flags and its size. The names are relative to
+ * the folder of the maildrop, which stays open as a directory file
+ * descriptor. Everything is freed at once with the maildrop.
+ *
+ * A Message is merely a handle to one of the records.
+ *
+ * A folder with "new" and "cur" subdirectories is a Maildir: the
+ * messages are the files in both. The name of a file may tell its size
+ * (",S=" on disk, ",W=" on the wire) and ends in its flags (":2,"
+ * followed by letters, e.g. "S" for seen). A message that is retrieved
+ * is marked as seen; all messages that must move from "new" to "cur" or
+ * whose flags changed are renamed in a single pass when the maildrop is
+ * closed, and their names then tell their sizes. Files being delivered
+ * (in "tmp") are never seen.
+ *
+ * The messages are numbered in the order of their unique names (in a
+ * Maildir, these start with the time of delivery). The unique names are
+ * also appended, in the order in which the messages are first seen, to
+ * the ".uidlog" file in the folder. A client can then ask for the
+ * messages added since a cursor, which is a position in that log (see
+ * Maildrop::added_since).
+ *
+ * A summary of the headers of each message (see Maildrop::summary) is
+ * kept in the ".headers" file in the folder, with its size on the wire,
+ * so that only new messages ever need to be opened to list them. A
+ * size that was counted for a message without a summary is kept there
+ * on a line of its own. Messages are read for their sizes with the
+ * index unlocked, the other sessions on it are not held up.
+ *
+ * A maildrop does not change while it is open, unless the session asks
+ * for the messages delivered since (see Maildrop::refresh): these get
+ * the next numbers, the messages that were there keep theirs.
+ *
+ * The sessions of a user share one index of the folder: a copy of a
+ * Maildrop is another session on the same index, which is closed with
+ * the last of them. Each session has its own messages marked as
+ * deleted; these are deleted when it is closed, and are then gone for
+ * the other sessions as well (they keep their numbers, but cannot be
+ * retrieved). The index is locked by each call, since the listings of
+ * several sessions may be written at the same time.
  */
 class Maildrop
 {
@@ -29,22 +73,28 @@ public:
    */
   Maildrop (std::string folderpath);
 
-  /** Destructor for Maildrop
-   * This will delete all the messages marked as deleted
+  /** Copy constructor for Maildrop
+   * Opens another session on the index of the original, with no
+   * messages marked as deleted. It sees the messages the original
+   * session sees, see Maildrop::refresh for those delivered since.
+   * @param orig A session on the maildrop
    */
-  virtual ~Maildrop ();
+  Maildrop (const Maildrop& orig);
 
-  /** Add a new message to the maildrop
-   * @param message The message to add to the maildrop
+  /** Destructor for Maildrop
+   * This will delete all the messages this session marked as deleted;
+   * the last session on the index also renames the messages of a Maildir
+   * whose name must change. A message file that can't be deleted is
+   * logged (see Logger), a destructor must not throw.
    */
-  void add_message (Message* message);
+  virtual ~Maildrop ();
 
   /** Retrieve a message from the maildrop
    * @param msg_nr The number of the message
-   * @return The actual message if found
-   * @return false if the message is not found
+   * @return The message if found, an invalid message
+   *   (see Message::valid) if not or if it is marked as deleted
    */
-  Message* retrieve_message (int msg_nr) const;
+  Message retrieve_message (int msg_nr);
 
   /** Delete a message from the maildrop
    * This does not actually delete the message but marks it as deleted
@@ -59,28 +109,285 @@ public:
    */
   int nr_of_messages (bool deleted = false) const;
 
-  /** Return the size of the maildrop
+  /** Return the size of the maildrop: the sum of the sizes on the wire
+   * of its messages (see Message::size), those not yet known are
+   * counted and kept in the header cache
    * @return The size of the maildrop in octets
    */
-  unsigned long size () const;
+  unsigned long size ();
+
+  /** The size of a message, cheaply, for budgeting read-ahead: its size
+   * on the wire if known, else the size of its file. Never reported to
+   * a client, which is given Message::size.
+   * @param msg_nr The number of the message, which must exist
+   * @return The size in octets, 0 if unknown
+   */
+  unsigned long file_size (int msg_nr) const;
+
+  /** Mark a message as seen, if it is in a Maildir
+   * @param msg_nr The number of the message
+   */
+  void seen (int msg_nr);
+
+  /** Get the messages that were added to the maildrop after a cursor.
+   * The first call brings the log of unique names up to date.
+   * @param cursor A cursor given by an earlier call, "" for all messages
+   * @param numbers Set to the numbers of the messages added after the
+   *   cursor that are not marked as deleted, in the order they were added
+   * @param next Set to the cursor to pass next time
+   * @return false if the cursor is not (or no longer) valid
+   */
+  bool added_since (const std::string& cursor, std::vector<int>& numbers,
+                    std::string& next);
+
+  /** Add the messages that were delivered after the maildrop was
+   * opened (or last refreshed), or that another session on the index
+   * added since
+   * @return The number of messages added
+   * @exception std::runtime_error If the folder cannot be read
+   */
+  int refresh ();
+
+  /** Get a summary of the headers of a message: its Date, From,
+   * Subject and Message-ID, separated by tabs (empty if absent). It
+   * comes from the header cache, a message that is not in it is read
+   * once, with the index unlocked, and added to it (see
+   * Maildrop::save_summaries).
+   * @param msg_nr The number of the message, which must exist
+   * @return The summary, one line without line ending
+   */
+  std::string summary (unsigned int msg_nr);
+
+  /** Write the summaries that are not yet in the header cache to it */
+  void save_summaries ();
+
+  /**
+   * @return The path to the directory where new messages are delivered:
+   *   the "new" directory of a Maildir, else the folder itself
+   */
+  std::string delivery_path () const
+  {
+    return _index->maildir ? _index->folder_path + "new" : _index->folder_path;
+  }
+
+  /** Unmark the messages this session marked as deleted, so that none
+   * is deleted when it is closed: a session that ends without QUIT
+   * never enters the UPDATE state (RFC 1939)
+   */
+  void reset ();
 
   /** Get all the messages from the maildrop (including the ones marked
    * as deleted or not).
    * @param deleted Return messages marked as deleted
    * @return A vector containing the messages
    */
-  std::vector<Message*> messages (bool deleted = false) const;
+  std::vector<Message> messages (bool deleted = false);
+
+  /**
+   * @return The number of sessions on the index of this maildrop
+   */
+  size_t sessions () const;
 
 private:
-  /** Private copy constructor */
-  Maildrop (const Maildrop& orig);
+  friend class Message;
+
+  Maildrop& operator= (const Maildrop&);
+
+  enum Flag
+  {
+    Expunged = 1, /* Deleted by a session that was closed */
+    Fresh = 2, /* In the "new" directory of a Maildir */
+    Changed = 4, /* The Maildir flags differ from those in the name */
+    Letters = 8, /* The Maildir flag 'A' + i is Letters << i */
+    Logged = 1 << 29 /* The unique name is in the log */
+  };
+
+  /** What the maildrop knows of a message */
+  struct Record
+  {
+    /* Offset of the file name in Index::names */
+    uint32_t name;
+    /* Flag values */
+    uint32_t flags;
+    /* The size on the wire, 0 if not yet computed */
+    uint64_t size;
+  };
+
+  /** What the sessions on a maildrop share */
+  struct Index
+  {
+    /* Guards all of the index, see Maildrop */
+    Mutex mutex;
+
+    /* The number of sessions on it */
+    size_t sessions;
+
+    /* The records of the messages, by number. The sizes are filled in
+     * when needed */
+    std::vector<Record> records;
+
+    /* The file names of the messages, each ending in a 0 */
+    std::vector<char> names;
+
+    /* The number of records that are Expunged */
+    size_t expunged;
+
+    /* The records before this one are sorted by unique name, the
+     * ones added by Maildrop::refresh follow in no particular order */
+    size_t sorted;
+
+    /* String */
+    std::string folder_path;
+
+    /* The folder, the file names are relative to it */
+    int dir_fd;
+
+    /* Is the folder a Maildir? */
+    bool maildir;
 
-  /* Vector containning all the messages in the maildrop */
-  std::vector<Message*> _messages;
+    /* Has the log of unique names been brought up to date? */
+    bool logged;
 
-  /* String */
-  std::string _folder_path;
+    /* The summaries of the headers, each ending in a 0 */
+    std::vector<char> summaries;
+
+    /* For each record, one more than the offset of its summary in
+     * summaries, 0 if it has none yet. Empty until Maildrop::summary
+     * is first called */
+    std::vector<uint32_t> summary;
+
+    /* Lines for the header cache that are not yet written */
+    std::string unsaved;
+
+    /* Lines in the header cache about messages that are gone */
+    size_t stale_summaries;
+  };
+
+  /* The methods below expect the index to be locked */
+
+  /**
+   * @param msg_nr The number of a message, which must exist
+   * @return Its record
+   */
+  Record& record (unsigned int msg_nr) const
+  {
+    return _index->records[msg_nr];
+  }
+
+  /**
+   * @return The file name of a message
+   */
+  const char* name (unsigned int msg_nr) const
+  {
+    return &_index->names[_index->records[msg_nr].name];
+  }
+
+  /**
+   * @return The path to the file of a message
+   */
+  std::string path (unsigned int msg_nr) const
+  {
+    return _index->folder_path + name(msg_nr);
+  }
+
+  /**
+   * @return Whether a message is marked as deleted by this session or
+   *   was deleted by another one
+   */
+  bool deleted (unsigned int msg_nr) const
+  {
+    return _deletions[msg_nr] || (_index->records[msg_nr].flags & Expunged);
+  }
+
+  /** Add a new message to the index
+   * @param name The name of the message file in the folder
+   */
+  void add_message (const std::string& name);
+
+  /** Find a message by its unique name (its uidl)
+   * @param uid The unique name
+   * @return The number of the message, -1 if there is none
+   */
+  int find_message (const std::string& uid) const;
+
+  /** Compute the sizes on the wire of the messages in a range that
+   * have none yet, from their wire form or by counting them, and add
+   * the counted ones to the header cache. Unlike the methods around
+   * it, it takes the lock itself and reads the files without it.
+   * @param first The first message
+   * @param last The message after the last one
+   */
+  void measure (size_t first, size_t last);
+
+  /** The size of a message on the wire, see Maildrop::measure; it
+   * takes the lock itself
+   * @return 0 if the message file is gone
+   */
+  unsigned long wire_size (unsigned int msg_nr);
+
+  /**
+   * @return The unique name of a message, the name of its file without
+   *   directory, sizes and flags in a Maildir
+   */
+  std::string unique_name (unsigned int msg_nr) const;
+
+  /**
+   * @param file_name The name of a message file, with or without
+   *   its directory
+   * @return The unique name of the message
+   */
+  std::string unique_name (const std::string& file_name) const;
+
+  /** Order of records by unique name, the same as that of
+   * std::string::compare (octets compared as unsigned) */
+  struct ByUniqueName;
+
+  /** Append the unique names of the messages that are not yet in the
+   * log, and rewrite the log without the names of messages that are
+   * gone once these are the majority
+   * @return A bool indicating if the log could be read and written
+   */
+  bool update_log ();
+
+  /** Read the header cache, the summaries of messages that are gone
+   * are skipped */
+  void load_summaries ();
+
+  /** Add the messages in a subdirectory of the folder
+   * @param subdir The name of the subdirectory, "" for the folder itself
+   * @param known Skip the messages that are in the maildrop already
+   * @return The number of messages added
+   * @exception std::runtime_error If it cannot be read
+   */
+  int read_directory (const std::string& subdir, bool known = false);
+
+  /** Write the summaries that are not yet in the header cache to it */
+  void write_summaries ();
+
+  /** Delete the messages this session marked as deleted, and if it is
+   * the last session rename the messages of a Maildir whose name must
+   * change
+   * @param last Is this the last session on the index?
+   * @return The path of a message that could not be deleted, "" if none
+   */
+  std::string update (bool last);
+
+  /** Rename a message of a Maildir to "cur", with its sizes and flags
+   * in its name */
+  void rename_message (unsigned int msg_nr);
+
+  /* Shared with the other sessions on the maildrop */
+  Index* _index;
+
+  /* The number of messages this session sees, Maildrop::refresh adds
+   * those delivered since */
+  size_t _visible;
+
+  /* For each message this session sees, is it marked as deleted? */
+  std::vector<bool> _deletions;
+
+  /* The number of messages marked as deleted */
+  unsigned int _deleted;
 };
 
 #endif	/* _MAILDROP_H */
-
@@ -1,7 +1,8 @@
 #include "maildrops.h"
 
-Maildrops::Maildrops (std::string folder_path) :
-_folder_path (folder_path) { }
+Maildrops::Maildrops (std::string folder_path, size_t levels, size_t width,
+                      size_t cache_size, SharedTable* table) :
+_layout (folder_path, levels, width, cache_size), _table (table) { }
 
 Maildrops::~Maildrops ()
 {
@@ -9,45 +10,90 @@ Maildrops::~Maildrops ()
     {
       delete (*it).second;
     }
+  for ( Shared::iterator it = _shared.begin(); it != _shared.end(); it++ )
+    {
+      delete (*it).second;
+    }
 }
 
 Maildrop* Maildrops::find_maildrop (const Player* player) const
 {
-  Maildrop * maildrop(_maildrops.find(player->name())->second);
+  Map::const_iterator it(_maildrops.find(player));
 
-  if ( maildrop )
-    return maildrop;
+  if ( it != _maildrops.end() )
+    return it->second;
   else
     return false;
 }
 
-bool Maildrops::new_maildrop (const Player* player)
+Maildrops::Result Maildrops::new_maildrop (const Player* player)
 {
   using namespace std;
-  DIR *dp; // pointer to the directory
-  string path("/exports/home/wvrossem/pop3/maildrops/" + player->name() + "/");
 
-  dp = opendir(path.c_str());
-  // Can we open the directory? If not, wrong username
-  if ( dp != NULL )
+  Shared::iterator shared(_shared.find(player->name()));
+  Maildrop* maildrop;
+
+  if ( shared == _shared.end() )
     {
-      pair<Map::iterator,bool> ret(_maildrops.insert
-                                    (Pair(player->name(), new Maildrop(path))));
-      closedir(dp);
-      /* Ret is a pair with as first element an iterator pointer pointing to
-       * the newly inserted element or the element with the same key.
-       * The second element is true if the insert was successful and
-       * false if an element with that key already existed
-       */
-      return ret.second;
+      string path;
+
+      // Does the user have a maildrop? If not, wrong username
+      if ( !_layout.resolve(player->name(), path) )
+        return Failed;
+      if ( _table && !_table->acquire(player->name()) )
+        return Locked;
+      try
+        {
+          maildrop = new Maildrop(path);
+        }
+      catch (runtime_error&)
+        {
+          if ( _table )
+            _table->release(player->name());
+          return Failed;
+        }
+      shared = _shared.insert(make_pair(player->name(), maildrop)).first;
     }
-  else
-    return false;
+
+  // The index is shared, only what was delivered since is read
+  maildrop = new Maildrop(*shared->second);
+  try
+    {
+      maildrop->refresh();
+    }
+  catch (runtime_error&) { }
+
+  pair<Map::iterator, bool> ret(_maildrops.insert(Pair(player, maildrop)));
+
+  /* Ret is a pair with as first element an iterator pointer pointing to
+   * the newly inserted element or the element with the same key.
+   * The second element is true if the insert was successful and
+   * false if an element with that key already existed
+   */
+  if ( !ret.second )
+    {
+      delete maildrop;
+      return Failed;
+    }
+  return Opened;
 }
 
 void Maildrops::remove_maildrop (const Player* player)
 {
-  Map::iterator it(_maildrops.find(player->name()));
-  delete it->second;
+  Map::iterator it(_maildrops.find(player));
+  Shared::iterator shared(_shared.find(player->name()));
+  Maildrop* maildrop(it->second);
+  Maildrop* last(0);
+
   _maildrops.erase(it);
+  // The shared maildrop goes with the last session on it
+  if ( shared->second->sessions() == 2 )
+    {
+      last = shared->second;
+      _shared.erase(shared);
+      if ( _table )
+        _table->release(player->name());
+    }
+  delete maildrop;
+  delete last;
 }
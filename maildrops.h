@@ -16,8 +16,18 @@
 
 #include "maildrop.h"
 #include "player.h"
+#include "layout.h"
+#include "sharedtable.h"
 
 /** The Maildrops class manages the different maildrops
+ *
+ * A user may have several sessions at once. Their maildrops share one
+ * index of the folder (see Maildrop): it is built when the first of
+ * them logs in, and kept in a maildrop of its own until the last one
+ * quits. A later session only reads the messages delivered since.
+ *
+ * In a prefork server, the maildrop of a user is open in one worker
+ * process at a time; the SharedTable tells which.
  */
 class Maildrops
 {
@@ -25,19 +35,37 @@ public:
   /** Constructor for Maildrops
    * @param folder_path String representing the folder where
    *                    the maildrops are located
+   * @param levels Number of levels of directories above a maildrop,
+   *               see Layout
+   * @param width Number of hexadecimal digits of a level's name
+   * @param cache_size Number of maildrop locations to remember
+   * @param table The table shared with the other worker processes,
+   *   0 if there are none
    */
-  Maildrops (std::string folder_path);
+  Maildrops (std::string folder_path, size_t levels = 0, size_t width = 2,
+             size_t cache_size = 0, SharedTable* table = 0);
 
   /** Destructor for Maildrops
-   * Deletes all the maildrops in the map
+   * Deletes all the maildrops in the maps
    */
   virtual ~Maildrops ();
 
-  /* Type of pair from name of the maildrop to the corresponding maildrop */
-  typedef std::pair<std::string, Maildrop*> Pair;
+  enum Result
+  {
+    Opened, /* The player has its maildrop */
+    Failed, /* Unknown user or unreadable maildrop */
+    Locked /* The maildrop is open in another worker process */
+  };
+
+  /* Type of pair from a player to its maildrop */
+  typedef std::pair<const Player*, Maildrop*> Pair;
 
-  /* Type of map from name of the maildrop to the corresponding maildrop */
-  typedef std::map<std::string, Maildrop*> Map;
+  /* Type of map from a player to its maildrop */
+  typedef std::map<const Player*, Maildrop*> Map;
+
+  /* Type of map from name of the maildrop to the maildrop its sessions
+   * are copied from */
+  typedef std::map<std::string, Maildrop*> Shared;
 
   /** Find the maildrop of the given player
    * @param player Player who's maildrop we need to find
@@ -45,15 +73,18 @@ public:
    */
   Maildrop* find_maildrop (const Player* player) const;
 
-  /** Add a maildrop for the player
+  /** Add a maildrop for the player, a session on the maildrop of the
+   * other sessions of the user if there are any
    * The name of the player will be used to find the path to the maildrop
    * @param player Player who's maildrop we need to create
-   * @return A bool indicating if the operation succeeded
+   * @return Whether the maildrop was opened
    */
-  bool new_maildrop (const Player* player);
+  Result new_maildrop (const Player* player);
 
-  /** Remove the maildrop of the player
+  /** Remove the maildrop of the player, the messages it marked as
+   * deleted are deleted
    * @param player Player who's maildrop we need to delete
+   * A message file that can't be deleted is logged
    */
   void remove_maildrop (const Player* player);
 
@@ -62,13 +93,22 @@ private:
   Maildrops (const Maildrops& orig);
 
   /** Collection of maildrops
-   * Key = name of the maildrop
-   * Value = the maildrop 
+   * Key = the player
+   * Value = its maildrop
    */
   Map _maildrops;
 
-  /* String indicating the path to the maildrops */
-  std::string _folder_path;
+  /** The maildrops that are open
+   * Key = name of the maildrop
+   * Value = a session on it that belongs to no player
+   */
+  Shared _shared;
+
+  /* Where the maildrops are located */
+  Layout _layout;
+
+  /* Shared with the other worker processes, may be 0 */
+  SharedTable* _table;
 };
 
 #endif	/* _MAILDROPS_H */
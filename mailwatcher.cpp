@@ -0,0 +1,188 @@
+#include <cerrno>
+#include <stdexcept>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "mailwatcher.h"
+#include "pool.h"
+#include "metrics.h"
+
+MailWatcher::MailWatcher (Pool& pool, size_t max_watched, size_t debug_level,
+                          Dv::Debugable* debug) :
+Dv::Thread::Thread (false, debug_level, debug), _pool (pool),
+_max_watched (max_watched), _inotify (inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+_epoll (epoll_create1(EPOLL_CLOEXEC)), _stop_fd (eventfd(0, EFD_CLOEXEC))
+{
+  struct epoll_event inotify_event, stop_event;
+
+  inotify_event.events = EPOLLIN;
+  inotify_event.data.ptr = &_inotify;
+  stop_event.events = EPOLLIN;
+  stop_event.data.ptr = &_stop_fd;
+  if ( _inotify < 0 || _epoll < 0 || _stop_fd < 0
+       || epoll_ctl(_epoll, EPOLL_CTL_ADD, _inotify, &inotify_event) != 0
+       || epoll_ctl(_epoll, EPOLL_CTL_ADD, _stop_fd, &stop_event) != 0 )
+    {
+      close(_inotify);
+      close(_epoll);
+      close(_stop_fd);
+      throw std::runtime_error("unable to create mail watcher");
+    }
+}
+
+MailWatcher::~MailWatcher ()
+{
+  close(_inotify);
+  close(_epoll);
+  close(_stop_fd);
+}
+
+bool MailWatcher::watch (Player* player, const std::string& directory)
+{
+  Lock lock(_mutex);
+
+  forget(player);
+  if ( _watched.size() >= _max_watched )
+    return false;
+
+  // A directory that is already watched gives the same watch
+  int wd(inotify_add_watch(_inotify, directory.c_str(),
+                           IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR));
+
+  if ( wd < 0 )
+    return false;
+  _watches[wd].insert(player);
+  _watched[player] = wd;
+  return true;
+}
+
+void MailWatcher::unwatch (Player* player)
+{
+  Lock lock(_mutex);
+
+  forget(player);
+}
+
+void MailWatcher::forget (Player* player)
+{
+  std::map<Player*, int>::iterator it(_watched.find(player));
+
+  if ( it == _watched.end() )
+    return;
+
+  std::map<int, Player::Set>::iterator watch(_watches.find(it->second));
+
+  if ( watch != _watches.end() )
+    {
+      watch->second.erase(player);
+      if ( watch->second.empty() )
+        {
+          inotify_rm_watch(_inotify, watch->first);
+          _watches.erase(watch);
+        }
+    }
+  _watched.erase(it);
+}
+
+void MailWatcher::park (Player* player)
+{
+  Lock lock(_mutex);
+  struct epoll_event input, wake;
+
+  input.events = EPOLLIN | EPOLLRDHUP;
+  input.data.ptr = player;
+  wake.events = EPOLLIN;
+  wake.data.ptr = player;
+  _parked.insert(player);
+  if ( epoll_ctl(_epoll, EPOLL_CTL_ADD, player->socket(), &input) != 0
+       || epoll_ctl(_epoll, EPOLL_CTL_ADD, player->wake_fd(), &wake) != 0 )
+    resume(player); // it cannot wait here, so it waits on a thread
+  else
+    Metrics::add(Metrics::Parked);
+}
+
+void MailWatcher::resume (Player* player)
+{
+  // Removing a descriptor that was not added is harmless
+  epoll_ctl(_epoll, EPOLL_CTL_DEL, player->socket(), 0);
+  epoll_ctl(_epoll, EPOLL_CTL_DEL, player->wake_fd(), 0);
+  _parked.erase(player);
+  forget(player);
+  _pool.submit(player);
+}
+
+void MailWatcher::notify (int wd)
+{
+  for ( std::map<int, Player::Set>::iterator watch = _watches.begin();
+        watch != _watches.end(); ++watch )
+    {
+      if ( wd >= 0 && watch->first != wd )
+        continue;
+      for ( Player::Set::iterator p = watch->second.begin();
+            p != watch->second.end(); ++p )
+        (*p)->mail_arrived();
+    }
+}
+
+void MailWatcher::stop ()
+{
+  uint64_t one(1);
+
+  if ( write(_stop_fd, &one, sizeof (one)) != sizeof (one) )
+    log() << "unable to stop mail watcher" << std::endl;
+}
+
+int MailWatcher::main ()
+{
+  static const int max_events(64);
+  struct epoll_event events[max_events];
+  // Room for at least one event with the longest name
+  char buffer[64 * (sizeof (struct inotify_event) + 256)];
+
+  while ( true )
+    {
+      int n(epoll_wait(_epoll, events, max_events, -1));
+
+      if ( n < 0 && errno != EINTR )
+        return 1;
+
+      /* Players are neither parked nor destroyed while the watcher is
+       * locked, so a player in _parked is not stale */
+      Lock lock(_mutex);
+
+      for ( int i = 0; i < n; i++ )
+        {
+          if ( events[i].data.ptr == &_stop_fd )
+            return 0;
+          if ( events[i].data.ptr == &_inotify )
+            {
+              ssize_t size;
+
+              while ( (size = read(_inotify, buffer, sizeof (buffer))) > 0 )
+                for ( char* p = buffer; p < buffer + size; )
+                  {
+                    struct inotify_event* event(reinterpret_cast<inotify_event*> (p));
+
+                    // Events were lost, anyone may have new mail
+                    if ( event->mask & IN_Q_OVERFLOW )
+                      notify(-1);
+                    // Not the log of unique names or a directory
+                    else if ( event->len && event->name[0] != '.'
+                              && !(event->mask & IN_ISDIR) )
+                      notify(event->wd);
+                    p += sizeof (struct inotify_event) + event->len;
+                  }
+              continue;
+            }
+
+          Player* player(static_cast<Player*> (events[i].data.ptr));
+
+          // The player may have been resumed by an earlier event
+          if ( _parked.count(player) )
+            resume(player);
+        }
+    }
+}
@@ -0,0 +1,119 @@
+/*
+ * File:   mailwatcher.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _MAILWATCHER_H
+#define	_MAILWATCHER_H
+
+#include <string>
+#include <map>
+#include <cstddef>
+
+#include <dvthread/thread.h>
+
+#include "sync.h"
+#include "player.h"
+
+class Pool;
+
+/** A thread that lets logged in sessions wait for new mail (the IDLE
+ * command) without holding a thread of the Pool each.
+ *
+ * The manager watches the directory where mail for the player's user is
+ * delivered, using a single inotify descriptor for all of them. Once the
+ * player has sent its reply, it parks: it gives its worker back to the
+ * pool, and the watcher waits (with epoll) for input on its connection
+ * or for its wake-up descriptor. A delivery is told to the player as
+ * out-of-band data (see Player::put), which wakes it up. Any of these
+ * events resumes the player: it is submitted to the pool again.
+ *
+ * An expired deadline or Player::kill also wake the player up, so a
+ * parked player notices them as it would while running.
+ */
+class MailWatcher : public Dv::Thread::Thread
+{
+public:
+  /** Constructor for MailWatcher
+   * @param pool The pool that runs the players that are resumed
+   * @param max_watched Most players waiting for new mail at once
+   * @param debug_level only if the master debug level is larger
+   *   than this level will debug output be generated
+   * @param debug object (may be 0)
+   * @exception std::runtime_error If the descriptors cannot be created
+   */
+  MailWatcher (Pool& pool, size_t max_watched, size_t debug_level,
+               Dv::Debugable* debug);
+
+  /** Destructor for MailWatcher
+   * Closes the descriptors
+   */
+  ~MailWatcher ();
+
+  /** Tell a player when mail is delivered in a directory, until it is
+   * resumed or MailWatcher::unwatch is called. Called by the manager.
+   * @param player to tell, see Player::mail_arrived
+   * @param directory String representing the path to the directory
+   * @return false if there are too many players waiting or the
+   *   directory cannot be watched
+   */
+  bool watch (Player* player, const std::string& directory);
+
+  /** Stop telling a player about new mail, it is harmless if it
+   * is not watched
+   * @param player to forget
+   */
+  void unwatch (Player* player);
+
+  /** Take over a player that is watched: it is submitted to the pool
+   * again when it has input or is woken up. Called by the thread
+   * running the player, as the last thing it does: the player may run
+   * on another thread once this returns.
+   * @param player to park
+   */
+  void park (Player* player);
+
+  /** Stop the thread, called once no players are left */
+  void stop ();
+
+private:
+  MailWatcher (const MailWatcher&);
+  MailWatcher& operator= (const MailWatcher&);
+
+  int main ();
+
+  /** Tell the players watching a directory that mail arrived, the
+   * watcher is locked
+   * @param wd The inotify watch of the directory, -1 for all
+   */
+  void notify (int wd);
+
+  /** Forget a player, the watcher is locked */
+  void forget (Player* player);
+
+  /** Submit a parked player to the pool again, the watcher is locked */
+  void resume (Player* player);
+
+  Pool& _pool;
+
+  size_t _max_watched;
+
+  int _inotify;
+  int _epoll;
+  /* An eventfd that becomes readable when the thread must stop */
+  int _stop_fd;
+
+  Mutex _mutex;
+
+  /* Key = inotify watch, Value = the players waiting for it */
+  std::map<int, Player::Set> _watches;
+
+  /* Key = player that waits for new mail, Value = its inotify watch */
+  std::map<Player*, int> _watched;
+
+  /* The players that gave their thread back */
+  Player::Set _parked;
+};
+
+#endif	/* _MAILWATCHER_H */
@@ -1,28 +1,83 @@
 #include <string>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include <dvutil/strings.h>
 #include <dvutil/enum2str.h>
 
 #include "command.h"
 #include "manager.h"
-
-Manager::Manager (const std::string& name, const Dv::Props& config, Dv::Debugable* debug) :
+#include "wirecache.h"
+#include "credentials.h"
+#include "tokenbucket.h"
+#include "logger.h"
+#include "trace.h"
+
+Manager::Manager (const std::string& name, const Dv::Props& config, Pool& pool,
+                  SharedTable* table, Router* router, Dv::Debugable* debug) :
 thread_ (name, *this, config ("timeout"), 0, config ("debuglevel"), debug),
-done_ (false), config_ (config), _maildrops (config ("top").str ()) { }
+done_ (false), shutdown_fd_ (eventfd (0, EFD_CLOEXEC)), config_ (config),
+timers_ (config ("tick"), config ("debuglevel"), debug), window_ (config ("window")),
+wireform_ (config ("wireform").str ()),
+_maildrops (config ("top").str (), config ("hashlevels"), config ("hashwidth"),
+            config ("layoutcache"), table), _table (table), _router (router),
+_authenticator (Credentials::make (config ("auth").str (), config ("authdb").str ()),
+                config ("authcache"),
+                config ("authfailures").get<double> () / 60,
+                config ("authfailures").get<double> ()),
+_verifier (*this, config ("debuglevel"), debug),
+_shaping (config),
+_admission (config ("maxsessions"), config ("maxperaddress"),
+            config ("maxperuser"), config ("maxpending"),
+            config ("directors").str ()), _queue (config ("quantum")),
+_recorder (_queue, config ("flightfile").str (), config ("flightsize"),
+           config ("slowcommand"), config ("flightwindow"), config ("debuglevel"), debug),
+_prefetcher (config ("prefetchqueue"), config ("debuglevel"), debug),
+_prefetch_depth (config ("prefetchdepth")),
+_prefetch_budget (static_cast<unsigned long> (config ("prefetchbudget")) * 1024),
+_watcher (pool, config ("maxidle"), config ("debuglevel"), debug),
+_shedder (config ("shedtarget").get<double> () / 1000,
+          config ("shedinterval").get<double> () / 1000), _charge (0),
+_deferred (false)
+{
+  // The timeouts are given in seconds
+  timeouts_.idle = static_cast<size_t> (config("idletimeout")) * 1000;
+  timeouts_.authorization = static_cast<size_t> (config("authtimeout")) * 1000;
+  timeouts_.command = static_cast<size_t> (config("commandtimeout")) * 1000;
+  timers_.start();
+  _prefetcher.start();
+  _verifier.start();
+  _watcher.start();
+  _recorder.start();
+}
 
 void
 Manager::kill ()
 {
-  // Kill all the player threads.
+  // Kill all the players.
   for ( Player::Set::iterator p = players_.begin(); p != players_.end(); ++p )
     ( *p )->kill();
-  // And wait for them to finish.
-  for ( Player::Set::iterator p = players_.begin(); p != players_.end(); ++p )
-    ( *p )->wait();
+  // And wait for them to finish, the pool deletes them. The
+  // watcher resumes those that wait for new mail.
+  while ( Player::count() )
+    usleep(10000);
+  _watcher.stop();
+  _watcher.join();
+  _recorder.stop();
+  _recorder.join();
+  // It tells the manager thread of the checks it makes
+  _verifier.stop();
+  _verifier.join();
   // Now kill the manager thread.
   thread_.kill();
   // And wait for it to finish.
   thread_.join();
+  // No player needs its deadlines anymore.
+  timers_.kill();
+  timers_.join();
+  _prefetcher.stop();
+  _prefetcher.join();
 }
 
 void
@@ -34,23 +89,234 @@ Manager::remove_player (Player* p)
       roots_.erase(p);
       players_by_name_.erase(p->name());
       players_.erase(p);
+      _players_states.erase(p);
+      _readahead.erase(p);
+      _verifying.erase(p);
+      if ( !p->name().empty() )
+        _admission.release(p->name());
       p->kill();
     }
 }
 
-std::string
-Manager::operator()(const Player::Message& m) throw (std::runtime_error)
+void
+Manager::prefetch (Player* p, Maildrop* maildrop, int msg_nr)
+{
+  std::map<Player*, Readahead>::iterator it(_readahead.find(p));
+
+  if ( it == _readahead.end() )
+    return;
+
+  Readahead& readahead(it->second);
+  size_t ahead(0);
+
+  for ( int n = msg_nr + 1; n < maildrop->nr_of_messages(true)
+        && ahead < readahead.depth(); n++ )
+    {
+      Message message(maildrop->retrieve_message(n));
+
+      if ( !message.valid() )
+        continue;
+      ahead++;
+
+      unsigned long size(maildrop->file_size(n));
+
+      if ( readahead.wanted(n, size) )
+        {
+          _prefetcher.prefetch(message.file_path());
+          readahead.prefetched(n, size);
+        }
+    }
+}
+
+bool
+Manager::loopback (const std::string& address)
+{
+  return address.compare(0, 4, "127.") == 0 || address == "::1"
+          || address.compare(0, 11, "::ffff:127.") == 0;
+}
+
+bool
+Manager::claim_name (Player* p, const std::string& name)
+{
+  if ( !p->name().empty() )
+    _admission.release(p->name());
+  p->set_name("");
+  if ( !_admission.claim(name) )
+    {
+      Metrics::add(Metrics::RefusedUser);
+      return false;
+    }
+  p->set_name(name);
+  return true;
+}
+
+Reply
+Manager::authorize (Player* p, Authenticator::Result result)
+{
+  switch (result)
+    {
+      case Authenticator::Accepted:
+        break;
+      case Authenticator::Throttled:
+        return std::string("-ERR [SYS/TEMP] too many failed logins, try again later");
+      default:
+        return std::string("-ERR [AUTH] invalid username or password");
+    }
+
+  // Other sessions of the user share the maildrop, see Maildrops
+  switch (_maildrops.new_maildrop(p))
+    {
+      case Maildrops::Opened:
+        break;
+      case Maildrops::Locked:
+        // The player sends this only if its session cannot move there
+        if ( _router && p->hops() < Router::MaxHops )
+          {
+            int owner(_table->owner(p->name()));
+
+            if ( owner >= 0 )
+              p->move(owner);
+          }
+        return std::string("-ERR [IN-USE] maildrop open in another process");
+      default:
+        return std::string("-ERR [SYS/PERM] unable to open maildrop");
+    }
+  // The player enters the transaction state
+  _players_states[p] = Transaction;
+  _readahead[p] = Readahead(_prefetch_depth, _prefetch_budget);
+  p->authorized();
+  p->limit(_shaping.connection(p->name()));
+  p->share(_shaping.acquire(p->name()));
+  return std::string("+OK maildrop locked and ready");
+}
+
+void
+Manager::finish_logins ()
+{
+  Player* p;
+  Authenticator::Check check;
+  bool ok;
+
+  while ( _verifier.take(p, check, ok) )
+    {
+      // Failures count even if the player went away meanwhile
+      Authenticator::Result result(_authenticator.verified(check, ok));
+      std::map<Player*, Verifying>::iterator it(_verifying.find(p));
+
+      if ( it == _verifying.end() )
+        continue;
+
+      Verifying verifying(it->second);
+
+      _verifying.erase(it);
+
+      Reply reply(authorize(p, result));
+
+      // The storage time of this login alone, the check included
+      p->timed(verifying.pushed, verifying.popped, TokenBucket::now(),
+               FlightRecorder::storage());
+      verifying.mbox->put(reply);
+    }
+}
+
+Reply
+Manager::operator()(const Player::Message&) throw (std::runtime_error)
+{
+  FairQueue::Request request;
+
+  if ( !_queue.pop(request) )
+    return Reply();
+
+  TRACE_CONTEXT(request.session, request.sequence);
+  // From the player's request to here, the token in the mailbox included
+  TRACE_RECORD("manager.queued", static_cast<uint64_t> (request.pushed * 1000000),
+               Trace::now());
+  TRACE_SPAN("manager.handle");
+  Reply reply;
+  // The queue's clock reads also time the request for the flight recorder
+  double popped(TokenBucket::now());
+
+  FlightRecorder::storage(); // not spent on this request
+  _charge = 0;
+  _deferred = false;
+  try
+    {
+      if ( shed(request, popped) )
+        reply = std::string("-ERR [SYS/TEMP] server busy, try again later");
+      else
+        reply = handle(request.message);
+    }
+  catch (std::runtime_error&)
+    {
+      _queue.charge(request, 0, TokenBucket::now());
+      throw;
+    }
+
+  double handled(TokenBucket::now());
+
+  _queue.charge(request, reply.status().size() + _charge, handled);
+  // The password is being checked, the player gets its reply later
+  if ( _deferred && request.mbox )
+    {
+      Verifying verifying = { request.mbox, request.pushed, popped };
+
+      _verifying[request.message.first] = verifying;
+    }
+  else if ( request.mbox )
+    {
+      // The player waits for the reply, it is still there
+      request.message.first->timed(request.pushed, popped, handled,
+                                   FlightRecorder::storage());
+      request.mbox->put(reply);
+    }
+  return Reply();
+}
+
+bool
+Manager::shed (const FairQueue::Request& request, double now)
+{
+  double sojourn(now - request.pushed);
+  const std::string& c(request.command);
+
+  Metrics::add(Metrics::QueueMicros, static_cast<unsigned long> (sojourn * 1000000));
+  if ( !_shedder.overloaded(sojourn, now) )
+    return false;
+
+  if ( c == "pass" || c == "apop" )
+    {
+      Metrics::add(Metrics::ShedLogins);
+      return true;
+    }
+
+  // LIST and UIDL are cheap for a single message
+  std::istringstream iss(request.message.second);
+  std::string word, argument;
+  bool all(!(iss >> word >> argument));
+
+  if ( c == "retr" || c == "top" || c == "stats" || c == "xmeta"
+       || ((c == "list" || c == "uidl") && all) )
+    {
+      Metrics::add(Metrics::ShedCommands);
+      return true;
+    }
+  return false;
+}
+
+Reply
+Manager::handle (const Player::Message& m) throw (std::runtime_error)
 {
   // Status indicators
   static const std::string ok("+OK");
   static const std::string error("-ERR");
 
-  static const std::string anonymous("anonymous");
+  // Queued by the Verifier, see Manager::verified
+  if ( !m.first )
+    {
+      finish_logins();
+      return Reply();
+    }
 
-  // logging output to server console
-  log() << "< "
-          << (m.first->name().size() ? m.first->name() : anonymous)
-          << ":" << m.second << std::endl;
+  Logger::write(Logger::Debug, Logger::Command, m.first->id(), m.second);
 
   // dump the message to an string stream for easy parsing
   std::istringstream iss(m.second);
@@ -58,7 +324,7 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
   // read first word of command, it should correspond to one
   // of the Command values.
   if ( !(iss >> command_word) )
-    return "syntax error";
+    return std::string("syntax error");
   try
     {
       // the following will throw if there is no value in Command
@@ -70,6 +336,14 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
           // don't know it yet).
           if ( players_.count(m.first) == 0 )
             throw std::runtime_error("abandon request from killed player");
+          // The player was told of new mail, its commands see it
+          if ( m.first->new_mail() )
+            {
+              Maildrop * maildrop(_maildrops.find_maildrop(m.first));
+
+              if ( maildrop )
+                maildrop->refresh();
+            }
         }
       switch (c)
         {
@@ -77,10 +351,11 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
             {
               players_.insert(m.first);
               _players_states.insert(std::pair<Player*, State > (m.first, Authorization));
+              m.first->limit(_shaping.connection());
               return ok;
             }
             break;
-          case USER: // USER name -- sending player logs in with the username
+          case USER: // USER name -- sending player gives the username
             {
               std::map<Player*, State>::iterator it(_players_states.find(m.first));
 
@@ -91,17 +366,10 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
                   // Did the user enter a username?
                   if ( iss >> user_name )
                     {
-                      std::map<Player*, State>::iterator it(_players_states.find(m.first));
-                      // The player's name is set find his or her maildrop later
-                      it->first->set_name(user_name);
-                      // The player enters the transaction name
-                      if ( _maildrops.new_maildrop(m.first) )
-                        {
-                          it->second = Transaction;
-                          return ok;
-                        }
-                      else
-                        return error + " invalid username";
+                      // The player's name is set to check the password later
+                      if ( !claim_name(it->first, user_name) )
+                        return error + " [IN-USE] too many sessions for this user";
+                      return ok;
                     }
                   else
                     return error + " user <username>";
@@ -115,11 +383,56 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
               std::map<Player*, State>::iterator it(_players_states.find(m.first));
 
               if ( it->second == Authorization )
-                return ok;
+                {
+                  std::string password;
+
+                  if ( m.first->name().empty() )
+                    return error + " use 'user <username>' first";
+                  // The password is the rest of the line, it may contain spaces
+                  std::getline(iss >> std::ws, password);
+
+                  Authenticator::Check check;
+                  Authenticator::Result result(_authenticator.pass(m.first->address(),
+                                                                   m.first->name(),
+                                                                   password, check));
+
+                  if ( result != Authenticator::Verifying )
+                    return authorize(m.first, result);
+                  // Replied to by Manager::finish_logins
+                  _verifier.verify(m.first, check);
+                  _deferred = true;
+                  return Reply();
+                }
+              else
+                return error;
+            }
+          case APOP: // APOP name digest -- sending player logs in with a digest
+            {
+              std::map<Player*, State>::iterator it(_players_states.find(m.first));
+
+              if ( it->second == Authorization )
+                {
+                  std::string user_name;
+                  std::string digest;
+
+                  if ( iss >> user_name >> digest )
+                    {
+                      if ( !claim_name(it->first, user_name) )
+                        return error + " [IN-USE] too many sessions for this user";
+                      return authorize(m.first,
+                                       _authenticator.apop(m.first->address(),
+                                                           user_name,
+                                                           m.first->banner(),
+                                                           digest));
+                    }
+                  else
+                    return error + " apop <username> <digest>";
+                }
               else
                 return error;
             }
           case QUIT: // QUIT -- sending player quits
+          case ABORT: // ABORT -- sending player ends without QUIT
             {
               std::map<Player*, State>::iterator it(_players_states.find(m.first));
 
@@ -127,7 +440,12 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
                * his or her maildrop */
               if ( it->second == Transaction )
                 {
+                  // Without QUIT there is no UPDATE state: nothing is deleted
+                  if ( c == ABORT )
+                    _maildrops.find_maildrop(m.first)->reset();
                   _maildrops.remove_maildrop(m.first);
+                  m.first->share(0);
+                  _shaping.release(m.first->name());
                   remove_player(m.first);
                   return ok;
                 }
@@ -168,13 +486,35 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
                   // Did the player enter a message number?
                   if ( (iss >> msg_nr) )
                     {
-                      Message * message(maildrop->retrieve_message(msg_nr));
-                      if ( message )
+                      Message message(maildrop->retrieve_message(msg_nr));
+                      std::string path;
+                      int wire(-1);
+                      // Opened now, another session may expunge or rename it
+                      int fd(message.valid()
+                             ? message.open(path, wireform_ == "none" ? 0 : &wire) : -1);
+
+                      if ( message.valid() && fd < 0 )
+                        return error + " message was deleted";
+                      if ( message.valid() )
                         {
-                          oss << ok << " " << message->size()
-                                  << " octets" << std::endl
-                                  << message->message_string() << std::endl;
-                          return oss.str();
+                          oss << ok << " " << message.size() << " octets";
+                          _charge = message.size();
+                          maildrop->seen(msg_nr);
+                          _readahead[m.first].retrieved(msg_nr);
+                          prefetch(m.first, maildrop, msg_nr);
+                          if ( wireform_ == "none" )
+                            return Reply(oss.str(), new FileBody(fd, window_));
+                          // Send the saved wire form or save it while sending
+                          if ( wire >= 0 )
+                            {
+                              close(fd);
+                              return Reply(oss.str(), new WireBody(wire, window_));
+                            }
+                          return Reply(oss.str(),
+                                       new FileBody(fd, window_, -1,
+                                                    WireCache::make_directory(path)
+                                                    ? WireCache::wire_path(path)
+                                                    : ""));
                         }
                       else
                         return error + " invalid message number";
@@ -224,11 +564,11 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
                   // Message number is given
                   if ( iss >> msg_nr )
                     {
-                      Message * message(maildrop->retrieve_message(msg_nr));
+                      Message message(maildrop->retrieve_message(msg_nr));
 
-                      if ( message )
+                      if ( message.valid() )
                         {
-                          oss << ok << " " << (*message);
+                          oss << ok << " " << message;
                           return oss.str();
                         }
                       else
@@ -237,16 +577,14 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
                     // Give list info for each message
                   else
                     {
-                      std::vector<Message*> msgs(maildrop->messages());
-
                       oss << ok << " " << maildrop->nr_of_messages() << " messages "
-                              << "(" << maildrop->size() << " octets)" << std::endl;
-
-                      for ( unsigned int i = 0; i < msgs.size(); i++ )
-                        {
-                          oss << (*msgs[i]) << std::endl;
-                        }
-                      return oss.str();
+                              << "(" << maildrop->size() << " octets)";
+                      // About the size of a "nr size" line
+                      _charge = maildrop->nr_of_messages() * 16;
+                      prefetch(m.first, maildrop, -1);
+                      return Reply(oss.str(),
+                                   new ListingBody(*maildrop,
+                                                   ListingBody::Scan, window_));
                     }
                 }
               else
@@ -276,11 +614,11 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
                   // Message number is given
                   if ( iss >> msg_nr )
                     {
-                      Message * message(maildrop->retrieve_message(msg_nr));
+                      Message message(maildrop->retrieve_message(msg_nr));
 
-                      if ( message )
+                      if ( message.valid() )
                         {
-                          oss << msg_nr << " " << message->uidl() << "\n";
+                          oss << msg_nr << " " << message.uidl();
                           return ok + " " + oss.str();
                         }
                       else
@@ -289,13 +627,12 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
                     // Give uidl for each message in the maildrop
                   else
                     {
-                      std::vector<Message*> msgs(maildrop->messages());
-
-                      for ( unsigned int i = 0; i < msgs.size(); i++ )
-                        {
-                          oss << msgs.at(i)->number() << " " << msgs.at(i)->uidl() << std::endl;
-                        }
-                      return oss.str();
+                      // About the size of a "nr uid" line
+                      _charge = maildrop->nr_of_messages() * 40;
+                      prefetch(m.first, maildrop, -1);
+                      return Reply(ok,
+                                   new ListingBody(*maildrop,
+                                                   ListingBody::Uidl, window_));
                     }
                 }
               else
@@ -317,13 +654,19 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
                       int n;
                       if ( iss >> n )
                         {
-                          Message * message(maildrop->retrieve_message(msg_nr));
-
-                          if ( message )
+                          Message message(maildrop->retrieve_message(msg_nr));
+                          std::string path;
+                          // Opened now, another session may expunge or rename it
+                          int fd(message.valid() ? message.open(path) : -1);
+
+                          if ( message.valid() && fd < 0 )
+                            return error + " message was deleted";
+                          if ( message.valid() )
                             {
-                              oss << ok << " " << message->size() << " " << "\n";
-                              oss << message->message_string(n) << "\n";
-                              return oss.str();
+                              oss << ok << " " << message.size();
+                              // At most the whole message
+                              _charge = message.size();
+                              return Reply(oss.str(), new FileBody(fd, window_, n));
                             }
                           else
                             return error + " invalid message number";
@@ -349,12 +692,12 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
 
                   if ( maildrop )
                     {
-                      std::vector<Message*> msgs(maildrop->messages(true));
+                      std::vector<Message> msgs(maildrop->messages(true));
 
                       for ( unsigned int i = 0; i < msgs.size(); i++ )
                         {
-                          if ( msgs.at(i)->deleted() )
-                            msgs.at(i)->deleted(false);
+                          if ( msgs.at(i).deleted() )
+                            msgs.at(i).deleted(false);
                         }
                       oss << ok << " maildrop has " << maildrop->nr_of_messages()
                               << " messages (" << maildrop->size() << " octets)";
@@ -365,9 +708,140 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
                 return error + " use 'user <username>' first";
             }
             break;
+          case CAPA: // CAPA -- list the capabilities, in any state
+            {
+              static const std::string capabilities("TOP\r\n"
+                                                    "USER\r\n"
+                                                    "UIDL\r\n"
+                                                    "RESP-CODES\r\n"
+                                                    "AUTH-RESP-CODE\r\n"
+                                                    "XUIDL\r\n"
+                                                    "IDLE\r\n"
+                                                    "XMETA\r\n");
+
+              return Reply(ok + " capability list follows",
+                           new TextBody(capabilities, window_));
+            }
+          case XUIDL: // XUIDL [cursor] -- get uidl of the messages added after cursor
+            {
+              std::map<Player*, State>::iterator it(_players_states.find(m.first));
+
+              if ( it->second == Transaction )
+                {
+                  Maildrop * maildrop(_maildrops.find_maildrop(m.first));
+                  std::string cursor, next;
+                  std::vector<int> numbers;
+
+                  iss >> cursor;
+                  if ( !maildrop->added_since(cursor, numbers, next) )
+                    return error + " invalid cursor, use 'xuidl' without one";
+
+                  std::ostringstream oss;
+                  for ( size_t i = 0; i < numbers.size(); i++ )
+                    oss << numbers[i] << " "
+                            << maildrop->retrieve_message(numbers[i]).uidl() << "\r\n";
+                  _charge = oss.str().size();
+                  return Reply(ok + " " + next, new TextBody(oss.str(), window_));
+                }
+              else
+                return error + " use 'user <username>' first";
+            }
+          case IDLE: // IDLE -- wait for new mail, any command ends the wait
+            {
+              std::map<Player*, State>::iterator it(_players_states.find(m.first));
+
+              if ( it->second == Transaction )
+                {
+                  Maildrop * maildrop(_maildrops.find_maildrop(m.first));
+
+                  if ( !_watcher.watch(m.first, maildrop->delivery_path()) )
+                    return error + " [SYS/TEMP] unable to wait for new mail";
+                  // Mail delivered before the watch started is not missed
+                  if ( maildrop->refresh() )
+                    {
+                      _watcher.unwatch(m.first);
+                      return ok + " new mail";
+                    }
+                  m.first->idle();
+                  return ok + " waiting for new mail";
+                }
+              else
+                return error + " use 'user <username>' first";
+            }
+          case XMETA: // XMETA -- get size, uidl and header summary of all messages
+            {
+              std::map<Player*, State>::iterator it(_players_states.find(m.first));
+
+              if ( it->second == Transaction )
+                {
+                  Maildrop * maildrop(_maildrops.find_maildrop(m.first));
+                  std::ostringstream oss;
+
+                  // The body reads the header cache, not the manager
+                  oss << ok << " " << maildrop->nr_of_messages() << " messages";
+                  // About the size of a line with a summary
+                  _charge = maildrop->nr_of_messages() * 160;
+                  prefetch(m.first, maildrop, -1);
+                  return Reply(oss.str(),
+                               new ListingBody(*maildrop, ListingBody::Meta, window_));
+                }
+              else
+                return error + " use 'user <username>' first";
+            }
+          case ADOPT: // ADOPT -- take over a session moved here, see Player::adopt
+            {
+              std::map<Player*, State>::iterator it(_players_states.find(m.first));
+
+              // Only the player sends it, before any command of the client
+              if ( it->second == Authorization && !m.first->moved().empty() )
+                {
+                  // The user logged in on the worker that moved it
+                  if ( !claim_name(it->first, m.first->moved()) )
+                    return error + " [IN-USE] too many sessions for this user";
+                  return authorize(m.first, Authenticator::Accepted);
+                }
+              else
+                return error;
+            }
+          case XADDR: // XADDR address -- a director tells the address of its client
+            {
+              std::map<Player*, State>::iterator it(_players_states.find(m.first));
+              std::string address;
+
+              // Only from a director, once, before the client gave a name
+              if ( it->second != Authorization || !m.first->name().empty()
+                   || m.first->forwarded() || !_admission.director(m.first->address())
+                   || !(iss >> address) )
+                return error;
+              if ( !_admission.forwarded(address) )
+                {
+                  Metrics::add(Metrics::RefusedAddress);
+                  Logger::write(Logger::Info, Logger::Refuse, m.first->id(), address);
+                  return error + " [IN-USE] too many sessions from your address";
+                }
+              m.first->forwarded(address);
+              return ok;
+            }
+          case STATS: // STATS -- show the metrics of the server
+            {
+              std::map<Player*, State>::iterator it(_players_states.find(m.first));
+
+              // Only for clients that logged in, or on the server's own host
+              if ( it->second != Transaction && !loopback(m.first->address()) )
+                return error + " use 'user <username>' first";
+
+              std::string report(Metrics::report() + _queue.report());
+
+              _charge = report.size();
+              return Reply(ok, new TextBody(report, window_));
+            }
           case SHUTDOWN: // SHUTDOWN -- shutdown server, only for convenience
             {
               done_ = true;
+              // Wake up the main program and the acceptors
+              uint64_t one(1);
+              if ( write(shutdown_fd_, &one, sizeof (one)) != sizeof (one) )
+                log() << "unable to signal shutdown" << std::endl;
               return ok;
             }
           default:
@@ -377,7 +851,7 @@ Manager::operator()(const Player::Message& m) throw (std::runtime_error)
   catch (std::logic_error& e)
     {
       log() << e.what() << std::endl;
-      return "syntax error";
+      return std::string("syntax error");
     }
-  return "impossible reply";
+  return std::string("impossible reply");
 }
@@ -19,6 +19,13 @@
 
 #include "player.h"
 #include "maildrops.h"
+#include "authenticator.h"
+#include "shaping.h"
+#include "fairqueue.h"
+#include "loadshedder.h"
+#include "prefetcher.h"
+#include "mailwatcher.h"
+#include "flightrecorder.h"
 
 /** The class that manages the maildrops. It communicates with
  * the players via an Dv::Thread::Actor thread which itself
@@ -26,8 +33,8 @@
  * waits for messages to be delivered to its mailbox and
  * then processes them using the Manager::operator() function.
  */
-class Manager : public std::unary_function<Player::Message, std::string>,
-public Player::Manager
+class Manager : public std::unary_function<Player::Message, Reply>,
+public Player::Manager, public Verifier::Listener
 {
 public:
 
@@ -39,22 +46,69 @@ public:
   };
 
   /** The following is pure virtual in Player::Manager and
-   * the only thing a Player needs to know about the manager. */
+   * the only thing a Player needs to know about the manager.
+   * The request waits in the fair queue, the actor's mailbox only
+   * receives a token telling it to handle the next request.
+   */
   void request (Player::Message m, Player::MailBox* mbox)
   {
-    thread_.request(m, mbox);
+    _queue.push(m.first->logged_in () ? m.first->name () : m.first->address (),
+                m, mbox, m.first->id (), m.first->commands ());
+    thread_.request(Player::Message(0, ""));
+  }
+
+  /** The following are also pure virtual in Player::Manager. */
+  TimerWheel& timers ()
+  {
+    return timers_;
+  }
+
+  const Timeouts& timeouts () const
+  {
+    return timeouts_;
+  }
+
+  Admission& admission ()
+  {
+    return _admission;
+  }
+
+  MailWatcher& watcher ()
+  {
+    return _watcher;
+  }
+
+  FlightRecorder& recorder ()
+  {
+    return _recorder;
+  }
+
+  Router* router ()
+  {
+    return _router;
   }
 
   /** Function called by the Actor thread associated with this Manager.
-   * The thread will read messages from its mailbox and then
-   * process them using this function.
-   * @param m message put by a player in the actor's mailbox.
-   * @return a string that will be put into the client's reply
-   *   mailbox, if any.
+   * The thread will read tokens from its mailbox, one for each
+   * request, and then use this function to handle the request that
+   * is next in the fair queue (see FairQueue).
+   * @param m token put in the actor's mailbox by Manager::request
+   * @return an empty reply, the reply to the request is put into
+   *   the player's mailbox, if any
    * @exception std::runtime_error if the manager refuses
    *   for some reason to react to a request
    */
-  std::string operator()(const Player::Message& m) throw (std::runtime_error);
+  Reply operator()(const Player::Message& m) throw (std::runtime_error);
+
+  /** Called by the Verifier when it checked a password: the login is
+   * finished by the manager thread, which takes the results from the
+   * Verifier when it handles the request queued here.
+   */
+  void verified ()
+  {
+    _queue.push ("", Player::Message (0, "verified"), 0);
+    thread_.request (Player::Message (0, ""));
+  }
 
   /** This function will return true after the manager (thread)
    * has processed a 'shutdown' command.
@@ -69,6 +123,17 @@ public:
     return done_;
   }
 
+  /** A file descriptor (an eventfd) that becomes readable when the
+   * manager has processed a 'shutdown' command, so the main program
+   * and the acceptors can simply wait for it instead of polling
+   * Manager::done.
+   * @return the file descriptor
+   */
+  int shutdown_fd () const
+  {
+    return shutdown_fd_;
+  }
+
   /** This function will
    * first kill all the players and then the manager thread.
    * @warning this function cannot be called from the
@@ -88,15 +153,77 @@ public:
   /** Constructor.
    * @param name of this manager
    * @param config contains configuration parameters
+   * @param pool runs the players that are resumed after waiting
+   * for new mail (see MailWatcher)
+   * @param table shared with the other worker processes of a prefork
+   * server, 0 if there are none
+   * @param router moves sessions to the other worker processes, 0 if
+   * there are none
    * @param debug object which allows connected objects (e.g.
    * threads) to write debug info
    */
-  Manager (const std::string& name, const Dv::Props& config, Dv::Debugable* debug = 0);
+  Manager (const std::string& name, const Dv::Props& config, Pool& pool,
+           SharedTable* table = 0, Router* router = 0,
+           Dv::Debugable* debug = 0);
 
 private:
   Manager (const Manager&);
   Manager & operator= (const Manager&);
 
+  /** Finish a login (PASS, APOP or ADOPT): if the credentials were
+   * accepted, open the player's maildrop and enter the transaction
+   * state. If another worker has the maildrop open, the player is told
+   * to move there (see Router).
+   * @param player pointer to player object
+   * @param result of checking the credentials
+   * @return reply to the login command
+   */
+  Reply authorize (Player* player, Authenticator::Result result);
+
+  /** Finish the logins whose passwords the Verifier checked, the
+   * players waiting for them get their replies. */
+  void finish_logins ();
+
+  /** Handle a request of a player.
+   * @param m message of the player
+   * @return a reply for the player. Large replies (RETR, TOP, LIST,
+   *   UIDL) carry a body that the player streams itself, so they are
+   *   never built as a whole by the manager.
+   * @exception std::runtime_error if the manager refuses
+   *   for some reason to react to a request
+   */
+  Reply handle (const Player::Message& m) throw (std::runtime_error);
+
+  /** Refuse a request at once if the manager is overloaded and the
+   * request is a login or an expensive command.
+   * @param request the request that is about to be handled
+   * @param now when it was popped, see TokenBucket::now
+   * @return a bool indicating if the request is refused
+   */
+  bool shed (const FairQueue::Request& request, double now);
+
+  /** Give a player the name of the user its client gives (with USER
+   * or APOP), if the user has not too many sessions already.
+   * @param player pointer to player object
+   * @param name of the user
+   * @return a bool indicating if the player now has the name
+   */
+  bool claim_name (Player* player, const std::string& name);
+
+  /**
+   * @param address of a client, numeric
+   * @return a bool indicating if the client is on the server's own host
+   */
+  static bool loopback (const std::string& address);
+
+  /** Prefetch the messages that a player will probably retrieve next,
+   * see Readahead
+   * @param player pointer to player object
+   * @param maildrop of the player
+   * @param msg_nr number of the message after which to look
+   */
+  void prefetch (Player* player, Maildrop* maildrop, int msg_nr);
+
   /** Remove all references to a player from the manager's database
    * and kill its thread.
    * The function is robust: calling it twice will have no effect
@@ -120,8 +247,21 @@ private:
 
   /** Has the manager thread processed a shutdown command? */
   bool done_;
+  /** Becomes readable once done_ is set. */
+  int shutdown_fd_;
   /** The server configuration */
   Dv::Props config_;
+  /** Keeps the deadlines of all players. */
+  TimerWheel timers_;
+  /** The deadlines of the players. */
+  Timeouts timeouts_;
+  /** Maximum size in octets of a chunk of a reply body, this bounds
+   * the memory a session needs to send a reply of any size. */
+  size_t window_;
+  /** When messages are saved in their wire form (see WireCache):
+   * "none", "lazy" (when first retrieved) or "background" (also by
+   * a WireConverter thread). */
+  std::string wireform_;
 
   /** Return a pseudo-stream to write log info on.
    * @param i debug level, the pseudo stream is real only
@@ -136,8 +276,73 @@ private:
   /** The active maildrops */
   Maildrops _maildrops;
 
+  /** Which worker has a maildrop open, 0 without workers */
+  SharedTable* _table;
+
+  /** Moves sessions to the worker that has their maildrop open, 0
+   * without workers */
+  Router* _router;
+
   /** A map of players and their current state */
   std::map<Player*, State> _players_states;
+
+  /** Checks the credentials given with PASS and APOP */
+  Authenticator _authenticator;
+
+  /** Checks passwords against their hashes, off the manager thread */
+  Verifier _verifier;
+
+  /** A PASS whose password the Verifier is checking */
+  struct Verifying
+  {
+    /* Where the player waits for the reply */
+    Player::MailBox* mbox;
+    /* When the request was pushed and popped, see Player::timed */
+    double pushed;
+    double popped;
+  };
+
+  /** The players whose password the Verifier is checking */
+  std::map<Player*, Verifying> _verifying;
+
+  /** Limits on bytes and commands per second of the players */
+  Shaping _shaping;
+
+  /** Limits on the number of sessions */
+  Admission _admission;
+
+  /** The requests of the players waiting to be handled */
+  FairQueue _queue;
+
+  /** Keeps the timings of the recent commands, dumps them when one
+   * is slow */
+  FlightRecorder _recorder;
+
+  /** Reads messages into the page cache before they are retrieved */
+  Prefetcher _prefetcher;
+
+  /** What to prefetch for each player in the transaction state */
+  std::map<Player*, Readahead> _readahead;
+
+  /** Most messages prefetched ahead of a player */
+  size_t _prefetch_depth;
+
+  /** Octets prefetched for a player that it did not retrieve yet */
+  unsigned long _prefetch_budget;
+
+  /** Takes over the players that wait for new mail */
+  MailWatcher _watcher;
+
+  /** Tells when the requests waited too long in the queue */
+  LoadShedder _shedder;
+
+  /** Size of the body of the reply that is being built, if known
+   * in advance, it is charged to the request's flow */
+  size_t _charge;
+
+  /** Is the reply to the request that is being handled sent later,
+   * see Manager::finish_logins? */
+  bool _deferred;
 };
 
 #endif	/* _MANAGER_H */
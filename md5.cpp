@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <cstring>
+
+#include "md5.h"
+
+namespace
+{
+  // Per-round shift amounts
+  const uint32_t S[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+  };
+
+  // Integer part of abs(sin(i + 1)) * 2^32
+  const uint32_t K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+    0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+    0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+    0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+    0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+  };
+
+  uint32_t rotate (uint32_t x, uint32_t c)
+  {
+    return (x << c) | (x >> (32 - c));
+  }
+
+  void block (uint32_t h[4], const unsigned char* p)
+  {
+    uint32_t m[16];
+    uint32_t a(h[0]), b(h[1]), c(h[2]), d(h[3]);
+
+    for ( int i = 0; i < 16; i++ )
+      m[i] = p[i * 4] | (p[i * 4 + 1] << 8) | (p[i * 4 + 2] << 16)
+      | (static_cast<uint32_t> (p[i * 4 + 3]) << 24);
+
+    for ( int i = 0; i < 64; i++ )
+      {
+        uint32_t f;
+        int g;
+
+        if ( i < 16 )
+          {
+            f = (b & c) | (~b & d);
+            g = i;
+          }
+        else if ( i < 32 )
+          {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+          }
+        else if ( i < 48 )
+          {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+          }
+        else
+          {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+          }
+        uint32_t t(d);
+        d = c;
+        c = b;
+        b = b + rotate(a + f + K[i] + m[g], S[i]);
+        a = t;
+      }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+  }
+}
+
+std::string md5_hex (const std::string& text)
+{
+  static const char hex[] = "0123456789abcdef";
+  uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  size_t size(text.size());
+  size_t i(0);
+
+  for ( ; i + 64 <= size; i += 64 )
+    block(h, reinterpret_cast<const unsigned char*> (text.data()) + i);
+
+  // Pad the last block(s) with 0x80, zeros and the length in bits
+  unsigned char tail[128];
+  size_t rest(size - i);
+  size_t tail_size(rest < 56 ? 64 : 128);
+  uint64_t bits(static_cast<uint64_t> (size) * 8);
+
+  memset(tail, 0, sizeof (tail));
+  memcpy(tail, text.data() + i, rest);
+  tail[rest] = 0x80;
+  for ( int j = 0; j < 8; j++ )
+    tail[tail_size - 8 + j] = static_cast<unsigned char> (bits >> (8 * j));
+  block(h, tail);
+  if ( tail_size == 128 )
+    block(h, tail + 64);
+
+  std::string digest;
+  for ( int j = 0; j < 16; j++ )
+    {
+      unsigned char byte(h[j / 4] >> (8 * (j % 4)));
+      digest += hex[byte >> 4];
+      digest += hex[byte & 0xf];
+    }
+  return digest;
+}
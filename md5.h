@@ -0,0 +1,19 @@
+/*
+ * File:   md5.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _MD5_H
+#define	_MD5_H
+
+#include <string>
+
+/** Compute the MD5 digest (RFC 1321) of a string, as needed for the
+ * APOP command (RFC 1939).
+ * @param text The string to digest
+ * @return The digest as 32 lower case hexadecimal digits
+ */
+std::string md5_hex (const std::string& text);
+
+#endif	/* _MD5_H */
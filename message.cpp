@@ -1,113 +1,71 @@
+#include <fcntl.h>
+
 #include "message.h"
+#include "maildrop.h"
+#include "wirecache.h"
 
-Message::Message (unsigned int number, const std::string& filepath) :
-_number (number), _deleted (false), _file_path (filepath) { }
+bool Message::deleted () const
+{
+  Lock lock(_maildrop->_index->mutex);
 
-Message::~Message ()
+  return _maildrop->deleted(_number);
+}
+
+void Message::deleted (bool mark)
 {
-  if ( deleted() )
+  Lock lock(_maildrop->_index->mutex);
+
+  // A message deleted by another session stays deleted
+  if ( _maildrop->record(_number).flags & Maildrop::Expunged )
+    return;
+  if ( mark != _maildrop->_deletions[_number] )
     {
-      if ( remove(_file_path.c_str()) != 0 )
-        throw std::runtime_error("unable to delete message: " + _file_path);
+      _maildrop->_deletions[_number] = mark;
+      _maildrop->_deleted += mark ? 1 : -1;
     }
 }
 
-unsigned long Message::size () const
+std::string Message::file_path () const
 {
-  unsigned long begin, end;
-  std::ifstream in_file(_file_path.c_str());
+  Lock lock(_maildrop->_index->mutex);
 
-  if ( in_file.is_open() )
-    {
-      // Get position of the get pointer
-      begin = in_file.tellg();
-      // Set the postion of the  get pointer to the end of the file
-      in_file.seekg(0, std::ios::end);
-      // Get the position of the get pointer
-      end = in_file.tellg();
-      in_file.close();
-
-      unsigned long bits(end - begin);
-
-      if ( bits == 0 )
-        return bits;
-      else
-        // We get the size size of the file by substracting end from begin
-        return ceil(bits / 8);
-    }
-  else
-    throw std::runtime_error("unable to open message: " + _file_path);
+  return _maildrop->path(_number);
 }
 
-std::string Message::message_string () const
+int Message::open (std::string& path, int* wire) const
 {
-  // Output string stream where we will put the text of the message
-  std::ostringstream oss;
-  std::ifstream in_file(_file_path.c_str());
-  std::string line;
+  Lock lock(_maildrop->_index->mutex);
+  unsigned long size;
 
-  if ( in_file.is_open() )
-    {
-      // Put each line of the file in the output stream
-      while ( !in_file.eof() )
-        {
-          getline(in_file, line);
-          oss << line << std::endl;
-        }
-      in_file.close();
-      // Return the actual string of the oss
-      return oss.str(); 
-    }
-  else
-    throw std::runtime_error("unable to open message: " + _file_path);
+  if ( wire )
+    *wire = -1;
+  if ( _maildrop->record(_number).flags & Maildrop::Expunged )
+    return -1;
+  path = _maildrop->path(_number);
+
+  int fd(openat(_maildrop->_index->dir_fd, _maildrop->name(_number), O_RDONLY | O_CLOEXEC));
+
+  if ( fd >= 0 && wire && WireCache::lookup(path, size) )
+    *wire = ::open(WireCache::wire_path(path).c_str(), O_RDONLY | O_CLOEXEC);
+  return fd;
 }
 
-std::string Message::message_string (int n) const
+std::string Message::summary () const
 {
-  // Output string stream where we will put the text of the message
-  std::ostringstream oss;
-  std::ifstream in_file(_file_path.c_str());
-  std::string line;
+  return _maildrop->summary(_number);
+}
 
-  if ( in_file.is_open() )
-    {
-      // Counter to keep track of how many lines we already got
-      int counter(0);
-      /* Put each line of the file in the output stream
-       * until counter = n or we are at the end of the file */
-      while ( (!(counter == n)) && (!in_file.eof()) )
-        {
-          getline(in_file, line);
-          oss << line << std::endl;
-          counter++;
-        }
-      in_file.close();
-      // Return the actual string of the oss
-      return oss.str(); // Return the actual string of the oss
-    }
-  else
-    throw std::runtime_error("unable to open message: " + _file_path);
+unsigned long Message::size () const
+{
+  return _maildrop->wire_size(_number);
 }
 
 std::string Message::uidl () const
 {
-  std::ostringstream oss;
-  std::size_t size(_file_path.size());
-  // We start at position size-1
-  int i(--size);
-
-  /* Seek the file path backwards and put every char in oss, until we find '/'
-   *  eg /home/wouter/123 will return "123" */
-  while ( _file_path.at(i) != '/' )
-    {
-      oss << _file_path.at(i);
-      i--;
-    }
-  std::string uidl_string(oss.str());
-  /* Since we put the characters on the oss backwards
-   * we have to reverse the string now */
-  std::reverse(uidl_string.begin(), uidl_string.end());
-  return uidl_string;
+  Lock lock(_maildrop->_index->mutex);
+
+  // The (unique) file name is the uidl in this implementation
+  return _maildrop->unique_name(_number);
 }
 
 std::ostream & operator<< (std::ostream& os, const Message& msg)
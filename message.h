@@ -15,42 +15,42 @@
 #include <sstream>
 #include <cstddef>
 #include <algorithm>
-#include <math.h>
 
-/** The Message class represents a message in a maildrop
- * Operations on the message file are executed by opening
- * a filestream with the _file_path as path
+class Maildrop;
+
+/** The Message class represents a message in a maildrop. It is a small
+ * handle (a maildrop and a number) that is passed by value: the data of
+ * all messages of a maildrop are kept together by the Maildrop, see
+ * Maildrop::Record.
  */
 class Message
 {
 public:
   /** Constructor for Message
+   * @param maildrop The maildrop of the message, 0 for no message
    * @param number The number of this message
-   * @param filepath String representing the path to the message file
    */
-  Message (unsigned int number, const std::string& filepath);
+  Message (Maildrop* maildrop = 0, unsigned int number = 0) :
+  _maildrop (maildrop), _number (number) { }
 
-  /** Destructor for message
-   * If the message was marked as deleted, it will be deleted now
-   * @exception std::runtime_error If the message file can't be deleted
+  /**
+   * @return Bool indicating if the handle refers to a message
    */
-  virtual ~Message ();
+  bool valid () const
+  {
+    return _maildrop != 0;
+  }
 
   /**
    * @return Bool indicating if the message is marked as deleted
    */
-  bool deleted () const
-  {
-    return _deleted;
-  }
+  bool deleted () const;
 
-  /** Overloaded deleted method
+  /** Overloaded deleted method, a message marked as deleted is deleted
+   * when its maildrop is
    * @param mark Mark or unmark the message as deleted
    */
-  void deleted (bool mark)
-  {
-    _deleted = mark;
-  }
+  void deleted (bool mark);
 
   /**
    * @return The number of the message
@@ -61,41 +61,51 @@ public:
   }
 
   /**
-   * @return the size of the file in bytes
+   * @return The path to the message file
    */
-  unsigned long size () const;
-
-  /**
-   * @return A string which contains the text in the message file
-   * @exception std::runtime_error If the message file can't be opened
+  std::string file_path () const;
+
+  /** Open the message file, and its saved wire form if asked, under
+   * the lock of the index: no other session expunges or renames it
+   * meanwhile, and once open it stays readable.
+   * @param path Set to the path of the message file
+   * @param wire If not 0, set to the saved wire form (see WireCache),
+   *   -1 if there is none
+   * @return A file descriptor, -1 if the message is gone (e.g. expunged
+   *   by another session)
    */
-  std::string message_string () const;
+  int open (std::string& path, int* wire = 0) const;
 
-  /** Overloaded message_string method
-   * @param n The top n lines of the message only
-   * @return A string containing the top n lines of the message file
+  /** The size is computed the first time it is needed and then
+   * remembered, messages do not change while they are in a maildrop.
+   * @return the exact size of the message on the wire in octets,
+   *   i.e. with CRLF line endings and byte-stuffing (see WireEncoder);
+   *   0 if the message file is gone
    */
-  std::string message_string (int n) const;
+  unsigned long size () const;
 
   /**
-   * @return A string which is the filename = uidl in this implementation
+   * @return A string which is the unique file name = uidl in this
+   *   implementation, see Maildrop
    */
   std::string uidl () const;
 
+  /**
+   * @return A summary of the headers of the message, see Maildrop::summary
+   */
+  std::string summary () const;
+
   /** Overloaded << operator, sends some information of the message 
-   * to the ostream
+   * to the ostream: its number and its size, see Message::size
    */
   friend std::ostream& operator<< (std::ostream& os, const Message& msg);
 
 private:
+  /* The maildrop that holds the data of the message */
+  Maildrop* _maildrop;
+
   /* The number of the message */
   unsigned int _number;
-
-  /* A bool indicating if the message is marked a deleted */
-  bool _deleted;
-
-  /* String containing the path to the message file */
-  std::string _file_path;
 };
 
 #endif	/* _MESSAGE_H */
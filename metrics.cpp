@@ -0,0 +1,46 @@
+#include <sstream>
+
+#include "metrics.h"
+
+unsigned long Metrics::_own[Metrics::NrOfCounters];
+unsigned long* Metrics::_counters(Metrics::_own);
+unsigned long* Metrics::_rows(0);
+size_t Metrics::_processes(0);
+
+void Metrics::share (unsigned long* rows, size_t processes, size_t process)
+{
+  _rows = rows;
+  _processes = processes;
+  _counters = rows + process * NrOfCounters;
+}
+
+std::string Metrics::report ()
+{
+  // Must follow the order of Metrics::Counter
+  static const char* names[NrOfCounters] = {
+    "commands",
+    "bytes.sent",
+    "throttled.commands",
+    "throttled.writes",
+    "throttled.micros",
+    "shed.logins",
+    "shed.commands",
+    "queue.micros",
+    "refused.full",
+    "refused.address",
+    "refused.backlog",
+    "refused.user",
+    "log.dropped",
+    "prefetch.reads",
+    "prefetch.hits",
+    "prefetch.misses",
+    "idle.parked",
+    "idle.notices",
+    "sessions.moved"
+  };
+  std::ostringstream oss;
+
+  for ( int i = 0; i < NrOfCounters; i++ )
+    oss << names[i] << " " << get(static_cast<Counter> (i)) << "\r\n";
+  return oss.str();
+}
@@ -0,0 +1,99 @@
+/*
+ * File:   metrics.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _METRICS_H
+#define	_METRICS_H
+
+#include <string>
+#include <cstddef>
+
+/** Counters that tell what the server has been doing, e.g. how long
+ * clients were held back by shaping. Any thread can add to a counter,
+ * an addition is a single atomic instruction. The counters are shown
+ * by the STATS command.
+ *
+ * In a prefork server each worker process adds to its own row of
+ * counters in shared memory (see SharedTable), and STATS shows the
+ * totals of all workers.
+ */
+class Metrics
+{
+public:
+  enum Counter
+  {
+    Commands, /* Commands received from clients */
+    BytesSent, /* Octets of reply bodies sent to clients */
+    ThrottledCommands, /* Commands delayed by shaping */
+    ThrottledWrites, /* Writes delayed by shaping */
+    ThrottledMicros, /* Microseconds clients were delayed by shaping */
+    ShedLogins, /* Logins refused because the manager was overloaded */
+    ShedCommands, /* Expensive commands refused for the same reason */
+    QueueMicros, /* Microseconds requests waited for the manager */
+    RefusedFull, /* Connections refused, too many sessions */
+    RefusedAddress, /* Connections refused, too many from the address */
+    RefusedBacklog, /* Connections refused, too many waiting for a thread */
+    RefusedUser, /* USER or APOP refused, too many sessions of the user */
+    LogDropped, /* Log records dropped, the writer could not keep up */
+    Prefetched, /* Messages read ahead into the page cache */
+    PrefetchHits, /* Prefetched messages that were retrieved */
+    PrefetchMisses, /* Prefetched messages that the client skipped */
+    Parked, /* Sessions that waited for new mail without a thread */
+    MailNotices, /* New mail told to sessions waiting for it */
+    Moved, /* Sessions moved to the worker that has their maildrop open */
+    NrOfCounters
+  };
+
+  /** Add to a counter
+   * @param counter The counter to add to
+   * @param n The amount to add
+   */
+  static void add (Counter counter, unsigned long n = 1)
+  {
+    __sync_fetch_and_add(&_counters[counter], n);
+  }
+
+  /**
+   * @param counter The counter to read
+   * @return The current value of the counter, in all processes
+   */
+  static unsigned long get (Counter counter)
+  {
+    if ( !_rows )
+      return __sync_fetch_and_add(&_counters[counter], 0);
+
+    unsigned long total(0);
+
+    for ( size_t i = 0; i < _processes; i++ )
+      total += __sync_fetch_and_add(&_rows[i * NrOfCounters + counter], 0);
+    return total;
+  }
+
+  /**
+   * @return All counters, one "name value" line per counter, each line
+   *   ending in CRLF
+   */
+  static std::string report ();
+
+  /** Count in shared memory from now on, called in a worker process
+   * before it starts any threads
+   * @param rows NrOfCounters counters for each process
+   * @param processes The number of rows
+   * @param process The row of this process
+   */
+  static void share (unsigned long* rows, size_t processes, size_t process);
+
+private:
+  /* The counters of this process */
+  static unsigned long* _counters;
+
+  /* All rows, 0 if not shared */
+  static unsigned long* _rows;
+  static size_t _processes;
+
+  static unsigned long _own[NrOfCounters];
+};
+
+#endif	/* _METRICS_H */
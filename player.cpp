@@ -1,40 +1,328 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+
 #include <dvutil/strings.h> // for Dv::String::trim
 
 #include "player.h"
+#include "logger.h"
+#include "mailwatcher.h"
+#include "trace.h"
+#include "flightrecorder.h"
 
-std::string
+Reply
 Player::query_manager (const std::string& s)
 {
+  TRACE_SPAN("session.query");
   manager_.request(std::make_pair(this, s), &mbox_);
-  std::string reply = mbox_.get(delay_);
-  log() << name() << "> " << reply << std::endl;
+  Reply reply = mbox_.get(delay_);
+  Logger::write(Logger::Debug, Logger::Reply, id_, reply.status());
   return reply;
 }
 
+void
+Player::send_reply (const Reply& reply)
+{
+  TRACE_SPAN("session.reply");
+  timing_.bytes += reply.status().size() + 2;
+  *so_ << reply.status() << "\r\n";
+  if ( reply.body() && reply.body()->fd() >= 0 )
+    send_file(*reply.body());
+  else if ( reply.body() )
+    {
+      // Reused for every chunk, so its capacity never exceeds the window
+      std::string chunk;
+      while ( reply.body()->next(chunk) )
+        {
+          shape_write(chunk.size());
+          (*so_ << chunk).flush();
+        }
+    }
+  // Terminate the multi-line response
+  if ( reply.body() )
+    *so_ << ".\r\n";
+  so_->flush();
+}
+
+void
+Player::send_file (const Body& body)
+{
+  TRACE_SPAN("message.sendfile");
+  // Whatever is still buffered in the socket stream goes first
+  so_->flush();
+
+  // Send in pieces, so that shaping can hold a large body back
+  static const size_t piece(64 * 1024);
+  off_t offset(0);
+  while ( offset < static_cast<off_t> (body.length()) )
+    {
+      size_t size(std::min(piece, body.length() - offset));
+
+      shape_write(size);
+      ssize_t n;
+      {
+        // Not the shaping or the waits for the client
+        FlightRecorder::Storage storage;
+        n = sendfile(so_->sockfd(), body.fd(), &offset, size);
+      }
+      if ( n > 0 )
+        continue;
+      if ( n < 0 && errno == EINTR )
+        continue;
+      if ( n < 0 && errno == EAGAIN )
+        {
+          // Non-blocking socket with a full send buffer
+          struct pollfd pfd = { so_->sockfd(), POLLOUT, 0 };
+          if ( poll(&pfd, 1, delay_) > 0 )
+            continue;
+        }
+      throw std::runtime_error("sendfile failed");
+    }
+}
+
+void
+Player::throttle (double seconds, double user_seconds, Metrics::Counter counter)
+{
+  seconds = std::max(seconds, user_seconds);
+  if ( seconds <= 0 )
+    return;
+  Metrics::add(counter);
+  Metrics::add(Metrics::ThrottledMicros, static_cast<unsigned long> (seconds * 1e6));
+
+  struct timespec ts;
+  ts.tv_sec = static_cast<time_t> (seconds);
+  ts.tv_nsec = static_cast<long> ((seconds - ts.tv_sec) * 1e9);
+  while ( nanosleep(&ts, &ts) != 0 && errno == EINTR )
+    ;
+}
+
+void
+Player::shape_write (size_t n)
+{
+  timing_.bytes += n;
+  Metrics::add(Metrics::BytesSent, n);
+  throttle(shaper_.write(n), user_shaper_ ? user_shaper_->write(n) : 0,
+           Metrics::ThrottledWrites);
+}
+
+void
+Player::record (const std::string& line)
+{
+  if ( !pushed_ )
+    return;
+
+  // The only clock read of the recorder, the others are the queue's
+  uint64_t now(FlightRecorder::now());
+  uint64_t begin(static_cast<uint64_t> (pushed_ * 1000000));
+  size_t i(0);
+
+  timing_.total = now - begin;
+  timing_.reply = now - static_cast<uint64_t> (replied_ * 1000000);
+  timing_.storage += FlightRecorder::storage();
+  timing_.session = id_;
+  timing_.command = commands_;
+  timing_.start = FlightRecorder::wall(begin);
+  // Only the command word, never the arguments (e.g. a password)
+  for ( ; i < line.size() && i < sizeof (timing_.verb) - 1 && line[i] != ' '; i++ )
+    timing_.verb[i] = tolower(line[i]);
+  timing_.verb[i] = 0;
+  manager_.recorder().record(timing_);
+}
+
+size_t Player::count_(0);
+
 Player*
-Player::make (Manager& mgr, Dv::shared_ptr<Dv::Net::Socket> so, size_t delay,
-              size_t debug_level, Dv::Debugable* debug)
+Player::make (Manager& mgr, Dv::shared_ptr<Dv::Net::Socket> so, size_t delay)
 {
-  Player* player = new Player(mgr, so, delay, debug_level, debug);
+  Player* player = new Player(mgr, so, delay);
   mgr.request(std::make_pair(player, "addplayer"));
   return player;
 }
 
-Player::Player (Manager& mgr, Dv::shared_ptr<Dv::Net::Socket> so, size_t delay,
-                size_t debug_level, Dv::Debugable* debug) :
-Dv::Thread::Thread (true, debug_level, debug), manager_ (mgr), so_ (so),
-mbox_ ("player"), incoming_ ("incoming"), name_ (""), delay_ (delay) { }
+Player*
+Player::adopt (Manager& mgr, Dv::shared_ptr<Dv::Net::Socket> so, size_t delay,
+               const Router::Session& session)
+{
+  Player* player = new Player(mgr, so, delay);
+
+  player->greeted_ = true;
+  player->address_ = session.address;
+  player->moved_ = session.user;
+  player->pending_ = session.pending;
+  player->hops_ = session.hops;
+  Logger::write(Logger::Info, Logger::Connect, player->id_, player->address_);
+  mgr.request(std::make_pair(player, "addplayer"));
+  return player;
+}
+
+Player::Player (Manager& mgr, Dv::shared_ptr<Dv::Net::Socket> so, size_t delay) :
+manager_ (mgr), worker_ (0), killed_ (false), logged_in_ (false),
+greeted_ (false), idle_requested_ (false), new_mail_ (0), so_ (so),
+mbox_ ("player"), incoming_ ("incoming"), name_ (""), forwarded_ (false),
+move_to_ (-1), hops_ (0), delay_ (delay),
+user_shaper_ (0), wake_fd_ (eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)),
+expired_ (0), idle_ (*this, Deadline::Idle),
+authorization_ (*this, Deadline::Authorization),
+command_ (*this, Deadline::Command)
+{
+  static unsigned long sequence(0);
+  char host[NI_MAXHOST];
+
+  address_ = peer_address(so_->sockfd());
+  id_ = __sync_add_and_fetch(&sequence, 1);
+  commands_ = 0;
+  pushed_ = replied_ = 0;
+
+  // The timestamp must be different for every greeting (RFC 1939)
+  std::ostringstream oss;
+  if ( gethostname(host, sizeof (host)) != 0 )
+    host[0] = 0;
+  host[sizeof (host) - 1] = 0;
+  oss << "<" << getpid() << "." << id_ << "."
+          << time(0) << "@" << (host[0] ? host : "localhost") << ">";
+  banner_ = oss.str();
+
+  manager_.timers().schedule(&authorization_, manager_.timeouts().authorization);
+  __sync_fetch_and_add(&count_, 1);
+}
+
+Player::~Player ()
+{
+  manager_.watcher().unwatch(this);
+  manager_.timers().cancel(&idle_);
+  manager_.timers().cancel(&authorization_);
+  manager_.timers().cancel(&command_);
+  close(wake_fd_);
+  manager_.admission().leave(address_);
+  __sync_fetch_and_sub(&count_, 1);
+}
+
+std::string
+Player::peer_address (int fd)
+{
+  struct sockaddr_storage peer;
+  socklen_t size(sizeof (peer));
+  char host[NI_MAXHOST];
+
+  if ( getpeername(fd, reinterpret_cast<sockaddr*> (&peer), &size) == 0
+       && getnameinfo(reinterpret_cast<sockaddr*> (&peer), size, host,
+                      sizeof (host), 0, 0, NI_NUMERICHOST) == 0 )
+    return host;
+  return "";
+}
+
+void
+Player::Deadline::expired ()
+{
+  player_.expired_ = kind_;
+  if ( kind_ == Command )
+    shutdown(player_.so_->sockfd(), SHUT_RDWR);
+  else
+    player_.wake();
+}
+
+const char*
+Player::Deadline::name (int kind)
+{
+  switch (kind)
+    {
+      case Idle:
+        return "idle";
+      case Authorization:
+        return "login";
+      default:
+        return "command";
+    }
+}
+
+void
+Player::wake ()
+{
+  uint64_t one(1);
+  if ( write(wake_fd_, &one, sizeof (one)) != sizeof (one) )
+    ; // the counter is already non-zero, the player will wake up anyway
+}
+
+bool
+Player::wait_for_input (Dv::Net::Socket& so)
+{
+  struct pollfd fds[2] = {
+    { so.sockfd(), POLLIN, 0 },
+    { wake_fd_, POLLIN, 0 }
+  };
+
+  if ( poll(fds, 2, -1) < 0 )
+    return errno != EINTR;
+  if ( fds[1].revents )
+    {
+      uint64_t count;
+      if ( read(wake_fd_, &count, sizeof (count)) != sizeof (count) )
+        ; // someone else reset it
+    }
+  return fds[0].revents != 0;
+}
+
+bool
+Player::transfer ()
+{
+  Router* router(manager_.router());
+  Router::Session session;
+  int worker(move_to_);
+
+  move_to_ = -1;
+  if ( !router )
+    return false;
+
+  // What the socket stream read ahead goes along, after the input that
+  // came with the session
+  std::streamsize buffered(so_->rdbuf()->in_avail());
+  std::string input(buffered > 0 ? buffered : 0, 0);
+
+  if ( buffered > 0 )
+    input.resize(so_->rdbuf()->sgetn(&input[0], buffered));
+  session.fd = so_->sockfd();
+  session.user = name_;
+  session.address = address_;
+  session.pending = pending_ + input;
+  session.hops = hops_ + 1;
+  if ( !router->send(worker, session) )
+    {
+      pending_ = session.pending;
+      return false;
+    }
+
+  // The connection belongs to the other worker: the descriptor is
+  // pointed elsewhere, so that closing it here does not end it
+  int null(open("/dev/null", O_RDWR | O_CLOEXEC));
+
+  if ( null >= 0 )
+    {
+      dup3(null, session.fd, O_CLOEXEC);
+      close(null);
+    }
+  Metrics::add(Metrics::Moved);
+  return true;
+}
 
 void
 Player::quit ()
 {
-  log() << name() << " quitting.. " << std::endl;
+  Logger::write(Logger::Info, Logger::Close, id_, name());
   so_->close();
   // if killed() then the manager already knows we're quitting
   if ( !killed() )
     {
       // let the manager know that we quit
-      manager_.request(std::make_pair(this, "quit"));
+      manager_.request(std::make_pair(this, "abort"));
       while ( !killed() )
         sleep(1);
     }
@@ -44,11 +332,20 @@ Player::quit ()
  * @return 0 iff a line was read
  * @return 1 I/O error while reading
  * @return 2 we were killed
+ * @return 3 a deadline expired
  */
 int
 Player::get_line (Dv::Net::Socket& so, std::string& line)
 {
+  TRACE_SPAN("session.read");
+  // A session moved here first finishes its login, see Player::adopt
+  if ( !moved_.empty() )
+    {
+      line = "adopt";
+      return 0;
+    }
   (so << "> ").flush();
+  manager_.timers().schedule(&idle_, manager_.timeouts().idle);
   while ( true )
     {
       // check if out-of-band data came in and, if so, show them
@@ -57,7 +354,7 @@ Player::get_line (Dv::Net::Socket& so, std::string& line)
           if ( incoming_.size() )
             {
               while ( incoming_.size() )
-                so << incoming_.get(100) << std::endl;
+                so << incoming_.get(100) << "\r\n";
               (so << "> ").flush(); // show new prompt
             }
         }
@@ -66,8 +363,29 @@ Player::get_line (Dv::Net::Socket& so, std::string& line)
           log() << __PRETTY_FUNCTION__ << ": exception: " << e.what()
                   << ": ignored" << std::endl;
         }
+      if ( expired_ )
+        return 3;
+      if ( killed() )
+        return 2;
+      // The lines that the worker that moved the session here read
+      size_t end(pending_.find('\n'));
+      if ( end != std::string::npos )
+        {
+          line = pending_.substr(0, end);
+          pending_.erase(0, end + 1);
+          manager_.timers().cancel(&idle_);
+          Dv::String::trim(line);
+          return 0;
+        }
+      // Only wake up for input, an expired deadline or out-of-band data
+      if ( so.rdbuf()->in_avail() <= 0 && !wait_for_input(so) )
+        continue;
       if ( std::getline(so, line) )
         {
+          // The start of the line may have been read by that worker
+          line.insert(0, pending_);
+          pending_.clear();
+          manager_.timers().cancel(&idle_);
           Dv::String::trim(line);
           return 0;
         }
@@ -85,9 +403,17 @@ Player::main ()
   try
     {
       std::string line;
+      if ( !greeted_ )
+        {
+          Logger::write(Logger::Info, Logger::Connect, id_, address_);
+          (*so_ << "+OK POP3 server ready " << banner_ << "\r\n").flush();
+          greeted_ = true;
+        }
       while ( !killed() )
         {
           log(1) << __PRETTY_FUNCTION__ << " " << __FILE__ << "." << __LINE__ << std::endl;
+          // The spans of the command that is read next
+          TRACE_CONTEXT(id_, ++commands_);
           switch (get_line(*so_, line))
             {
               case 0:
@@ -96,18 +422,66 @@ Player::main ()
                     // send message to manager for processing and show her reply
                     try
                       {
-                        std::string reply = query_manager(line);
-                        *so_ << reply << std::endl;
+                        Metrics::add(Metrics::Commands);
+                        manager_.timers().schedule(&command_,
+                                                   manager_.timeouts().command);
+                        throttle(shaper_.command(),
+                                 user_shaper_ ? user_shaper_->command() : 0,
+                                 Metrics::ThrottledCommands);
+                        timing_ = FlightRecorder::Sample();
+                        pushed_ = 0;
+                        FlightRecorder::storage(); // not spent on this command
+                        Reply reply(query_manager(line));
+                        moved_.clear();
+                        // The maildrop is open in another worker, the
+                        // session goes there and gets its reply there
+                        if ( move_to_ >= 0 )
+                          {
+                            manager_.timers().cancel(&command_);
+                            if ( transfer() )
+                              {
+                                quit();
+                                return 0;
+                              }
+                          }
+                        send_reply(reply);
+                        manager_.timers().cancel(&command_);
+                        record(line);
+                        if ( idle_requested_ )
+                          {
+                            idle_requested_ = false;
+                            // Input already buffered would never wake it up
+                            if ( so_->rdbuf()->in_avail() <= 0 && pending_.empty() )
+                              {
+                                manager_.timers().schedule(&idle_,
+                                                           manager_.timeouts().idle);
+                                manager_.watcher().park(this);
+                                // Another thread may run the player now
+                                return Parked;
+                              }
+                            manager_.watcher().unwatch(this);
+                          }
                       }
                     catch (std::runtime_error& e)
                       {
-                        log() << "query_manager exception: " << e.what() << std::endl;
+                        Logger::write(Logger::Error, Logger::Failure, id_, e.what());
                         throw;
                       }
                   }
                 else
-                  *so_ << "bye" << std::endl;
+                  *so_ << "bye\r\n";
                 break;
+              case 3: // deadline expired
+                {
+                  int kind(expired_);
+
+                  // Handled, it must not end anything else
+                  expired_ = 0;
+                  (*so_ << "-ERR [SYS/TEMP] " << Deadline::name(kind)
+                          << " timeout\r\n").flush();
+                  quit();
+                  return 0;
+                }
               case 1: // I/O error
               case 2: // killed()
                 quit();
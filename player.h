@@ -17,9 +17,19 @@
 #include <dvthread/thread.h>
 #include <dvthread/mailbox.h>
 
+#include "reply.h"
+#include "shaping.h"
+#include "metrics.h"
+#include "timerwheel.h"
+#include "admission.h"
+#include "flightrecorder.h"
+#include "router.h"
+
+class MailWatcher;
+
 /** The Player class represents a user connected to the server.  It is
- * also a thread. The class is very simple and reusable: its main
- * function (the one executed by the thread) simply reads commands
+ * run by a thread of a Pool. The class is very simple and reusable: its
+ * main function (the one executed by the thread) simply reads commands
  * from the socket connection (with the 'client/user') and sends them
  * (via the Manager::request function) to the manager for processing,
  * after which it displays the reply. It also reads replies from the
@@ -28,7 +38,7 @@
  * request from the player). All these replies are sent back to the
  * user via the socket.
  */
-class Player : public Dv::Thread::Thread
+class Player
 {
 public:
   /** The type of a message that the player sends out.
@@ -39,8 +49,11 @@ public:
    */
   typedef std::pair<Player*, std::string> Message;
 
-  /** Type of mailbox where a player receives information.*/
-  typedef Dv::Thread::MailBox<std::string> MailBox;
+  /** Type of mailbox where a player receives replies from its manager.*/
+  typedef Dv::Thread::MailBox<Reply> MailBox;
+
+  /** Type of mailbox where a player receives out of band data.*/
+  typedef Dv::Thread::MailBox<std::string> Inbox;
 
   /** Abstract class representing the player's manager. All input
    * from a player is passed on to its manager.
@@ -49,31 +62,101 @@ public:
   {
   public:
     virtual void request (Player::Message, MailBox* = 0) = 0;
+
+    /** The deadlines of a session, in millisecs. */
+    struct Timeouts
+    {
+      /** Waiting for the next command. */
+      size_t idle;
+      /** From the connection to a successful login. */
+      size_t authorization;
+      /** Executing a command, including sending its reply. */
+      size_t command;
+    };
+
+    /** The wheel that keeps the deadlines of the players. */
+    virtual TimerWheel& timers () = 0;
+
+    /** The limits on the number of sessions, a player leaves it
+     * when it is destroyed. */
+    virtual Admission& admission () = 0;
+
+    /** The deadlines of the players. */
+    virtual const Timeouts& timeouts () const = 0;
+
+    /** The watcher that takes over players waiting for new mail. */
+    virtual MailWatcher& watcher () = 0;
+
+    /** Keeps the timings of the commands of all players. */
+    virtual FlightRecorder& recorder () = 0;
+
+    /** Moves sessions to the other workers of a prefork server,
+     * 0 if there are none. */
+    virtual Router* router () = 0;
   };
 
+  /** Returned by Player::run when the player parked (see MailWatcher):
+   * it is not done and must not be deleted. */
+  static const int Parked = -1;
+
   /** Factory method to create a new Player. This function also
    * reports the creation to the manager via a 'newplayer' command.
    *
-   * Note that the player will autodestruct after the thread
-   * finishes its main() function.
+   * Note that the player is deleted by the Pool that runs it
+   * after its main() function finishes, unless it parked.
    *
    * Note also that a player will never wait indefinitely for any
-   * event: the calls to the manager time out, as do the read calls
-   * to the socket connection. Thus, a player that is killed will
-   * always notice this after a while.
+   * event: the calls to the manager time out, and the deadlines
+   * kept by the manager's TimerWheel wake it up while it waits for
+   * input. Thus, a player that is killed will always notice this
+   * after a while.
    *
    * @param manager of this player
    * @param so socket connection to player
    * @param delay millisecs that the player will wait for the
    *   manager to reply before throwing an exception
-   * @param delay millisecs that the player will wait for the
-   * @param debug_level
-   * @param debug
    * @return pointer to new Player object
    */
   static Player* make (Manager& manager,
-                       Dv::shared_ptr<Dv::Net::Socket> so, size_t delay, size_t
-                       debug_level, Dv::Debugable* debug);
+                       Dv::shared_ptr<Dv::Net::Socket> so, size_t delay);
+
+  /** Factory method to create a Player for a session that another
+   * worker moved here (see Router). Like Player::make, but the client
+   * was greeted and logged in already: the player first asks its
+   * manager to adopt the session with an 'adopt' command, and sends
+   * the reply as that of the login.
+   * @param manager of this player
+   * @param so socket connection to player
+   * @param delay millisecs, see Player::make
+   * @param session the session that was moved
+   * @return pointer to new Player object
+   */
+  static Player* adopt (Manager& manager, Dv::shared_ptr<Dv::Net::Socket> so,
+                        size_t delay, const Router::Session& session);
+
+  /** Destructor, cancels the deadlines and the watch for new mail. */
+  ~Player ();
+
+  /** Run the player on a thread of the pool, see Player::main.
+   * A parked player is run again when it is resumed.
+   * @param worker the thread running the player, used for logging
+   * @return the result of Player::main, Player::Parked if the
+   *   player parked
+   */
+  int run (Dv::Thread::Thread& worker)
+  {
+    worker_ = &worker;
+    return main();
+  }
+
+  /** The number of players that exist, the manager waits for
+   * this to drop to zero when it kills all players.
+   * @return the number of players
+   */
+  static size_t count ()
+  {
+    return __sync_fetch_and_add(&count_, 0);
+  }
 
   /** Type of sets of players. */
   typedef std::set<Player*> Set;
@@ -96,39 +179,281 @@ public:
     name_ = name;
   }
 
+  /** Get the address of the peer of a connection.
+   * @param fd socket of the connection
+   * @return the numeric IP address of the peer, empty if unknown
+   */
+  static std::string peer_address (int fd);
+
+  /** Get the address of the client of this player.
+   * @return the numeric IP address of the peer of the connection
+   */
+  const std::string& address () const
+  {
+    return address_;
+  }
+
+  /** Replace the address of the client by the one a director told
+   * (see Director). Must only be called while the player waits for a
+   * reply from its manager.
+   * @param address the numeric IP address of the client of the director
+   */
+  void forwarded (const std::string& address)
+  {
+    address_ = address;
+    forwarded_ = true;
+  }
+
+  /** Did a director tell the address of the client?
+   * @return a bool, true once forwarded was called
+   */
+  bool forwarded () const
+  {
+    return forwarded_;
+  }
+
+  /** Get the timestamp sent in the greeting, as needed for APOP.
+   * @return the timestamp, e.g. "<1896.697170952@dbc.mtview.ca.us>"
+   */
+  const std::string& banner () const
+  {
+    return banner_;
+  }
+
+  /** Get the number of this session, as shown in the log.
+   * @return a number that differs for every player
+   */
+  unsigned long id () const
+  {
+    return id_;
+  }
+
+  /** Get the number of commands the player read, the last one is the
+   * command it executes, if any.
+   * @return the number of commands
+   */
+  unsigned long commands () const
+  {
+    return commands_;
+  }
+
+  /** Set the limits of this connection (see Shaping).
+   * May be called from any thread.
+   * @param limits new limits of the connection
+   */
+  void limit (const Limits& limits)
+  {
+    shaper_.limit(limits);
+  }
+
+  /** Tell the player that it has logged in: the authorization
+   * deadline no longer applies.
+   */
+  void authorized ()
+  {
+    logged_in_ = true;
+    manager_.timers().cancel(&authorization_);
+  }
+
+  /** Has the player logged in?
+   * @return true iff Player::authorized has been called
+   */
+  bool logged_in () const
+  {
+    return logged_in_;
+  }
+
+  /** Kill the player and wake it up, so that it notices
+   * even if it is waiting for input.
+   */
+  void kill ()
+  {
+    killed_ = true;
+    wake();
+  }
+
+  /** Has the player been killed?
+   * @return true iff Player::kill has been called
+   */
+  bool killed () const
+  {
+    return killed_;
+  }
+
+  /** Set the shaper shared by all connections of this player's user.
+   * Must only be called while the player waits for a reply from
+   * its manager, i.e. by the manager while it handles a request.
+   * @param shaper shaper of the user, 0 if there is none
+   */
+  void share (Shaper* shaper)
+  {
+    user_shaper_ = shaper;
+  }
+
   /** Send out-of-band data to this player by storing them
    * in the incoming_ mailbox.
    */
   void put (const std::string& text)
   {
     incoming_.put(text);
+    wake();
+  }
+
+  /** Tell the player how its manager spent the time of the current
+   * command. Must only be called while the player waits for a reply
+   * from its manager. The times are those the manager's queue reads
+   * anyway, see TokenBucket::now.
+   * @param pushed when the request was queued
+   * @param popped when the manager took it
+   * @param replied when the manager replied
+   * @param storage microseconds the manager spent in storage calls
+   */
+  void timed (double pushed, double popped, double replied, uint32_t storage)
+  {
+    timing_.queue = static_cast<uint32_t> ((popped - pushed) * 1000000);
+    timing_.manager = static_cast<uint32_t> ((replied - popped) * 1000000);
+    timing_.storage = storage;
+    pushed_ = pushed;
+    replied_ = replied;
+  }
+
+  /** Tell the player to move its session to another worker instead of
+   * sending its reply (see Router); the reply is sent if it cannot.
+   * Must only be called while the player waits for a reply from its
+   * manager.
+   * @param worker the worker that has the maildrop of its user open
+   */
+  void move (int worker)
+  {
+    move_to_ = worker;
+  }
+
+  /** Get the user whose session was moved here, see Player::adopt.
+   * @return the name of the user, empty once the manager adopted the
+   *   session (or if it was not moved)
+   */
+  const std::string& moved () const
+  {
+    return moved_;
+  }
+
+  /** Get the number of times the session was moved.
+   * @return the number, 0 if it was not
+   */
+  unsigned int hops () const
+  {
+    return hops_;
+  }
+
+  /** Tell the player to park once it has sent its reply, its manager
+   * watches for new mail (see MailWatcher). Must only be called while
+   * the player waits for a reply from its manager.
+   */
+  void idle ()
+  {
+    idle_requested_ = true;
+  }
+
+  /** Tell the player that new mail was delivered for its user, by
+   * out-of-band data. May be called from any thread; a notice that is
+   * not yet taken (see Player::new_mail) is not repeated.
+   */
+  void mail_arrived ()
+  {
+    if ( __sync_lock_test_and_set(&new_mail_, 1) == 0 )
+      {
+        Metrics::add(Metrics::MailNotices);
+        put("+OK new mail");
+      }
+  }
+
+  /** Take the notice of new mail, if any.
+   * @return true iff Player::mail_arrived was called since the last call
+   */
+  bool new_mail ()
+  {
+    return __sync_lock_test_and_set(&new_mail_, 0) != 0;
+  }
+
+  /** The socket of the connection, which a MailWatcher waits for.
+   * @return the file descriptor
+   */
+  int socket () const
+  {
+    return so_->sockfd();
+  }
+
+  /** The descriptor that Player::wake makes readable.
+   * @return the file descriptor
+   */
+  int wake_fd () const
+  {
+    return wake_fd_;
   }
 private:
 
-  /** Destructor */
-  ~Player () { }
+  /** A deadline of the player, kept by the manager's TimerWheel. */
+  class Deadline : public TimerWheel::Timer
+  {
+  public:
+    enum Kind
+    {
+      Idle = 1,
+      Authorization,
+      Command
+    };
+
+    Deadline (Player& player, Kind kind) : player_ (player), kind_ (kind) { }
+
+    /**
+     * @param kind a Deadline::Kind
+     * @return the name of the deadline as told to the client: "idle",
+     *   "login" or "command"
+     */
+    static const char* name (int kind);
+
+    /** Tell the player which deadline expired and wake it up. A
+     * player that is stuck writing a reply is woken up by shutting
+     * down its connection. */
+    void expired ();
+
+  private:
+    Player& player_;
+    Kind kind_;
+  };
+
   Player (const Player&);
   Player & operator= (const Player&);
 
   /** Main function. Note that this function should not return unless
-   * the player's manager has been informed.
+   * the player's manager has been informed, or the player parked: it
+   * then runs this function again when it is resumed.
    */
-  virtual int main ();
+  int main ();
   /** Constructor.
    * @param manager of this player
    * @param so socket connection of this player with the client
    * @param delay millisecs that the player will wait for the
    *   manager to reply before throwing an exception
-   * @param debug_level only if the master debug level is larger
-   *   than this level will debug output be generated
-   * @param debug object (may be 0)
    */
-  Player (Manager& manager, Dv::shared_ptr<Dv::Net::Socket> so, size_t delay,
-          size_t debug_level, Dv::Debugable* debug);
+  Player (Manager& manager, Dv::shared_ptr<Dv::Net::Socket> so, size_t delay);
 
+  /** Return a pseudo-stream to write log info on, that of the
+   * thread running the player.
+   * @param i debug level, the pseudo stream is real only
+   * if the actual debug level is at least @c i
+   * @return a pseudo stream to write on
+   */
+  Dv::ostream_ptr& log (unsigned int i = 0)
+  {
+    return worker_->log(i);
+  }
 
-  /** Clean up before exiting this thread, in particular send
-   * a 'quit' command to the manager. */
+
+  /** Clean up before exiting this thread, in particular send an
+   * 'abort' command to the manager unless it ended the session (after
+   * QUIT of the client): a session that times out or loses its
+   * connection keeps the messages marked as deleted. */
   void quit ();
 
   /** Read a line from a socket that may time out.
@@ -142,18 +467,86 @@ private:
    * @return 0 if a line was successfully read
    * @return 2 if the player thread was killed (and input is ignored)
    * @return 1 if the read did not succeed, e.g. because of an I/O error
+   * @return 3 if a deadline expired
    */
   int get_line (Dv::Net::Socket& so, std::string& line);
 
+  /** Sleep, without a timeout, until there is input on a socket or
+   * the player is woken up (by Player::wake).
+   * @param so socket to wait for
+   * @return true if there is input (or an error) on the socket
+   */
+  bool wait_for_input (Dv::Net::Socket& so);
+
+  /** Wake up the player if it is waiting for input. */
+  void wake ();
+
   /** Send a message to the player's manager and wait for a reply.
    * @param message to send
    * @return reply from manager on this message
    * @sa Player::Manager::request
    */
-  std::string query_manager (const std::string& message);
+  Reply query_manager (const std::string& message);
+
+  /** Write a reply to the client: first the status line, then
+   * the body (if any), one chunk at a time. Each chunk is flushed
+   * before the next one is produced, so a slow client throttles
+   * the production of the body instead of letting it pile up.
+   * @param reply to write
+   */
+  void send_reply (const Reply& reply);
+
+  /** Send a body that is backed by a file with sendfile(2), so
+   * its octets never pass through user space.
+   * @param body to send, Body::fd must not be -1
+   * @exception std::runtime_error if the body cannot be sent
+   */
+  void send_file (const Body& body);
+
+  /** Hold the player back as long as its shapers require
+   * and account for the delay in the metrics.
+   * @param seconds to wait for the connection's shaper
+   * @param user_seconds to wait for the user's shaper
+   * @param counter the metric that counts this kind of delay
+   */
+  void throttle (double seconds, double user_seconds, Metrics::Counter counter);
+
+  /** Give the timing of the command that was just executed to the
+   * manager's FlightRecorder, if the manager timed it.
+   * @param line the command
+   */
+  void record (const std::string& line);
+
+  /** Send the session to the worker given with Player::move, with the
+   * input that was read ahead; the connection then no longer belongs
+   * to this player.
+   * @return false if it could not be sent, it stays here
+   */
+  bool transfer ();
+
+  /** Account for octets about to be written to the client
+   * and wait if they exceed the limits.
+   * @param n number of octets
+   */
+  void shape_write (size_t n);
+
+  /** Number of existing players. */
+  static size_t count_;
 
   /** Manager of this player. */
   Manager& manager_;
+  /** The thread running this player. */
+  Dv::Thread::Thread* worker_;
+  /** Has the player been killed? */
+  volatile bool killed_;
+  /** Has the player logged in? */
+  bool logged_in_;
+  /** Has the greeting been sent? */
+  bool greeted_;
+  /** Must the player park after its reply? */
+  bool idle_requested_;
+  /** Was new mail told since the manager last looked? */
+  volatile int new_mail_;
 
   /** Connection to user/client. */
   Dv::shared_ptr<Dv::Net::Socket> so_;
@@ -163,12 +556,48 @@ private:
    */
   MailBox mbox_;
   /** Mailbox for incoming 'out of band' data. */
-  MailBox incoming_;
+  Inbox incoming_;
   /** Name of the player. */
   std::string name_;
+  /** Address of the client, the one its director told if any. */
+  std::string address_;
+  /** Was the address told by a director? */
+  bool forwarded_;
+  /** Number of this session. */
+  unsigned long id_;
+  /** Number of commands read. */
+  unsigned long commands_;
+  /** The timing of the current command, so far. */
+  FlightRecorder::Sample timing_;
+  /** When the current command was queued and answered, see timed; 0
+   * until the manager timed it. */
+  double pushed_;
+  double replied_;
+  /** The worker to move the session to, -1 if none. */
+  int move_to_;
+  /** The user of a session moved here, until the manager adopts it. */
+  std::string moved_;
+  /** Input read by the worker that moved the session here. */
+  std::string pending_;
+  /** The number of times the session was moved. */
+  unsigned int hops_;
+  /** Unique timestamp sent in the greeting. */
+  std::string banner_;
   /** Delay used when communicating with the manager or when doing
    * I/O operations. */
   size_t delay_;
+  /** Limits this connection. */
+  Shaper shaper_;
+  /** Limits all connections of the player's user, 0 before login. */
+  Shaper* user_shaper_;
+  /** An eventfd that wakes up the player while it waits for input. */
+  int wake_fd_;
+  /** The Deadline::Kind that expired, 0 if none did. */
+  volatile int expired_;
+  /** The deadlines of the player. */
+  Deadline idle_;
+  Deadline authorization_;
+  Deadline command_;
 };
 
 #endif	/* _PLAYER_H */
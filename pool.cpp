@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <pthread.h>
+
+#include "pool.h"
+#include "player.h"
+
+Pool::Pool (size_t threads, size_t max_threads, size_t stack_size,
+            size_t debug_level, Dv::Debugable* debug) :
+_max_threads (std::max(threads, max_threads)), _stack_size (stack_size),
+_debug_level (debug_level), _debug (debug), _idle (0), _stopping (false)
+{
+  Lock lock(_mutex);
+  for ( size_t i = 0; i < threads; i++ )
+    spawn();
+}
+
+Pool::~Pool ()
+{
+  stop();
+}
+
+void Pool::spawn ()
+{
+  Worker* worker(new Worker(*this, _debug_level, _debug));
+  pthread_attr_t saved;
+  bool saved_ok(_stack_size && pthread_getattr_default_np(&saved) == 0);
+  bool restore(false);
+
+  /* Dv::Thread::Thread creates its thread with the default attributes,
+   * so the small stack is made the default while the worker starts.
+   * Only the pool creates threads once the server is running. */
+  if ( saved_ok )
+    {
+      pthread_attr_t attr;
+
+      pthread_attr_init(&attr);
+      restore = (pthread_attr_setstacksize(&attr, _stack_size) == 0
+                 && pthread_setattr_default_np(&attr) == 0);
+      pthread_attr_destroy(&attr);
+    }
+  worker->start();
+  if ( restore )
+    pthread_setattr_default_np(&saved);
+  if ( saved_ok )
+    pthread_attr_destroy(&saved);
+  _workers.push_back(worker);
+}
+
+void Pool::submit (Player* player)
+{
+  Lock lock(_mutex);
+
+  _queue.push_back(player);
+  if ( _idle < _queue.size() && _workers.size() < _max_threads )
+    spawn();
+  _ready.signal();
+}
+
+size_t Pool::waiting ()
+{
+  Lock lock(_mutex);
+
+  return _queue.size() > _idle ? _queue.size() - _idle : 0;
+}
+
+Player* Pool::take ()
+{
+  Lock lock(_mutex);
+
+  _idle++;
+  while ( _queue.empty() && !_stopping )
+    _ready.wait(_mutex);
+  _idle--;
+
+  if ( _queue.empty() )
+    return 0;
+
+  Player* player(_queue.front());
+  _queue.pop_front();
+  return player;
+}
+
+void Pool::stop ()
+{
+  {
+    Lock lock(_mutex);
+
+    if ( _stopping )
+      return;
+    // Workers only stop once the queue is empty
+    _stopping = true;
+    _ready.broadcast();
+  }
+  for ( size_t i = 0; i < _workers.size(); i++ )
+    {
+      _workers[i]->join();
+      delete _workers[i];
+    }
+  _workers.clear();
+}
+
+int Pool::Worker::main ()
+{
+  Player* player;
+
+  while ( (player = pool_.take()) )
+    {
+      // A parked player is submitted again when it is resumed
+      if ( player->run(*this) != Player::Parked )
+        delete player;
+    }
+  return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * File:   pool.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _POOL_H
+#define	_POOL_H
+
+#include <deque>
+#include <vector>
+#include <cstddef>
+
+#include <dvthread/thread.h>
+
+#include "sync.h"
+
+class Player;
+
+/** A pool of threads that run players. Instead of creating a thread
+ * for every connection and tearing it down when the connection ends,
+ * a player is handed to an idle worker thread, which goes back to the
+ * pool when the player is done. The workers are created with a small
+ * stack, so many of them fit in little memory.
+ *
+ * The pool starts with a number of workers and creates more (up to a
+ * maximum) when a player arrives while all of them are busy. Beyond the
+ * maximum, players wait in a queue for a worker to become idle.
+ */
+class Pool
+{
+public:
+  /** Constructor for Pool, starts the initial workers
+   * @param threads Number of workers created at once
+   * @param max_threads Maximum number of workers
+   * @param stack_size Stack size of a worker in octets, 0 for the default
+   * @param debug_level only if the master debug level is larger
+   *   than this level will debug output be generated
+   * @param debug object (may be 0)
+   */
+  Pool (size_t threads, size_t max_threads, size_t stack_size,
+        size_t debug_level, Dv::Debugable* debug);
+
+  /** Destructor for Pool
+   * Stops the workers, see Pool::stop
+   */
+  ~Pool ();
+
+  /** Run a player on a worker, the pool deletes the player when
+   * its main function returns (unless it parked, see MailWatcher).
+   * @param player to run
+   */
+  void submit (Player* player);
+
+  /**
+   * @return The number of players waiting for a worker
+   */
+  size_t waiting ();
+
+  /** Wait until all submitted players are done, then stop and
+   * join the workers.
+   */
+  void stop ();
+
+private:
+  Pool (const Pool&);
+  Pool& operator= (const Pool&);
+
+  /** A thread of the pool: it runs one player after another. */
+  class Worker : public Dv::Thread::Thread
+  {
+  public:
+    Worker (Pool& pool, size_t debug_level, Dv::Debugable* debug) :
+    Dv::Thread::Thread (false, debug_level, debug), pool_ (pool) { }
+
+  private:
+    virtual int main ();
+
+    Pool& pool_;
+  };
+
+  /** Start a new worker, the pool is locked */
+  void spawn ();
+
+  /** Wait for the next player to run
+   * @return the player, 0 if the pool stops
+   */
+  Player* take ();
+
+  size_t _max_threads;
+  size_t _stack_size;
+  size_t _debug_level;
+  Dv::Debugable* _debug;
+
+  Mutex _mutex;
+  /* Signalled when a player is queued or the pool stops */
+  Condition _ready;
+
+  std::deque<Player*> _queue;
+  std::vector<Worker*> _workers;
+
+  /* Number of workers waiting for a player */
+  size_t _idle;
+
+  bool _stopping;
+};
+
+#endif	/* _POOL_H */
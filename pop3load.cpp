@@ -0,0 +1,350 @@
+/*
+ * File:   pop3load.cpp
+ * Author: Wouter Van Rossem
+ *
+ * Puts load on a running server: every connection logs in as one of a
+ * few users (so that the users have several sessions at once, like a
+ * user with a phone and a laptop), runs a mix of STAT, LIST, UIDL, RETR
+ * and NOOP, and logs in again after a number of commands. Reports the
+ * commands and logins a second, the latency of the commands, and the
+ * logins that were refused.
+ *
+ * The users are load0, load1, ... with the password "load", e.g. a line
+ * "load0:{PLAIN}load" in the authdb for each, and a maildrop for each.
+ *
+ *   pop3load [connections [seconds [users [port [host]]]]]
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+namespace
+{
+  // Commands a session runs before it logs in again
+  const size_t session_length(100);
+
+  /**
+   * @return Seconds since some fixed time
+   */
+  double seconds ()
+  {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  /** What all connections share */
+  struct Run
+  {
+    std::string host;
+    std::string port;
+    size_t users;
+    double until;
+  };
+
+  /** One connection, and what it measured */
+  struct Client
+  {
+    const Run* run;
+    size_t number;
+    unsigned int seed;
+    /* Microseconds of each command */
+    std::vector<uint32_t> latencies;
+    size_t logins;
+    size_t refused;
+    size_t errors;
+  };
+
+  /** A connection to the server, read a line at a time */
+  class Connection
+  {
+  public:
+    Connection () : _fd (-1), _start (0), _end (0) { }
+
+    ~Connection ()
+    {
+      if ( _fd >= 0 )
+        close(_fd);
+    }
+
+    bool open (const Run& run)
+    {
+      struct addrinfo hints, *addresses;
+
+      memset(&hints, 0, sizeof (hints));
+      hints.ai_socktype = SOCK_STREAM;
+      if ( getaddrinfo(run.host.c_str(), run.port.c_str(), &hints, &addresses) != 0 )
+        return false;
+      _fd = socket(addresses->ai_family, SOCK_STREAM, 0);
+      if ( _fd >= 0 && connect(_fd, addresses->ai_addr, addresses->ai_addrlen) != 0 )
+        {
+          close(_fd);
+          _fd = -1;
+        }
+      freeaddrinfo(addresses);
+
+      static const int on(1);
+
+      if ( _fd >= 0 )
+        setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+      return _fd >= 0;
+    }
+
+    bool send (const std::string& command)
+    {
+      std::string line(command + "\r\n");
+
+      return write(_fd, line.data(), line.size()) == static_cast<ssize_t> (line.size());
+    }
+
+    /** Read a line, without its CRLF
+     * @return false if the connection was closed
+     */
+    bool line (std::string& text)
+    {
+      text.clear();
+      for ( ;; )
+        {
+          char* eol(static_cast<char*> (memchr(_buffer + _start, '\n', _end - _start)));
+
+          if ( eol )
+            {
+              text.append(_buffer + _start, eol);
+              _start = eol + 1 - _buffer;
+              if ( !text.empty() && text[text.size() - 1] == '\r' )
+                text.erase(text.size() - 1);
+              return true;
+            }
+          text.append(_buffer + _start, _end - _start);
+          _start = _end = 0;
+
+          ssize_t n(read(_fd, _buffer, sizeof (_buffer)));
+
+          if ( n <= 0 )
+            return false;
+          _end = n;
+        }
+    }
+
+    /** Read the status line of a reply, after the prompt the server
+     * writes before it reads a command
+     * @return false if the connection was closed
+     */
+    bool status (std::string& text)
+    {
+      if ( !line(text) )
+        return false;
+      while ( text.compare(0, 2, "> ") == 0 )
+        text.erase(0, 2);
+      return true;
+    }
+
+    /** Read the body of a multi-line reply, up to the "." line
+     * @return false if the connection was closed
+     */
+    bool body ()
+    {
+      std::string text;
+
+      while ( line(text) )
+        if ( text == "." )
+          return true;
+      return false;
+    }
+
+  private:
+    int _fd;
+    char _buffer[65536];
+    size_t _start;
+    size_t _end;
+  };
+
+  /** Log in, as the user of the client
+   * @return false if the connection was closed or the login refused
+   */
+  bool login (Connection& connection, Client& client, size_t& messages)
+  {
+    std::ostringstream user;
+    std::string reply;
+
+    user << "USER load" << client.number % client.run->users;
+    if ( !connection.status(reply) || !connection.send(user.str())
+         || !connection.status(reply) || !connection.send("PASS load")
+         || !connection.status(reply) )
+      return false;
+    if ( reply.compare(0, 3, "+OK") != 0 )
+      {
+        client.refused++;
+        return false;
+      }
+    client.logins++;
+    if ( !connection.send("STAT") || !connection.status(reply) )
+      return false;
+
+    std::istringstream iss(reply.substr(3));
+
+    messages = 0;
+    iss >> messages;
+    return true;
+  }
+
+  void* client_main (void* arg)
+  {
+    Client& client(*static_cast<Client*> (arg));
+
+    while ( seconds() < client.run->until )
+      {
+        Connection connection;
+        size_t messages;
+
+        if ( !connection.open(*client.run) )
+          {
+            client.errors++;
+            usleep(10000);
+            continue;
+          }
+        size_t refused(client.refused);
+
+        if ( !login(connection, client, messages) )
+          {
+            if ( client.refused == refused )
+              client.errors++;
+            usleep(10000);
+            continue;
+          }
+        for ( size_t i = 0; i < session_length && seconds() < client.run->until; i++ )
+          {
+            int pick(rand_r(&client.seed) % 10);
+            std::ostringstream command;
+            bool multiline(true);
+            std::string reply;
+
+            if ( pick < 3 )
+              {
+                command << "STAT";
+                multiline = false;
+              }
+            else if ( pick < 5 )
+              command << "LIST";
+            else if ( pick < 7 )
+              command << "UIDL";
+            // The server numbers the messages from 0
+            else if ( pick < 9 && messages )
+              command << "RETR " << rand_r(&client.seed) % messages;
+            else
+              {
+                command << "NOOP";
+                multiline = false;
+              }
+
+            double begin(seconds());
+
+            if ( !connection.send(command.str()) || !connection.status(reply) )
+              {
+                client.errors++;
+                break;
+              }
+            if ( reply.compare(0, 3, "+OK") != 0 )
+              client.errors++;
+            else if ( multiline && !connection.body() )
+              {
+                client.errors++;
+                break;
+              }
+            client.latencies.push_back(static_cast<uint32_t> ((seconds() - begin) * 1e6));
+          }
+
+        std::string reply;
+
+        if ( connection.send("QUIT") )
+          connection.status(reply);
+      }
+    return 0;
+  }
+
+  /**
+   * @return The latency below which a fraction of the commands are
+   */
+  uint32_t percentile (const std::vector<uint32_t>& sorted, double fraction)
+  {
+    if ( sorted.empty() )
+      return 0;
+    return sorted[std::min(sorted.size() - 1,
+                           static_cast<size_t> (fraction * sorted.size()))];
+  }
+}
+
+int
+main (int argc, char* argv[])
+{
+  size_t connections(argc > 1 ? atoi(argv[1]) : 64);
+  double duration(argc > 2 ? atof(argv[2]) : 10);
+  Run run;
+
+  run.users = std::max(argc > 3 ? atoi(argv[3]) : 16, 1);
+  run.port = argc > 4 ? argv[4] : "9999";
+  run.host = argc > 5 ? argv[5] : "localhost";
+
+  std::vector<Client> clients(connections);
+  std::vector<pthread_t> threads(connections);
+  double begin(seconds());
+
+  run.until = begin + duration;
+  for ( size_t i = 0; i < connections; i++ )
+    {
+      Client& client(clients[i]);
+
+      client.run = &run;
+      client.number = i;
+      client.seed = i + 1;
+      client.logins = client.refused = client.errors = 0;
+      if ( pthread_create(&threads[i], 0, client_main, &client) != 0 )
+        {
+          std::cerr << "pop3load: " << strerror(errno) << std::endl;
+          return 1;
+        }
+    }
+
+  std::vector<uint32_t> latencies;
+  size_t logins(0), refused(0), errors(0);
+
+  for ( size_t i = 0; i < connections; i++ )
+    {
+      pthread_join(threads[i], 0);
+      latencies.insert(latencies.end(), clients[i].latencies.begin(),
+                       clients[i].latencies.end());
+      logins += clients[i].logins;
+      refused += clients[i].refused;
+      errors += clients[i].errors;
+    }
+
+  double elapsed(seconds() - begin);
+
+  std::sort(latencies.begin(), latencies.end());
+  std::cout << std::fixed << std::setprecision(0)
+          << "commands: " << latencies.size() / elapsed << " a second\n"
+          << "logins:   " << logins / elapsed << " a second, " << refused << " refused\n"
+          << "latency:  p50 " << percentile(latencies, 0.5) << " us, p99 "
+          << percentile(latencies, 0.99) << " us, p99.9 "
+          << percentile(latencies, 0.999) << " us\n"
+          << "errors:   " << errors << "\n"
+          << "(" << connections << " connections, " << run.users << " users, "
+          << std::setprecision(1) << elapsed << " s)" << std::endl;
+  return refused || errors ? 1 : 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * File:   pop3migrate.cpp
+ * Author: Wouter Van Rossem
+ *
+ * Moves the maildrops of a flat tree (one directory per user) into the
+ * layout configured by hashlevels and hashwidth under top, see Layout.
+ * The server must not run while the maildrops are moved.
+ */
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include <dvutil/props.h>
+
+#include "layout.h"
+
+/** Create a directory and the ones above it, up to an existing one
+ * @param path String representing the path to the directory
+ * @return A bool indicating if the directory exists
+ */
+static bool
+make_directories (const std::string& path)
+{
+  std::string::size_type slash(path.rfind('/', path.size() - 2));
+
+  if ( mkdir(path.c_str(), 0700) == 0 || errno == EEXIST )
+    return true;
+  if ( errno != ENOENT || slash == std::string::npos || slash == 0 )
+    return false;
+  return make_directories(path.substr(0, slash + 1))
+          && (mkdir(path.c_str(), 0700) == 0 || errno == EEXIST);
+}
+
+int
+main (int argc, char* argv[])
+{
+  static const char* usage = "pop3migrate config-file [flat-directory]";
+
+  try
+    {
+      if ( argc != 2 && argc != 3 )
+        throw std::runtime_error(usage);
+
+      Dv::Props config;
+
+      {
+        std::ifstream ifconfig(argv[1]);
+        if ( !ifconfig )
+          throw std::runtime_error(std::string(argv[1]) + ": cannot open");
+        ifconfig >> config;
+      }
+
+      Layout layout(config("top").str(), config("hashlevels"),
+                    config("hashwidth"), 0);
+      std::string flat(argc == 3 ? argv[2] : config("top").str());
+
+      if ( flat.empty() || flat[flat.size() - 1] != '/' )
+        flat += '/';
+
+      // Read the whole directory first, it changes while we move
+      std::vector<std::string> users;
+      DIR *dp(opendir(flat.c_str()));
+      struct dirent *ep;
+
+      if ( dp == NULL )
+        throw std::runtime_error(flat + ": cannot open");
+      while ( (ep = readdir(dp)) )
+        {
+          std::string name(ep->d_name);
+          struct stat st;
+
+          if ( !Layout::valid(name) || stat((flat + name).c_str(), &st) != 0
+               || !S_ISDIR(st.st_mode) )
+            continue;
+          // A level of a tree that was already (partly) moved
+          if ( flat == layout.top() && layout.level(name) )
+            {
+              std::cerr << "skipped " << name << ": a level directory"
+                      << std::endl;
+              continue;
+            }
+          users.push_back(name);
+        }
+      closedir(dp);
+
+      size_t moved(0), failed(0);
+
+      for ( size_t i = 0; i < users.size(); i++ )
+        {
+          std::string from(flat + users[i] + "/");
+          std::string to(layout.directory(users[i]));
+
+          if ( from == to )
+            continue;
+          if ( make_directories(to.substr(0, to.rfind('/', to.size() - 2) + 1))
+               && rename(from.c_str(), to.c_str()) == 0 )
+            moved++;
+          else
+            {
+              std::cerr << users[i] << ": " << strerror(errno) << std::endl;
+              failed++;
+            }
+        }
+      std::cout << moved << " maildrops moved, " << failed << " failed"
+              << std::endl;
+      return failed ? 1 : 0;
+    }
+  catch (std::exception& e)
+    {
+      std::cerr << "pop3migrate error: " << e.what() << std::endl;
+      return 2;
+    }
+}
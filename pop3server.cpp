@@ -7,16 +7,33 @@
  */
 
 #include <fstream>
+#include <vector>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
 
 #include <iostream>
 #include <stdexcept>
 #include <dvutil/debug.h>
 #include <dvutil/props.h>
 #include <dvthread/logstream.h>
-#include <dvnet/serversocket.h>
 
 #include "player.h"
 #include "manager.h"
+#include "wirecache.h"
+#include "acceptor.h"
+#include "logger.h"
+#include "trace.h"
+#include "sharedtable.h"
+#include "router.h"
+#include "director.h"
+#include "handoff.h"
+#include "tokenbucket.h"
 
 // In a production system, server_log would be linked
 // to a file stream. Alternatively, it can be launched
@@ -28,6 +45,378 @@ std::ofstream logfile ("pop3.log", std::ios_base::app);
 Dv::Thread::logstream pop3server_log (logfile, "pop3server");
 Dv::Debug debug (&pop3server_log, 0);
 
+namespace
+{
+  // The manager's shutdown descriptor, written on SIGTERM
+  int shutdown_fd(-1);
+
+  // Written on SIGUSR2: stop accepting and let the sessions finish
+  int drain_fd(-1);
+
+  // Set in the master of a prefork server by SIGTERM and SIGINT, and
+  // by SIGUSR2
+  volatile sig_atomic_t stopping(0);
+  volatile sig_atomic_t draining(0);
+
+  void terminated (int)
+  {
+    uint64_t one(1);
+
+    if ( write(shutdown_fd, &one, sizeof (one)) != sizeof (one) )
+      return;
+  }
+
+  void drain (int)
+  {
+    uint64_t one(1);
+
+    if ( write(drain_fd, &one, sizeof (one)) != sizeof (one) )
+      return;
+  }
+
+  void stop (int)
+  {
+    stopping = 1;
+  }
+
+  void stop_accepting (int)
+  {
+    draining = 1;
+  }
+
+  // Only there to interrupt ppoll
+  void child_exited (int) { }
+
+  void handle (int signal, void (*handler) (int))
+  {
+    struct sigaction action;
+
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    sigaction(signal, &action, 0);
+  }
+
+  /** Run the server on the listening sockets until it is shut down
+   * @param config The configuration
+   * @param listeners The listening sockets, one per acceptor; they
+   *   are closed
+   * @param table Shared with the other workers of a prefork server,
+   *   0 if there are none
+   * @param router Moves sessions to the other workers, 0 if there are
+   *   none
+   * @param handoff Where a new server takes over the listening sockets,
+   *   0 if the master of a prefork server does this
+   */
+  void serve (const Dv::Props& config, const std::vector<int>& listeners,
+              SharedTable* table, Router* router, Handoff* handoff)
+  {
+    // The log of the sessions, written by a thread of its own
+    Logger::Writer log_writer(config("logfile").str(),
+                              config("loglevel").get<int>(),
+                              config("logflush"), config("debuglevel"),
+                              &debug);
+    log_writer.start();
+
+#ifdef POP3_TRACE
+    // Writes the trace spans on a schedule and on SIGUSR1
+    Trace::Dumper trace_dumper(config("tracefile").str(), config("traceinterval"),
+                               config("tracekeep"), config("debuglevel"), &debug);
+    trace_dumper.start();
+#endif
+
+    // The threads that run the players, with a small stack (in KB).
+    Pool pool(config("threads"), config("maxthreads"),
+              static_cast<size_t> (config("stacksize")) * 1024,
+              config("debuglevel"), &debug);
+
+    // Set up the manager object. Note that this will also start
+    // a thread that will actually handle player requests.
+    Manager manager("pop3manager", config, pool, table, router, &debug);
+
+    // SIGTERM shuts the server down as the SHUTDOWN command does,
+    // SIGUSR2 drains it
+    shutdown_fd = manager.shutdown_fd();
+    drain_fd = eventfd(0, EFD_CLOEXEC);
+    if ( drain_fd < 0 )
+      throw std::runtime_error("unable to create eventfd");
+    handle(SIGTERM, terminated);
+    handle(SIGUSR2, drain);
+
+    // Readable once the acceptors must stop
+    int stop_fd(eventfd(0, EFD_CLOEXEC));
+    if ( stop_fd < 0 )
+      throw std::runtime_error("unable to create eventfd");
+
+    // The delay to use througout for I/O operations, mailbox waiting etc.
+    size_t delay = config("timeout");
+
+    // Optionally save the wire form of all messages in the background
+    WireConverter converter(config("top").str(), config("wireinterval"),
+                            config("debuglevel"), &debug);
+    if ( config("wireform").str() == "background" )
+      converter.start();
+
+    // Set up the acceptor threads, each with its own socket listening
+    // on the port, and start them.
+    std::vector<Acceptor*> acceptors;
+    for ( size_t i = 0; i < listeners.size(); i++ )
+      acceptors.push_back(new Acceptor(manager, pool, listeners[i], delay,
+                                       stop_fd, config("debuglevel"), &debug));
+    for ( size_t i = 0; i < acceptors.size(); i++ )
+      acceptors[i]->start();
+
+    // Sleep until the manager has processed a shutdown command (or
+    // SIGTERM was received), it then makes its shutdown file descriptor
+    // readable. Or until the server is drained, by SIGUSR2 or because a
+    // new server took the listening sockets over.
+    struct pollfd events[3] = {
+      { manager.shutdown_fd(), POLLIN, 0 },
+      { drain_fd, POLLIN, 0 },
+      { handoff ? handoff->fd() : -1, POLLIN, 0 }
+    };
+    bool drained(false);
+    while ( !drained )
+      {
+        if ( poll(events, 3, -1) < 0 )
+          {
+            if ( errno == EINTR )
+              continue;
+            throw std::runtime_error("poll failed");
+          }
+        if ( events[0].revents || events[1].revents )
+          drained = true;
+        else if ( events[2].revents && handoff->give(listeners) )
+          {
+            pop3server_log << "pop3server: listening sockets handed over, draining"
+                    << std::endl;
+            drained = true;
+          }
+      }
+
+    // The acceptors stop, a new server may accept on the same sockets
+    uint64_t one(1);
+    if ( write(stop_fd, &one, sizeof (one)) != sizeof (one) )
+      throw std::runtime_error("unable to stop the acceptors");
+    for ( size_t i = 0; i < acceptors.size(); i++ )
+      {
+        acceptors[i]->join();
+        delete acceptors[i];
+      }
+    close(stop_fd);
+
+    // Let the sessions finish on their own, until the drain timeout
+    double deadline(TokenBucket::now() + static_cast<size_t> (config("draintimeout")));
+    struct pollfd done = { manager.shutdown_fd(), POLLIN, 0 };
+    while ( Player::count() && TokenBucket::now() < deadline
+            && poll(&done, 1, 100) <= 0 )
+      ;
+
+    // The manager wants to stop: kill it. This will kill all
+    // remaining players and wait for them to finish, then it
+    // will kill the manager thread and wait for it to finish before
+    // returning.
+    manager.kill();
+    pool.stop();
+    // Moved here after the acceptors stopped, the master would hold
+    // them until it exits
+    Router::Session moved;
+    while ( router && router->receive(moved) )
+      Acceptor::refuse(moved.fd, Admission::Backlogged);
+    if ( config("wireform").str() == "background" )
+      {
+        converter.kill();
+        converter.join();
+      }
+#ifdef POP3_TRACE
+    trace_dumper.kill();
+    trace_dumper.join();
+#endif
+    log_writer.kill();
+    log_writer.join();
+    close(drain_fd);
+  }
+
+  /** Run a director on the listening sockets until SIGTERM, see
+   * Director
+   * @param config The configuration
+   * @param listeners The listening sockets; they are closed
+   */
+  void direct (const Dv::Props& config, const std::vector<int>& listeners)
+  {
+    Logger::Writer log_writer(config("logfile").str(),
+                              config("loglevel").get<int>(),
+                              config("logflush"), config("debuglevel"),
+                              &debug);
+    log_writer.start();
+
+    // There is no manager to run SHUTDOWN, only SIGTERM stops it
+    shutdown_fd = eventfd(0, EFD_CLOEXEC);
+    if ( shutdown_fd < 0 )
+      throw std::runtime_error("unable to create eventfd");
+    handle(SIGTERM, terminated);
+
+    Director director(listeners, config("backends").str(), config("vnodes"),
+                      config("healthinterval"), config("authtimeout"),
+                      config("maxsessions"), shutdown_fd, config("debuglevel"),
+                      &debug);
+    director.start();
+    director.join();
+    log_writer.kill();
+    log_writer.join();
+  }
+
+  /** Start a worker process of a prefork server, it serves until it
+   * is shut down and exits
+   * @param worker The number of the worker
+   * @param unblocked The signal mask of the worker
+   * @return The pid of the worker, -1 if it could not be started
+   */
+  pid_t start_worker (const Dv::Props& config, const std::vector<int>& listeners,
+                      SharedTable& table, Router& router, Handoff& handoff,
+                      size_t worker, const sigset_t& unblocked)
+  {
+    // The child would write what is buffered as well
+    pop3server_log.flush();
+    logfile.flush();
+
+    pid_t pid(fork());
+
+    if ( pid != 0 )
+      return pid;
+
+    int status(0);
+
+    // A ^C reaches the whole process group, the master stops the workers
+    signal(SIGINT, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &unblocked, 0);
+    // The master hands the sockets over
+    handoff.forget();
+    table.enter(worker);
+    router.enter(worker);
+    try
+      {
+        serve(config, listeners, &table, &router, 0);
+      }
+    catch (std::exception& e)
+      {
+        pop3server_log << "pop3server worker " << worker << " error: "
+                << e.what() << std::endl;
+        status = 2;
+      }
+    pop3server_log.flush();
+    logfile.flush();
+    _exit(status);
+  }
+
+  /** The master of a prefork server: it starts the workers, starts a
+   * worker again when one dies, and stops them all on SIGTERM, SIGINT
+   * or when one of them was shut down (see Manager::shutdown_fd). When
+   * a new server took the listening sockets over, or on SIGUSR2, the
+   * workers are drained instead. It starts no threads, so that it can
+   * always fork.
+   * @param workers The number of worker processes
+   */
+  void prefork (const Dv::Props& config, const std::vector<int>& listeners,
+                size_t workers)
+  {
+    SharedTable table(workers, config("lockslots"));
+    // Made before the workers, a worker started again receives the
+    // sessions that wait for it
+    Router router(workers);
+    Handoff handoff(config("handoff").str());
+    std::vector<pid_t> pids(workers, -1);
+    std::vector<time_t> started(workers, 0);
+    sigset_t blocked, unblocked;
+    bool forwarded(false);
+
+    // The signals are only taken in ppoll, none is missed
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &blocked, &unblocked);
+    handle(SIGCHLD, child_exited);
+    handle(SIGTERM, stop);
+    handle(SIGINT, stop);
+    handle(SIGUSR2, stop_accepting);
+
+    for ( size_t i = 0; i < workers; i++ )
+      {
+        started[i] = time(0);
+        pids[i] = start_worker(config, listeners, table, router, handoff, i,
+                               unblocked);
+      }
+
+    for ( ;; )
+      {
+        int status;
+        pid_t pid;
+
+        while ( (pid = waitpid(-1, &status, WNOHANG)) > 0 )
+          {
+            size_t i(0);
+
+            while ( i < workers && pids[i] != pid )
+              i++;
+            if ( i == workers )
+              continue;
+            pids[i] = -1;
+
+            // The maildrops it had open are free again
+            size_t released(table.release_worker(i));
+
+            if ( stopping || draining )
+              continue;
+            if ( WIFEXITED(status) && WEXITSTATUS(status) == 0 )
+              {
+                // The worker was shut down, so is the server
+                stopping = 1;
+                continue;
+              }
+            pop3server_log << "pop3server worker " << i << " (pid " << pid
+                    << ") died, " << (WIFSIGNALED(status) ? "signal " : "status ")
+                    << (WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status))
+                    << ", " << released << " maildrops released" << std::endl;
+            // Do not fork in a loop when it dies at once
+            if ( time(0) - started[i] < 1 )
+              sleep(1);
+            started[i] = time(0);
+            pids[i] = start_worker(config, listeners, table, router, handoff, i,
+                                   unblocked);
+          }
+        if ( (stopping || draining) && !forwarded )
+          {
+            for ( size_t i = 0; i < workers; i++ )
+              if ( pids[i] > 0 )
+                kill(pids[i], stopping ? SIGTERM : SIGUSR2);
+            forwarded = true;
+          }
+
+        size_t running(0);
+
+        for ( size_t i = 0; i < workers; i++ )
+          if ( pids[i] > 0 )
+            running++;
+        if ( !running )
+          break;
+
+        // A new server may connect, the signals are taken meanwhile
+        struct pollfd events = { draining ? -1 : handoff.fd(), POLLIN, 0 };
+
+        if ( ppoll(&events, 1, 0, &unblocked) == 1 && handoff.give(listeners) )
+          {
+            pop3server_log << "pop3server: listening sockets handed over, draining"
+                    << std::endl;
+            draining = 1;
+          }
+      }
+    sigprocmask(SIG_SETMASK, &unblocked, 0);
+  }
+}
+
 int
 main (int argc, char* argv[])
 {
@@ -51,39 +440,30 @@ main (int argc, char* argv[])
         ifconfig >> config;
       }
 
-      // Set up the manager object. Note that this will also start
-      // a thread that will actually handle player requests.
-      Manager manager("pop3manager", config, &debug);
+      // The listening sockets, one per acceptor, taken over from a
+      // running server if there is one
+      std::vector<int> listeners;
+      if ( !config("handoff").str().empty()
+           && Handoff::take(config("handoff").str(), listeners) )
+        pop3server_log << "pop3server: took over " << listeners.size()
+                << " listening sockets" << std::endl;
+      else
+        for ( size_t i = 0; i < static_cast<size_t> (config("acceptors")); i++ )
+          listeners.push_back(Acceptor::listen_socket(config("port").get<int>(),
+                                                      config("backlog").get<int>()));
 
-      // The delay to use througout for I/O operations, mailbox waiting etc.
-      size_t delay = config("timeout");
-
-      // Set up a server socket listening on the port
-      Dv::Net::ServerSocket server(config("port").get<int>());
-
-      // Each time around the main loop, check whether the manager wants to stop.
-      while ( !manager.done() )
+      // A director only relays the sessions to the backends. With
+      // workers, each runs the whole server on the same sockets.
+      size_t workers(config("workers"));
+      if ( !config("backends").str().empty() )
+        direct(config, listeners);
+      else if ( workers )
+        prefork(config, listeners, workers);
+      else
         {
-          // The following times out after delay millisec, thus we will check
-          // manager::done regularly.
-          if ( server.connection(delay) )
-            {
-              // The delay argument to ServerSocket::accept() makes e.g.
-              // getline(socket) time out after delay millisecs, ensuring that
-              // we can often check conditions in a player's main loop.
-              Dv::shared_ptr<Dv::Net::Socket> socket(server.accept(delay));
-              // The timeout argument to Player::make ensures that the player
-              // will e.g. timeout after not receiving a reply from the
-              // manager.
-              Player::make(manager, socket, delay, config("debuglevel"), &debug)->start();
-            }
+          Handoff handoff(config("handoff").str());
+          serve(config, listeners, 0, 0, &handoff);
         }
-
-      // The manager wants to stop: kill it. This will kill all
-      // remaining players and wait for them to finish, then it
-      // will kill the manager thread and wait for it to finish before
-      // returning.
-      manager.kill();
     }
   catch (std::exception& e)
     {
@@ -0,0 +1,107 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "prefetcher.h"
+#include "wirecache.h"
+#include "metrics.h"
+
+Prefetcher::Prefetcher (size_t queue_size, size_t debug_level,
+                        Dv::Debugable* debug) :
+Dv::Thread::Thread (false, debug_level, debug), _queue_size (queue_size),
+_stopping (false) { }
+
+void Prefetcher::prefetch (const std::string& filepath)
+{
+  Lock lock(_mutex);
+
+  if ( _queue.size() >= _queue_size )
+    return;
+  _queue.push_back(filepath);
+  _ready.signal();
+}
+
+void Prefetcher::stop ()
+{
+  Lock lock(_mutex);
+
+  _stopping = true;
+  _queue.clear();
+  _ready.broadcast();
+}
+
+int Prefetcher::main ()
+{
+  while ( true )
+    {
+      std::string filepath;
+      {
+        Lock lock(_mutex);
+
+        while ( _queue.empty() && !_stopping )
+          _ready.wait(_mutex);
+        if ( _stopping )
+          return 0;
+        filepath = _queue.front();
+        _queue.pop_front();
+      }
+
+      // RETR sends the saved wire form if there is one
+      unsigned long size;
+      std::string path(WireCache::lookup(filepath, size)
+                       ? WireCache::wire_path(filepath) : filepath);
+      int fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+      struct stat st;
+
+      if ( fd < 0 )
+        continue;
+      // Reads the file into the page cache, without copying it
+      if ( fstat(fd, &st) == 0 && readahead(fd, 0, st.st_size) == 0 )
+        Metrics::add(Metrics::Prefetched);
+      else
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      close(fd);
+    }
+}
+
+Readahead::Readahead (size_t max_depth, unsigned long budget) :
+_max_depth (max_depth), _budget (budget), _depth (max_depth ? 1 : 0),
+_pending_size (0) { }
+
+void Readahead::retrieved (int msg_nr)
+{
+  std::map<int, unsigned long>::iterator it(_pending.find(msg_nr));
+
+  if ( it != _pending.end() )
+    {
+      Metrics::add(Metrics::PrefetchHits);
+      _pending_size -= it->second;
+      _pending.erase(it);
+      if ( _depth < _max_depth )
+        _depth++;
+    }
+
+  // Prefetched messages before this one were skipped
+  bool skipped(false);
+  while ( !_pending.empty() && _pending.begin()->first < msg_nr )
+    {
+      Metrics::add(Metrics::PrefetchMisses);
+      _pending_size -= _pending.begin()->second;
+      _pending.erase(_pending.begin());
+      skipped = true;
+    }
+  if ( skipped && _depth > 1 )
+    _depth /= 2;
+}
+
+bool Readahead::wanted (int msg_nr, unsigned long size) const
+{
+  return _pending.find(msg_nr) == _pending.end()
+          && _pending_size + size <= _budget;
+}
+
+void Readahead::prefetched (int msg_nr, unsigned long size)
+{
+  _pending[msg_nr] = size;
+  _pending_size += size;
+}
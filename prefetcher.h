@@ -0,0 +1,126 @@
+/*
+ * File:   prefetcher.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _PREFETCHER_H
+#define	_PREFETCHER_H
+
+#include <string>
+#include <deque>
+#include <map>
+#include <cstddef>
+
+#include <dvthread/thread.h>
+
+#include "sync.h"
+
+/** A thread that reads messages into the page cache before they are
+ * retrieved. Most clients list the maildrop (UIDL or LIST) and then
+ * retrieve the messages they have not seen yet, in order; a RETR then
+ * finds its message in memory instead of waiting for the disk.
+ *
+ * The manager decides what to read (see Readahead) and only queues the
+ * paths, the reading is done by this thread. When the queue is full,
+ * further paths are dropped: prefetching is merely a hint.
+ */
+class Prefetcher : public Dv::Thread::Thread
+{
+public:
+  /** Constructor for Prefetcher
+   * @param queue_size Maximum number of paths waiting to be read
+   * @param debug_level only if the master debug level is larger
+   *   than this level will debug output be generated
+   * @param debug object (may be 0)
+   */
+  Prefetcher (size_t queue_size, size_t debug_level, Dv::Debugable* debug);
+
+  /** Queue a message to be read, its saved wire form (see WireCache)
+   * is read instead if there is one
+   * @param filepath String representing the path to the message file
+   */
+  void prefetch (const std::string& filepath);
+
+  /** Stop the thread, paths that are still queued are not read */
+  void stop ();
+
+private:
+  Prefetcher (const Prefetcher&);
+  Prefetcher& operator= (const Prefetcher&);
+
+  int main ();
+
+  size_t _queue_size;
+
+  Mutex _mutex;
+  /* Signalled when a path is queued or the thread stops */
+  Condition _ready;
+
+  std::deque<std::string> _queue;
+
+  bool _stopping;
+};
+
+/** Decides which messages of a session to prefetch.
+ *
+ * After a listing, or after the RETR of a message, the next messages
+ * that are not marked as deleted are prefetched, up to the depth and
+ * as long as the prefetched messages that were not retrieved yet stay
+ * within the budget of the session.
+ *
+ * The depth adapts to the session: each prefetched message that is
+ * retrieved (a hit) adds one to it, and the client skipping prefetched
+ * messages (a miss) halves it.
+ *
+ * A Readahead is used by the manager thread only.
+ */
+class Readahead
+{
+public:
+  /** Constructor for Readahead
+   * @param max_depth Most messages to prefetch ahead, 0 means none
+   * @param budget Octets of prefetched messages that were not retrieved yet
+   */
+  Readahead (size_t max_depth = 0, unsigned long budget = 0);
+
+  /** Record that a message is retrieved
+   * @param msg_nr The number of the message
+   */
+  void retrieved (int msg_nr);
+
+  /** May a message be prefetched?
+   * @param msg_nr The number of the message
+   * @param size The size of the message
+   * @return A bool indicating if it should be prefetched now
+   */
+  bool wanted (int msg_nr, unsigned long size) const;
+
+  /** Record that a message is prefetched
+   * @param msg_nr The number of the message
+   * @param size The size of the message
+   */
+  void prefetched (int msg_nr, unsigned long size);
+
+  /**
+   * @return The number of messages to look ahead now
+   */
+  size_t depth () const
+  {
+    return _depth;
+  }
+
+private:
+  size_t _max_depth;
+  unsigned long _budget;
+  size_t _depth;
+
+  /* Key = number of a message that was prefetched but not yet
+   * retrieved, Value = its size */
+  std::map<int, unsigned long> _pending;
+
+  /* Sum of the sizes in _pending */
+  unsigned long _pending_size;
+};
+
+#endif	/* _PREFETCHER_H */
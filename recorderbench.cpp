@@ -0,0 +1,263 @@
+/*
+ * File:   recorderbench.cpp
+ * Author: Wouter Van Rossem
+ *
+ * Measures what the FlightRecorder adds to a command. A client sends
+ * STAT over a socket pair to a player thread, which pushes it on a
+ * FairQueue for a manager thread and writes the reply, as the server
+ * does it for the cheapest command there is. The rounds alternate
+ * between doing the work of the recorder (a clock read and the sample,
+ * the other times are those the queue reads anyway) and not doing it;
+ * the best round of each is compared. A storage timer is measured on
+ * its own, it only wraps file I/O.
+ *
+ *   recorderbench [commands [rounds]]
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "fairqueue.h"
+#include "flightrecorder.h"
+#include "tokenbucket.h"
+#include "sync.h"
+
+namespace
+{
+  /** The hop from the player to the manager and back, as the queue
+   * and the mailboxes of the server do it */
+  struct Hop
+  {
+    Hop () : queue (4096), state (Idle), stopping (false), recording (false),
+    pushed (0), popped (0), replied (0), storage (0) { }
+
+    enum State { Idle, Asked, Answered };
+
+    FairQueue queue;
+    Mutex mutex;
+    Condition changed;
+    State state;
+    bool stopping;
+    bool recording;
+    /* The manager's share of the timing, see Player::timed */
+    double pushed;
+    double popped;
+    double replied;
+    uint32_t storage;
+  };
+
+  struct Session
+  {
+    Hop* hop;
+    FlightRecorder* recorder;
+    int fd;
+  };
+
+  void* manager_main (void* arg)
+  {
+    Hop& hop(*static_cast<Hop*> (arg));
+    Lock lock(hop.mutex);
+
+    for (;;)
+      {
+        while ( hop.state != Hop::Asked && !hop.stopping )
+          hop.changed.wait(hop.mutex);
+        if ( hop.stopping )
+          return 0;
+
+        // As Manager::operator() does it
+        FairQueue::Request request;
+
+        if ( !hop.queue.pop(request) )
+          continue;
+
+        double popped(TokenBucket::now());
+
+        if ( hop.recording )
+          FlightRecorder::storage();
+
+        double handled(TokenBucket::now());
+
+        hop.queue.charge(request, 12, handled);
+        if ( hop.recording )
+          {
+            hop.pushed = request.pushed;
+            hop.popped = popped;
+            hop.replied = handled;
+            hop.storage = FlightRecorder::storage();
+          }
+        hop.state = Hop::Answered;
+        hop.changed.broadcast();
+      }
+  }
+
+  void* player_main (void* arg)
+  {
+    Session& player(*static_cast<Session*> (arg));
+    Hop& hop(*player.hop);
+    static const char reply[] = "+OK 1 4096\r\n";
+    char line[64];
+    ssize_t n;
+
+    while ( (n = read(player.fd, line, sizeof (line) - 1)) > 0 )
+      {
+        bool recording(hop.recording);
+        FlightRecorder::Sample sample;
+
+        line[n] = 0;
+        if ( recording )
+          {
+            sample = FlightRecorder::Sample();
+            FlightRecorder::storage();
+          }
+        {
+          Lock lock(hop.mutex);
+
+          hop.queue.push("alice", Player::Message(0, line), 0);
+          hop.state = Hop::Asked;
+          hop.changed.broadcast();
+          while ( hop.state != Hop::Answered )
+            hop.changed.wait(hop.mutex);
+          hop.state = Hop::Idle;
+          if ( recording )
+            {
+              sample.queue = static_cast<uint32_t> ((hop.popped - hop.pushed) * 1000000);
+              sample.manager = static_cast<uint32_t> ((hop.replied - hop.popped) * 1000000);
+              sample.storage = hop.storage;
+            }
+        }
+        if ( write(player.fd, reply, sizeof (reply) - 1) < 0 )
+          break;
+        if ( !recording )
+          continue;
+
+        // As Player::record does it
+        uint64_t now(FlightRecorder::now());
+        uint64_t begin(static_cast<uint64_t> (hop.pushed * 1000000));
+        size_t i(0);
+
+        sample.total = now - begin;
+        sample.reply = now - static_cast<uint64_t> (hop.replied * 1000000);
+        sample.storage += FlightRecorder::storage();
+        sample.bytes = sizeof (reply) - 1;
+        sample.start = FlightRecorder::wall(begin);
+        for ( ; i < sizeof (sample.verb) - 1 && line[i] != ' ' && line[i] != '\r'; i++ )
+          sample.verb[i] = tolower(line[i]);
+        sample.verb[i] = 0;
+        player.recorder->record(sample);
+      }
+    return 0;
+  }
+
+  /**
+   * @return Seconds since some fixed time
+   */
+  double seconds ()
+  {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  /** Send commands and read the replies
+   * @return Microseconds a command
+   */
+  double run (int fd, size_t commands)
+  {
+    static const char command[] = "STAT\r\n";
+    char reply[64];
+    double begin(seconds());
+
+    for ( size_t i = 0; i < commands; i++ )
+      if ( write(fd, command, sizeof (command) - 1) < 0 || read(fd, reply, sizeof (reply)) <= 0 )
+        {
+          std::cerr << "recorderbench: the player went away" << std::endl;
+          exit(1);
+        }
+    return (seconds() - begin) * 1e6 / commands;
+  }
+}
+
+int
+main (int argc, char* argv[])
+{
+  size_t commands(argc > 1 ? atoi(argv[1]) : 200000);
+  size_t rounds(argc > 2 ? atoi(argv[2]) : 5);
+  int fds[2];
+
+  if ( socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0 )
+    {
+      std::cerr << "recorderbench: " << strerror(errno) << std::endl;
+      return 1;
+    }
+
+  // Never dumps: only the recording is measured
+  Hop hop;
+  FlightRecorder recorder(hop.queue, "/dev/null", 4096, 0, 1, 0, 0);
+  Session player = { &hop, &recorder, fds[1] };
+  pthread_t manager, player_thread;
+
+  pthread_create(&manager, 0, manager_main, &hop);
+  pthread_create(&player_thread, 0, player_main, &player);
+
+  double without(1e9), with(1e9);
+
+  run(fds[0], commands / 10);
+  for ( size_t round = 0; round < rounds; round++ )
+    {
+      hop.recording = false;
+      without = std::min(without, run(fds[0], commands));
+      hop.recording = true;
+      with = std::min(with, run(fds[0], commands));
+    }
+
+  close(fds[0]);
+  pthread_join(player_thread, 0);
+  {
+    Lock lock(hop.mutex);
+
+    hop.stopping = true;
+    hop.changed.broadcast();
+  }
+  pthread_join(manager, 0);
+  close(fds[1]);
+
+  // The recording alone, and a storage timer, without the hop
+  FlightRecorder::Sample sample = FlightRecorder::Sample();
+  double begin(seconds());
+
+  for ( size_t i = 0; i < commands; i++ )
+    {
+      sample.total = FlightRecorder::now() - sample.start;
+      sample.storage = FlightRecorder::storage();
+      recorder.record(sample);
+    }
+
+  double recorded(seconds());
+
+  for ( size_t i = 0; i < commands; i++ )
+    FlightRecorder::Storage storage;
+
+  double timed(seconds());
+
+  std::cout << std::fixed << std::setprecision(2)
+          << "without recorder: " << without << " us a command\n"
+          << "with recorder:    " << with << " us a command\n"
+          << "overhead:         " << (with - without) / without * 100 << " %\n"
+          << "record alone:     " << std::setprecision(0)
+          << (recorded - begin) * 1e9 / commands << " ns\n"
+          << "storage timer:    " << (timed - recorded) * 1e9 / commands << " ns\n"
+          << "(" << rounds << " rounds of " << commands << " commands, best of each)"
+          << std::endl;
+  return 0;
+}
@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "reply.h"
+#include "wirecache.h"
+#include "trace.h"
+#include "flightrecorder.h"
+
+FileBody::FileBody (int fd, size_t window, int lines, const std::string& wirepath) :
+_fd (fd), _buffer (window / 2 ? window / 2 : 1), _lines (lines), _in_header (true),
+_line_length (0), _done (false), _wire_path (wirepath)
+{
+  // The message is not saved if no file of its own can be created
+  if ( !_wire_path.empty() )
+    _tmp_path = WireCache::temporary(_wire_path);
+  if ( !_tmp_path.empty() )
+    {
+      _wire_file.open(_tmp_path.c_str(), std::ios::out | std::ios::binary);
+      if ( !_wire_file.is_open() )
+        unlink(_tmp_path.c_str());
+    }
+}
+
+FileBody::~FileBody ()
+{
+  close(_fd);
+  // The client went away before the whole message was sent
+  if ( _wire_file.is_open() )
+    {
+      _wire_file.close();
+      unlink(_tmp_path.c_str());
+    }
+}
+
+size_t FileBody::cut (size_t size)
+{
+  for ( size_t i = 0; i < size; i++ )
+    {
+      if ( _buffer[i] == '\n' )
+        {
+          // The headers end at the first empty line
+          if ( _in_header )
+            _in_header = (_line_length != 0);
+          else
+            _lines--;
+          _line_length = 0;
+
+          if ( !_in_header && _lines == 0 )
+            {
+              _done = true;
+              return i + 1;
+            }
+        }
+      else if ( _buffer[i] != '\r' )
+        _line_length++;
+    }
+  return size;
+}
+
+bool FileBody::next (std::string& chunk)
+{
+  TRACE_SPAN("message.read");
+  FlightRecorder::Storage storage;
+  chunk.clear();
+  if ( _done )
+    return false;
+
+  ssize_t n;
+
+  while ( (n = read(_fd, &_buffer[0], _buffer.size())) < 0 && errno == EINTR )
+    ;
+
+  size_t size(n > 0 ? n : 0);
+
+  if ( _lines >= 0 )
+    size = cut(size);
+  if ( size == 0 )
+    _done = true;
+  else
+    _encoder.encode(&_buffer[0], size, chunk);
+  if ( _done )
+    _encoder.finish(chunk);
+
+  if ( _wire_file.is_open() )
+    {
+      _wire_file << chunk;
+      if ( _done )
+        {
+          _wire_file.close();
+          if ( !_wire_file || rename(_tmp_path.c_str(), _wire_path.c_str()) != 0 )
+            unlink(_tmp_path.c_str());
+        }
+    }
+  return !chunk.empty();
+}
+
+WireBody::WireBody (int fd, size_t window) :
+_fd (fd), _length (0), _window (window ? window : 1)
+{
+  struct stat st;
+
+  if ( fstat(_fd, &st) == 0 )
+    _length = st.st_size;
+}
+
+WireBody::~WireBody ()
+{
+  close(_fd);
+}
+
+bool WireBody::next (std::string& chunk)
+{
+  chunk.resize(_window);
+
+  ssize_t n(read(_fd, &chunk[0], _window));
+
+  if ( n <= 0 )
+    {
+      chunk.clear();
+      return false;
+    }
+  chunk.resize(n);
+  return true;
+}
+
+ListingBody::ListingBody (Maildrop& maildrop, Kind kind, size_t window) :
+_maildrop (maildrop), _next (0), _kind (kind), _window (window) { }
+
+bool ListingBody::next (std::string& chunk)
+{
+  std::ostringstream oss;
+
+  // Always produce at least one line, even if it exceeds the window
+  while ( _next < _maildrop.nr_of_messages(true)
+          && (oss.tellp() == 0 || static_cast<size_t> (oss.tellp()) < _window) )
+    {
+      Message msg(_maildrop.retrieve_message(_next++));
+
+      if ( !msg.valid() )
+        continue;
+      if ( _kind == Scan )
+        oss << msg << "\r\n";
+      else if ( _kind == Uidl )
+        oss << msg.number() << " " << msg.uidl() << "\r\n";
+      else
+        {
+          // The summary brings the size along from the header cache
+          std::string summary(msg.summary());
+
+          oss << msg.number() << " " << msg.size() << " " << msg.uidl()
+                  << "\t" << summary << "\r\n";
+        }
+    }
+  chunk = oss.str();
+  // New summaries are saved once the whole listing has been sent
+  if ( chunk.empty() && _kind == Meta )
+    _maildrop.save_summaries();
+  return !chunk.empty();
+}
+
+bool TextBody::next (std::string& chunk)
+{
+  chunk = _text.substr(std::min(_next, _text.size()), _window);
+  _next += chunk.size();
+  return !chunk.empty();
+}
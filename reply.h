@@ -0,0 +1,271 @@
+/*
+ * File:   reply.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _REPLY_H
+#define	_REPLY_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstddef>
+
+#include <dvutil/shared_ptr.h>
+
+#include "maildrop.h"
+#include "wire.h"
+
+/** A Body produces the multi-line part of a reply (e.g. the text of
+ * a message for RETR or the scan listing for LIST) in chunks.
+ * The player pulls one chunk at a time and writes it to the socket
+ * before asking for the next one, so a reply never has to be held
+ * in memory as a whole: a blocking write on a full socket send
+ * buffer simply delays the next call to Body::next.
+ */
+class Body
+{
+public:
+  virtual ~Body () { }
+
+  /** Produce the next chunk of the body.
+   * @param chunk string that will be overwritten with the next chunk,
+   *   its size is bounded by the window of the body
+   * @return false if the body is exhausted, chunk is then empty
+   * @exception std::runtime_error if the body cannot be produced
+   */
+  virtual bool next (std::string& chunk) = 0;
+
+  /** A body that is the complete contents of a file can be sent
+   * by the kernel (see sendfile(2)) instead of through next.
+   * @return A file descriptor open for reading, -1 if the body
+   *   is not backed by a file
+   */
+  virtual int fd () const
+  {
+    return -1;
+  }
+
+  /**
+   * @return The number of octets that can be read from fd
+   */
+  virtual size_t length () const
+  {
+    return 0;
+  }
+};
+
+/** A Body that streams a message file in its wire form
+ * (see WireEncoder), or only its headers and the first lines of its
+ * body as for TOP.
+ */
+class FileBody : public Body
+{
+public:
+  /** Constructor for FileBody
+   * @param fd The message file open for reading, see Message::open;
+   *   the body closes it
+   * @param window Maximum size of a single chunk in octets
+   * @param lines Only stream the headers and this many lines of the
+   *   body, -1 means the whole file
+   * @param wirepath If not empty, the wire form is also written to this
+   *   file as it is produced (see WireCache), it only appears once the
+   *   whole message has been written
+   */
+  FileBody (int fd, size_t window, int lines = -1,
+            const std::string& wirepath = "");
+
+  /** Destructor for FileBody
+   * Closes the file and removes an incomplete wire form
+   */
+  ~FileBody ();
+
+  bool next (std::string& chunk);
+
+private:
+  FileBody (const FileBody&);
+  FileBody& operator= (const FileBody&);
+
+  /** Find where the text read for TOP must be cut off
+   * @param size The number of octets in _buffer
+   * @return The number of octets of _buffer that must be sent
+   */
+  size_t cut (size_t size);
+
+  /* The message file */
+  int _fd;
+
+  /* Raw text read from the file, encoding at most doubles its size */
+  std::vector<char> _buffer;
+
+  WireEncoder _encoder;
+
+  /* Number of body lines still to be streamed, -1 if unlimited */
+  int _lines;
+
+  /* Are we still in the headers of the message? */
+  bool _in_header;
+
+  /* Length of the current line so far, not counting a CR */
+  size_t _line_length;
+
+  /* Has the whole body been produced? */
+  bool _done;
+
+  /* Where the wire form is saved, empty if it is not */
+  std::string _wire_path;
+
+  /* The file of this body the wire form is written to, see
+   * WireCache::temporary; empty if it is not saved */
+  std::string _tmp_path;
+
+  /* The wire form while it is being written */
+  std::ofstream _wire_file;
+};
+
+/** A Body that is the wire form of a message as saved by the
+ * WireCache. It needs no encoding at all: the player hands the file
+ * to the kernel, next is only used if that is not possible.
+ */
+class WireBody : public Body
+{
+public:
+  /** Constructor for WireBody
+   * @param fd The wire form open for reading, see Message::open; the
+   *   body closes it
+   * @param window Maximum size of a single chunk in octets
+   */
+  WireBody (int fd, size_t window);
+
+  /** Destructor for WireBody
+   * Closes the file
+   */
+  ~WireBody ();
+
+  bool next (std::string& chunk);
+
+  int fd () const
+  {
+    return _fd;
+  }
+
+  size_t length () const
+  {
+    return _length;
+  }
+
+private:
+  WireBody (const WireBody&);
+  WireBody& operator= (const WireBody&);
+
+  int _fd;
+
+  size_t _length;
+
+  /* Maximum size of a chunk */
+  size_t _window;
+};
+
+/** A Body that produces one line per message: its scan listing
+ * (LIST), its unique id (UIDL) or both with a summary of its headers
+ * (XMETA, see Maildrop::summary). The lines are generated
+ * lazily from the maildrop, which does not change while the player
+ * sends them: only the player's own requests change it.
+ */
+class ListingBody : public Body
+{
+public:
+  enum Kind
+  {
+    Scan, /* "nr size" lines as for LIST */
+    Uidl, /* "nr uidl" lines as for UIDL */
+    Meta /* "nr size uidl" followed by a tab and the summary */
+  };
+
+  /** Constructor for ListingBody
+   * @param maildrop The maildrop whose messages are listed, except
+   *   those marked as deleted
+   * @param kind Which kind of listing to produce
+   * @param window Maximum size of a single chunk in octets
+   */
+  ListingBody (Maildrop& maildrop, Kind kind, size_t window);
+
+  bool next (std::string& chunk);
+
+private:
+  /* The maildrop to list */
+  Maildrop& _maildrop;
+
+  /* Number of the next message to consider */
+  int _next;
+
+  Kind _kind;
+
+  /* Maximum size of a chunk */
+  size_t _window;
+};
+
+/** A Body that is a (small) text produced by the manager, e.g. the
+ * output of STATS.
+ */
+class TextBody : public Body
+{
+public:
+  /** Constructor for TextBody
+   * @param text The text, its lines must end in CRLF
+   * @param window Maximum size of a single chunk in octets
+   */
+  TextBody (const std::string& text, size_t window) :
+  _text (text), _next (0), _window (window ? window : 1) { }
+
+  bool next (std::string& chunk);
+
+private:
+  std::string _text;
+
+  /* Position of the next chunk in _text */
+  size_t _next;
+
+  /* Maximum size of a chunk */
+  size_t _window;
+};
+
+/** The reply of the manager to a request of a player. It consists
+ * of a status line and an optional body that the player streams
+ * to the client after the status line.
+ */
+class Reply
+{
+public:
+  /** Constructor for Reply
+   * @param status The status line, e.g. "+OK" or "-ERR ..."
+   * @param body The body that follows the status line, may be 0
+   */
+  Reply (const std::string& status = "", Body* body = 0) :
+  _status (status), _body (body) { }
+
+  /**
+   * @return The status line of the reply
+   */
+  const std::string& status () const
+  {
+    return _status;
+  }
+
+  /**
+   * @return The body of the reply, 0 if there is none
+   */
+  Body* body () const
+  {
+    return _body.get();
+  }
+
+private:
+  std::string _status;
+
+  /* Shared since replies are copied into and out of mailboxes */
+  Dv::shared_ptr<Body> _body;
+};
+
+#endif	/* _REPLY_H */
@@ -0,0 +1,142 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "router.h"
+
+Router::Router (size_t workers) : _worker (-1)
+{
+  for ( size_t i = 0; i < workers; i++ )
+    {
+      int pair[2];
+
+      if ( socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                      pair) != 0 )
+        {
+          std::string error(strerror(errno));
+
+          for ( size_t j = 0; j < _ends.size(); j++ )
+            close(_ends[j]);
+          throw std::runtime_error("unable to create router sockets: " + error);
+        }
+      _ends.push_back(pair[0]);
+      _ends.push_back(pair[1]);
+    }
+}
+
+Router::~Router ()
+{
+  for ( size_t i = 0; i < _ends.size(); i++ )
+    if ( _ends[i] >= 0 )
+      close(_ends[i]);
+}
+
+void Router::enter (size_t worker)
+{
+  _worker = worker;
+  // The sessions sent to the others are theirs to receive
+  for ( size_t i = 0; i < _ends.size(); i += 2 )
+    if ( i != 2 * worker )
+      {
+        close(_ends[i]);
+        _ends[i] = -1;
+      }
+}
+
+bool Router::send (size_t worker, const Session& session)
+{
+  if ( worker >= _ends.size() / 2 || static_cast<int> (worker) == _worker )
+    return false;
+
+  // The hops, then the user and the address each ending in a 0, then
+  // the input
+  std::string payload(1, static_cast<char> (session.hops));
+
+  payload += session.user;
+  payload += '\0';
+  payload += session.address;
+  payload += '\0';
+  payload += session.pending;
+  if ( payload.size() > MaxSession )
+    return false;
+
+  struct iovec iov = { const_cast<char*> (payload.data()), payload.size() };
+  char control[CMSG_SPACE(sizeof (int))];
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof (msg));
+  memset(control, 0, sizeof (control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+
+  struct cmsghdr* cmsg(CMSG_FIRSTHDR(&msg));
+
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+  memcpy(CMSG_DATA(cmsg), &session.fd, sizeof (int));
+
+  ssize_t sent;
+
+  while ( (sent = sendmsg(_ends[2 * worker + 1], &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0
+          && errno == EINTR )
+    ;
+  return sent == static_cast<ssize_t> (payload.size());
+}
+
+bool Router::receive (Session& session)
+{
+  char payload[MaxSession];
+  struct iovec iov = { payload, sizeof (payload) };
+  char control[CMSG_SPACE(sizeof (int))];
+  struct msghdr msg;
+
+  for ( ;; )
+    {
+      memset(&msg, 0, sizeof (msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof (control);
+
+      ssize_t n(recvmsg(fd(), &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC));
+
+      if ( n < 0 && errno == EINTR )
+        continue;
+      if ( n <= 0 )
+        return false;
+
+      int connection(-1);
+
+      for ( struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg) )
+        if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS )
+          memcpy(&connection, CMSG_DATA(cmsg), sizeof (int));
+
+      // The 0s after the user and after the address
+      const char* start(payload);
+      const char* end(start + n);
+      const char* user_end(static_cast<const char*> (memchr(payload + 1, 0, n - 1)));
+      const char* address_end(user_end
+                              ? static_cast<const char*> (memchr(user_end + 1, 0,
+                                                                 end - user_end - 1))
+                              : 0);
+
+      // Never sent like this, but the connection is not leaked
+      if ( connection < 0 || !address_end || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) )
+        {
+          if ( connection >= 0 )
+            close(connection);
+          continue;
+        }
+      session.fd = connection;
+      session.hops = static_cast<unsigned char> (payload[0]);
+      session.user.assign(start + 1, user_end);
+      session.address.assign(user_end + 1, address_end);
+      session.pending.assign(address_end + 1, end);
+      return true;
+    }
+}
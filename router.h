@@ -0,0 +1,101 @@
+/*
+ * File:   router.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _ROUTER_H
+#define	_ROUTER_H
+
+#include <string>
+#include <vector>
+
+/** Moves sessions between the worker processes of a prefork server
+ * (see pop3server.cpp), so that every session of a user ends up in the
+ * worker that has the maildrop of the user open (see SharedTable): a
+ * second device of the user that connects to another worker is not
+ * refused, its session is moved after it logged in.
+ *
+ * The master creates a Unix socket pair (SOCK_SEQPACKET) for every
+ * worker before it forks them; a worker receives on its own pair and
+ * sends on those of the others. A session is sent as its connection
+ * (SCM_RIGHTS) with the user, the address of the client and the input
+ * that was already read from it. A worker that is started again
+ * inherits its pair, with the sessions that wait in it.
+ */
+class Router
+{
+public:
+  /** A session on its way to another worker */
+  struct Session
+  {
+    /* The connection to the client */
+    int fd;
+    /* The user, who logged in on the worker that sent it */
+    std::string user;
+    /* The numeric address of the client */
+    std::string address;
+    /* Input read from the connection that was not handled yet */
+    std::string pending;
+    /* How often the session was moved */
+    unsigned int hops;
+  };
+
+  /** Constructor for Router, called by the master
+   * @param workers The number of worker processes
+   * @exception std::runtime_error If the sockets cannot be created
+   */
+  Router (size_t workers);
+
+  /** Destructor for Router
+   * Closes the sockets of this process
+   */
+  ~Router ();
+
+  /** Make this process a worker, called right after fork: only the
+   * sockets that send to the other workers stay open, and its own
+   * @param worker The number of the worker, from 0
+   */
+  void enter (size_t worker);
+
+  /**
+   * @return The socket on which this worker receives sessions,
+   *   readable when one waits; -1 in the master
+   */
+  int fd () const
+  {
+    return _worker < 0 ? -1 : _ends[2 * _worker];
+  }
+
+  /** Send a session to another worker, without waiting
+   * @param worker The number of the worker
+   * @param session The session, its connection stays open here
+   * @return false if the worker does not exist, or its queue is full
+   */
+  bool send (size_t worker, const Session& session);
+
+  /** Take a session sent to this worker, without waiting
+   * @param session Filled in; its connection belongs to the caller
+   * @return false if none waits
+   */
+  bool receive (Session& session);
+
+  /** Most times a session is moved, the login of a session that would
+   * move again is refused instead */
+  enum { MaxHops = 2 };
+
+private:
+  Router (const Router&);
+  Router& operator= (const Router&);
+
+  /* Most octets of a session, a larger one is not sent */
+  enum { MaxSession = 16384 };
+
+  /* For each worker the end it receives on, then the end sent to */
+  std::vector<int> _ends;
+
+  /* The worker of this process, -1 in the master */
+  int _worker;
+};
+
+#endif	/* _ROUTER_H */
@@ -0,0 +1,90 @@
+#include <fstream>
+#include <sstream>
+
+#include "shaping.h"
+
+Shaper::Shaper (const Limits& limits) :
+_bytes (limits.bytes, limits.bytes), _commands (limits.commands, limits.commands) { }
+
+void Shaper::limit (const Limits& limits)
+{
+  Lock lock(_mutex);
+
+  _bytes.limit(limits.bytes, limits.bytes);
+  _commands.limit(limits.commands, limits.commands);
+}
+
+double Shaper::write (size_t n)
+{
+  Lock lock(_mutex);
+
+  // A write larger than a second's worth is allowed, it just costs more
+  return _bytes.borrow(n);
+}
+
+double Shaper::command ()
+{
+  Lock lock(_mutex);
+
+  return _commands.borrow();
+}
+
+Shaping::Shaping (const Dv::Props& config) :
+_connection (config("bytespersec").get<double>(), config("cmdspersec").get<double>()),
+_user (config("userbytespersec").get<double>(), config("usercmdspersec").get<double>())
+{
+  std::ifstream in_file(config("shapingfile").str().c_str());
+  std::string line;
+
+  while ( getline(in_file, line) )
+    {
+      std::istringstream iss(line);
+      std::string user;
+      Limits limits;
+
+      if ( line.empty() || line[0] == '#' )
+        continue;
+      if ( iss >> user >> limits.bytes >> limits.commands )
+        _overrides[user] = limits;
+    }
+}
+
+Shaping::~Shaping ()
+{
+  for ( std::map<std::string, std::pair<Shaper*, size_t> >::iterator it = _shapers.begin();
+        it != _shapers.end(); it++ )
+    delete it->second.first;
+}
+
+Limits Shaping::connection (const std::string& user) const
+{
+  std::map<std::string, Limits>::const_iterator it(_overrides.find(user));
+
+  return it != _overrides.end() ? it->second : _connection;
+}
+
+Shaper* Shaping::acquire (const std::string& user)
+{
+  std::map<std::string, std::pair<Shaper*, size_t> >::iterator it(_shapers.find(user));
+
+  if ( it == _shapers.end() )
+    {
+      std::map<std::string, Limits>::const_iterator o(_overrides.find(user));
+
+      it = _shapers.insert(std::make_pair(user, std::make_pair(
+              new Shaper(o != _overrides.end() ? o->second : _user), 0))).first;
+    }
+  it->second.second++;
+  return it->second.first;
+}
+
+void Shaping::release (const std::string& user)
+{
+  std::map<std::string, std::pair<Shaper*, size_t> >::iterator it(_shapers.find(user));
+
+  if ( it != _shapers.end() && --it->second.second == 0 )
+    {
+      delete it->second.first;
+      _shapers.erase(it);
+    }
+}
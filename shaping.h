@@ -0,0 +1,132 @@
+/*
+ * File:   shaping.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _SHAPING_H
+#define	_SHAPING_H
+
+#include <string>
+#include <map>
+#include <cstddef>
+
+#include <dvutil/props.h>
+
+#include "sync.h"
+#include "tokenbucket.h"
+
+/** Limits on what a client may do per second, 0 means unlimited */
+struct Limits
+{
+  Limits (double b = 0, double c = 0) : bytes (b), commands (c) { }
+
+  /* Octets of replies per second */
+  double bytes;
+  /* Commands per second */
+  double commands;
+};
+
+/** A Shaper holds a client back to its limits: it tells how long to
+ * wait before the next write or command. There is one for every
+ * connection and one shared by all connections of the same user, so
+ * it is synchronized.
+ */
+class Shaper
+{
+public:
+  /** Constructor for Shaper
+   * @param limits The limits to enforce
+   */
+  Shaper (const Limits& limits = Limits());
+
+  /** Change the limits
+   * @param limits The new limits
+   */
+  void limit (const Limits& limits);
+
+  /** Account for octets that are about to be written
+   * @param n The number of octets
+   * @return Seconds to wait before writing them
+   */
+  double write (size_t n);
+
+  /** Account for a command that is about to be executed
+   * @return Seconds to wait before executing it
+   */
+  double command ();
+
+private:
+  Shaper (const Shaper&);
+  Shaper& operator= (const Shaper&);
+
+  Mutex _mutex;
+  TokenBucket _bytes;
+  TokenBucket _commands;
+};
+
+/** The shaping configuration and the shapers of all logged in users.
+ * Used by the manager thread only.
+ *
+ * The limits come from pop3.config: bytespersec and cmdspersec per
+ * connection, userbytespersec and usercmdspersec per user. They can be
+ * overridden for individual users in the file named by shapingfile,
+ * which has one "user bytespersec cmdspersec" line per user; the
+ * override then applies per connection as well as per user.
+ */
+class Shaping
+{
+public:
+  /** Constructor for Shaping
+   * @param config The server configuration
+   */
+  Shaping (const Dv::Props& config);
+
+  /** Destructor for Shaping
+   * Deletes the shapers of the users
+   */
+  ~Shaping ();
+
+  /**
+   * @return The limits of a connection whose user is not known yet
+   */
+  const Limits& connection () const
+  {
+    return _connection;
+  }
+
+  /**
+   * @param user The name of the user
+   * @return The limits of a connection of this user
+   */
+  Limits connection (const std::string& user) const;
+
+  /** Get the shaper of a user, every acquire must be matched by
+   * a release when the connection ends.
+   * @param user The name of the user
+   * @return The shaper shared by all connections of the user
+   */
+  Shaper* acquire (const std::string& user);
+
+  /** Release the shaper of a user, it is deleted when the last
+   * connection of the user ends.
+   * @param user The name of the user
+   */
+  void release (const std::string& user);
+
+private:
+  Shaping (const Shaping&);
+  Shaping& operator= (const Shaping&);
+
+  /* Limits of a connection and of a user, if not overridden */
+  Limits _connection;
+  Limits _user;
+
+  /* Key = user name, Value = the limits of the user */
+  std::map<std::string, Limits> _overrides;
+
+  /* Key = user name, Value = the shaper and the number of connections */
+  std::map<std::string, std::pair<Shaper*, size_t> > _shapers;
+};
+
+#endif	/* _SHAPING_H */
@@ -0,0 +1,198 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+
+#include "sharedtable.h"
+#include "metrics.h"
+
+namespace
+{
+  /** Round up to a multiple of a cache line */
+  size_t line_up (size_t n)
+  {
+    return (n + 63) & ~static_cast<size_t> (63);
+  }
+}
+
+SharedTable::Guard::Guard (SharedTable& table) : _table (table)
+{
+  // The previous owner died: the table is repaired before it is marked
+  // consistent, the master releases the maildrops of the worker
+  if ( pthread_mutex_lock(&_table._header->mutex) == EOWNERDEAD )
+    {
+      _table.repair();
+      pthread_mutex_consistent(&_table._header->mutex);
+    }
+}
+
+SharedTable::Guard::~Guard ()
+{
+  pthread_mutex_unlock(&_table._header->mutex);
+}
+
+SharedTable::SharedTable (size_t workers, size_t slots) :
+_memory (MAP_FAILED), _length (0), _header (0), _counters (0), _slots (0),
+_workers (workers), _nr_of_slots (slots ? slots : 1), _worker (-1)
+{
+  size_t counters(line_up(sizeof (Header)));
+  size_t table(counters + line_up(workers * Metrics::NrOfCounters
+                                  * sizeof (unsigned long)));
+
+  _length = table + _nr_of_slots * sizeof (Slot);
+  _memory = mmap(0, _length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                 -1, 0);
+  if ( _memory == MAP_FAILED )
+    throw std::runtime_error(std::string("unable to map shared table: ")
+                             + strerror(errno));
+
+  char* base(static_cast<char*> (_memory));
+
+  _header = reinterpret_cast<Header*> (base);
+  _counters = reinterpret_cast<unsigned long*> (base + counters);
+  _slots = reinterpret_cast<Slot*> (base + table);
+
+  pthread_mutexattr_t attributes;
+
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&_header->mutex, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+  _header->writing = -1;
+
+  // The mapping is zeroed, so are the counters
+  for ( size_t i = 0; i < _nr_of_slots; i++ )
+    _slots[i].worker = Empty;
+}
+
+SharedTable::~SharedTable ()
+{
+  // Only the last process to unmap it would destroy the mutex, and
+  // none knows it is the last: a robust mutex needs no destroying
+  munmap(_memory, _length);
+}
+
+void SharedTable::enter (size_t worker)
+{
+  _worker = worker;
+  Metrics::share(_counters, _workers, worker);
+}
+
+uint64_t SharedTable::hash (const std::string& user)
+{
+  uint64_t h(14695981039346656037ULL);
+
+  for ( size_t i = 0; i < user.size(); i++ )
+    {
+      h ^= static_cast<unsigned char> (user[i]);
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+SharedTable::Slot* SharedTable::find (const std::string& user, uint64_t hash,
+                                      bool insert)
+{
+  Slot* free(0);
+
+  for ( size_t i = 0; i < _nr_of_slots; i++ )
+    {
+      Slot& slot(_slots[(hash + i) % _nr_of_slots]);
+
+      if ( slot.worker == Empty )
+        {
+          if ( !free )
+            free = &slot;
+          break;
+        }
+      if ( slot.worker == Free )
+        {
+          if ( !free )
+            free = &slot;
+          continue;
+        }
+      if ( slot.hash == hash
+           && user.compare(0, sizeof (slot.user) - 1, slot.user) == 0 )
+        return &slot;
+    }
+  if ( !insert || !free )
+    return 0;
+
+  // Marked before the slot is touched, in case this process dies now
+  __atomic_store_n(&_header->writing, static_cast<int32_t> (free - _slots),
+                   __ATOMIC_SEQ_CST);
+  free->hash = hash;
+  strncpy(free->user, user.c_str(), sizeof (free->user) - 1);
+  free->user[sizeof (free->user) - 1] = 0;
+  free->worker = Free;
+  __atomic_store_n(&_header->writing, -1, __ATOMIC_RELEASE);
+  return free;
+}
+
+void SharedTable::repair ()
+{
+  int32_t writing(_header->writing);
+
+  // Free, not Empty: a later slot may be in use by a user that hashes
+  // to an earlier one
+  if ( writing >= 0 && static_cast<size_t> (writing) < _nr_of_slots )
+    {
+      Slot& slot(_slots[writing]);
+
+      slot.hash = 0;
+      memset(slot.user, 0, sizeof (slot.user));
+      slot.worker = Free;
+    }
+  _header->writing = -1;
+  for ( size_t i = 0; i < _nr_of_slots; i++ )
+    {
+      int32_t worker(_slots[i].worker);
+
+      if ( worker != Free && worker != Empty
+           && (worker < 0 || static_cast<size_t> (worker) >= _workers) )
+        _slots[i].worker = Free;
+    }
+}
+
+bool SharedTable::acquire (const std::string& user)
+{
+  Guard guard(*this);
+  Slot* slot(find(user, hash(user), true));
+
+  if ( !slot || (slot->worker != Free && slot->worker != _worker) )
+    return false;
+  slot->worker = _worker;
+  return true;
+}
+
+void SharedTable::release (const std::string& user)
+{
+  Guard guard(*this);
+  Slot* slot(find(user, hash(user), false));
+
+  if ( slot && slot->worker == _worker )
+    slot->worker = Free;
+}
+
+int SharedTable::owner (const std::string& user)
+{
+  Guard guard(*this);
+  Slot* slot(find(user, hash(user), false));
+
+  return slot && slot->worker >= 0 ? slot->worker : -1;
+}
+
+size_t SharedTable::release_worker (size_t worker)
+{
+  Guard guard(*this);
+  size_t released(0);
+
+  for ( size_t i = 0; i < _nr_of_slots; i++ )
+    if ( _slots[i].worker == static_cast<int32_t> (worker) )
+      {
+        _slots[i].worker = Free;
+        released++;
+      }
+  return released;
+}
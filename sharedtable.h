@@ -0,0 +1,153 @@
+/*
+ * File:   sharedtable.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _SHAREDTABLE_H
+#define	_SHAREDTABLE_H
+
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+#include <pthread.h>
+
+/** What the worker processes of a prefork server share (see
+ * pop3server.cpp): which worker has the maildrop of a user open, and
+ * the Metrics of every worker, so that STATS shows the totals.
+ *
+ * The table lives in an anonymous shared mapping that the master
+ * creates before it forks the workers. It is guarded by a robust,
+ * process-shared mutex (a futex): when a worker dies while holding it,
+ * the next process that locks it takes it over. The master then
+ * releases the maildrops of the dead worker and starts another one.
+ *
+ * A maildrop is open in one worker at a time, since the sessions on it
+ * share an index in memory (see Maildrops); a session that logs in on
+ * another worker is moved to that one (see Router). The table is an
+ * open addressing hash table of user names; a user name longer than a
+ * slot holds is told apart by its hash.
+ *
+ * A worker that dies while it fills in a slot leaves it half written:
+ * the next process to lock the table clears that slot, and any slot
+ * that names no worker, before it uses the table.
+ */
+class SharedTable
+{
+public:
+  /** Constructor for SharedTable
+   * @param workers The number of worker processes
+   * @param slots Most maildrops open at once, in all workers together
+   * @exception std::runtime_error If the memory cannot be mapped
+   */
+  SharedTable (size_t workers, size_t slots);
+
+  /** Destructor for SharedTable
+   * Unmaps the table, in the process that calls it
+   */
+  ~SharedTable ();
+
+  /** Make this process a worker, called right after fork: the
+   * maildrops it opens and its metrics are those of the worker
+   * @param worker The number of the worker, from 0
+   */
+  void enter (size_t worker);
+
+  /** Note that this worker opens the maildrop of a user
+   * @param user The name of the user
+   * @return false if another worker has it open or the table is full
+   */
+  bool acquire (const std::string& user);
+
+  /** Note that this worker closed the maildrop of a user
+   * @param user The name of the user
+   */
+  void release (const std::string& user);
+
+  /**
+   * @param user The name of the user
+   * @return The worker that has the maildrop of the user open, -1 if
+   *   none has
+   */
+  int owner (const std::string& user);
+
+  /** Release the maildrops of a worker that died, called by the master
+   * @param worker The number of the worker
+   * @return The number of maildrops it had open
+   */
+  size_t release_worker (size_t worker);
+
+private:
+  SharedTable (const SharedTable&);
+  SharedTable& operator= (const SharedTable&);
+
+  enum
+  {
+    Free = -1, /* The slot was used, look further */
+    Empty = -2 /* The slot was never used, stop looking */
+  };
+
+  /** The maildrop of a user that is open */
+  struct Slot
+  {
+    uint64_t hash;
+    /* The start of the user name, ending in a 0 */
+    char user[52];
+    /* The worker that has it open, or Free or Empty */
+    int32_t worker;
+  };
+
+  /** At the start of the mapping */
+  struct Header
+  {
+    pthread_mutex_t mutex;
+    /* The slot being filled in, -1 if none is */
+    int32_t writing;
+  };
+
+  /** Locks the table for as long as it exists, and repairs it if the
+   * previous owner of the lock died */
+  class Guard
+  {
+  public:
+    Guard (SharedTable& table);
+    ~Guard ();
+
+  private:
+    Guard (const Guard&);
+    Guard& operator= (const Guard&);
+
+    SharedTable& _table;
+  };
+
+  /** Undo what a worker that died holding the lock left half done,
+   * the table is locked */
+  void repair ();
+
+  /** Find the slot of a user, the table is locked
+   * @param user The name of the user
+   * @param hash Its hash
+   * @param insert Return a free slot if the user has none
+   * @return The slot, 0 if there is none
+   */
+  Slot* find (const std::string& user, uint64_t hash, bool insert);
+
+  /** FNV-1a hash of a user name */
+  static uint64_t hash (const std::string& user);
+
+  void* _memory;
+  size_t _length;
+
+  Header* _header;
+  /* workers rows of Metrics::NrOfCounters counters */
+  unsigned long* _counters;
+  Slot* _slots;
+
+  size_t _workers;
+  size_t _nr_of_slots;
+
+  /* The worker of this process, -1 in the master */
+  int _worker;
+};
+
+#endif	/* _SHAREDTABLE_H */
@@ -0,0 +1,105 @@
+/*
+ * File:   sync.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _SYNC_H
+#define	_SYNC_H
+
+#include <pthread.h>
+
+/** A mutex for data that is shared by player threads, e.g. the
+ * shaping state of a user with several connections. Most state is
+ * owned by the manager thread and needs no locking at all.
+ */
+class Mutex
+{
+public:
+  Mutex ()
+  {
+    pthread_mutex_init(&_mutex, 0);
+  }
+
+  ~Mutex ()
+  {
+    pthread_mutex_destroy(&_mutex);
+  }
+
+  void lock ()
+  {
+    pthread_mutex_lock(&_mutex);
+  }
+
+  void unlock ()
+  {
+    pthread_mutex_unlock(&_mutex);
+  }
+
+private:
+  friend class Condition;
+  Mutex (const Mutex&);
+  Mutex& operator= (const Mutex&);
+
+  pthread_mutex_t _mutex;
+};
+
+/** A condition variable to wait on while holding a Mutex */
+class Condition
+{
+public:
+  Condition ()
+  {
+    pthread_cond_init(&_cond, 0);
+  }
+
+  ~Condition ()
+  {
+    pthread_cond_destroy(&_cond);
+  }
+
+  /** Wait until signalled, the mutex must be locked */
+  void wait (Mutex& mutex)
+  {
+    pthread_cond_wait(&_cond, &mutex._mutex);
+  }
+
+  void signal ()
+  {
+    pthread_cond_signal(&_cond);
+  }
+
+  void broadcast ()
+  {
+    pthread_cond_broadcast(&_cond);
+  }
+
+private:
+  Condition (const Condition&);
+  Condition& operator= (const Condition&);
+
+  pthread_cond_t _cond;
+};
+
+/** Holds a Mutex locked for as long as it exists */
+class Lock
+{
+public:
+  Lock (Mutex& mutex) : _mutex (mutex)
+  {
+    _mutex.lock();
+  }
+
+  ~Lock ()
+  {
+    _mutex.unlock();
+  }
+
+private:
+  Lock (const Lock&);
+  Lock& operator= (const Lock&);
+
+  Mutex& _mutex;
+};
+
+#endif	/* _SYNC_H */
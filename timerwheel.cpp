@@ -0,0 +1,117 @@
+#include <cerrno>
+#include <ctime>
+
+#include "timerwheel.h"
+
+TimerWheel::Timer::Timer () :
+_next (0), _prev (0), _expires (0) { }
+
+TimerWheel::TimerWheel (size_t tick, size_t debug_level, Dv::Debugable* debug) :
+Dv::Thread::Thread (false, debug_level, debug), _tick (tick ? tick : 1), _now (0)
+{
+  for ( int level = 0; level < Levels; level++ )
+    for ( int slot = 0; slot < Slots; slot++ )
+      _slots[level][slot]._next = _slots[level][slot]._prev = &_slots[level][slot];
+}
+
+void TimerWheel::unlink (Timer* timer)
+{
+  if ( timer->_next )
+    {
+      timer->_prev->_next = timer->_next;
+      timer->_next->_prev = timer->_prev;
+      timer->_next = timer->_prev = 0;
+    }
+}
+
+void TimerWheel::insert (Timer* timer)
+{
+  unsigned long long delta(timer->_expires - _now);
+  int level(0);
+
+  // The lowest level whose range covers the deadline
+  while ( level < Levels - 1 && delta >= (1ULL << (Bits * (level + 1))) )
+    level++;
+
+  // Beyond the range of the wheel: park in the last slot of the top
+  // level, the timer is put back when that slot comes round.
+  unsigned long long expires(timer->_expires);
+  if ( delta >= (1ULL << (Bits * Levels)) )
+    expires = _now + (1ULL << (Bits * Levels)) - 1;
+
+  Timer* head(&_slots[level][(expires >> (Bits * level)) & (Slots - 1)]);
+  timer->_next = head;
+  timer->_prev = head->_prev;
+  head->_prev->_next = timer;
+  head->_prev = timer;
+}
+
+void TimerWheel::schedule (Timer* timer, size_t delay)
+{
+  Lock lock(_mutex);
+
+  unlink(timer);
+  // Round up, a timer never expires early
+  timer->_expires = _now + (delay + _tick - 1) / _tick + 1;
+  insert(timer);
+}
+
+void TimerWheel::cancel (Timer* timer)
+{
+  Lock lock(_mutex);
+
+  unlink(timer);
+}
+
+void TimerWheel::advance ()
+{
+  Lock lock(_mutex);
+
+  _now++;
+
+  // When a level comes round, its timers move down to the levels below
+  for ( int level = 1; level < Levels; level++ )
+    {
+      if ( (_now & ((1ULL << (Bits * level)) - 1)) != 0 )
+        break;
+
+      Timer* head(&_slots[level][(_now >> (Bits * level)) & (Slots - 1)]);
+      while ( head->_next != head )
+        {
+          Timer* timer(head->_next);
+
+          unlink(timer);
+          insert(timer);
+        }
+    }
+
+  Timer* head(&_slots[0][_now & (Slots - 1)]);
+  while ( head->_next != head )
+    {
+      Timer* timer(head->_next);
+
+      unlink(timer);
+      if ( timer->_expires <= _now )
+        timer->expired();
+      else
+        insert(timer); // parked beyond the range of the wheel
+    }
+}
+
+int TimerWheel::main ()
+{
+  struct timespec next;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while ( !killed() )
+    {
+      // Sleep until the next tick, without drifting
+      next.tv_nsec += (_tick % 1000) * 1000000;
+      next.tv_sec += _tick / 1000 + next.tv_nsec / 1000000000;
+      next.tv_nsec %= 1000000000;
+      while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0) == EINTR )
+        ;
+      advance();
+    }
+  return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * File:   timerwheel.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _TIMERWHEEL_H
+#define	_TIMERWHEEL_H
+
+#include <cstddef>
+
+#include <dvthread/thread.h>
+
+#include "sync.h"
+
+/** A hierarchical timer wheel: a single thread that keeps the deadlines
+ * of all sessions (idle, authorization and command timeouts) and calls
+ * a Timer back when its deadline passes. Sessions themselves can then
+ * sleep without a timeout until there is input or a deadline expires.
+ *
+ * Time advances in ticks. The wheel has Levels levels of Slots slots;
+ * a timer is kept in the lowest level whose range covers its deadline
+ * and moves down a level when the level above comes round. Scheduling,
+ * cancelling and each tick cost O(1), no matter how many timers there
+ * are.
+ */
+class TimerWheel : public Dv::Thread::Thread
+{
+public:
+  /** A timer that can be scheduled on a TimerWheel. A Timer is an
+   * intrusive list node, so scheduling it allocates nothing.
+   */
+  class Timer
+  {
+  public:
+    Timer ();
+
+    virtual ~Timer () { }
+
+    /** Called by the wheel thread when the deadline has passed. The
+     * wheel is locked meanwhile: the function must be short and must
+     * not schedule or cancel timers.
+     */
+    virtual void expired () = 0;
+
+  private:
+    friend class TimerWheel;
+    Timer (const Timer&);
+    Timer& operator= (const Timer&);
+
+    /* Neighbours in the slot, 0 if the timer is not scheduled */
+    Timer* _next;
+    Timer* _prev;
+
+    /* Tick at which the timer expires */
+    unsigned long long _expires;
+  };
+
+  /** Constructor for TimerWheel
+   * @param tick millisecs per tick, the resolution of the wheel
+   * @param debug_level only if the master debug level is larger
+   *   than this level will debug output be generated
+   * @param debug object (may be 0)
+   */
+  TimerWheel (size_t tick, size_t debug_level, Dv::Debugable* debug);
+
+  /** Schedule a timer, if it is already scheduled it is moved
+   * @param timer The timer
+   * @param delay millisecs until the timer expires
+   */
+  void schedule (Timer* timer, size_t delay);
+
+  /** Cancel a timer, nothing happens if it is not scheduled. After
+   * this returns, Timer::expired is not running and will not be called.
+   * @param timer The timer
+   */
+  void cancel (Timer* timer);
+
+private:
+  TimerWheel (const TimerWheel&);
+  TimerWheel& operator= (const TimerWheel&);
+
+  enum
+  {
+    Bits = 6,
+    Slots = 1 << Bits,
+    Levels = 4
+  };
+
+  virtual int main ();
+
+  /** Put a scheduled timer in the right slot, the wheel is locked */
+  void insert (Timer* timer);
+
+  /** Take a timer out of its slot, the wheel is locked */
+  static void unlink (Timer* timer);
+
+  /** Advance the wheel by one tick and call the expired timers */
+  void advance ();
+
+  /* Millisecs per tick */
+  size_t _tick;
+
+  Mutex _mutex;
+
+  /* The current tick */
+  unsigned long long _now;
+
+  /* Each slot is a circular list with a sentinel that never expires */
+  struct Sentinel : public Timer
+  {
+    void expired () { }
+  };
+  Sentinel _slots[Levels][Slots];
+};
+
+#endif	/* _TIMERWHEEL_H */
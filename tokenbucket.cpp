@@ -0,0 +1,61 @@
+#include <time.h>
+
+#include "tokenbucket.h"
+
+TokenBucket::TokenBucket (double rate, double burst) :
+_rate (rate), _burst (burst), _tokens (burst), _last (now ()) { }
+
+double TokenBucket::now ()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void TokenBucket::refill ()
+{
+  double t(now());
+
+  _tokens += (t - _last) * _rate;
+  if ( _tokens > _burst )
+    _tokens = _burst;
+  _last = t;
+}
+
+bool TokenBucket::take (double n)
+{
+  if ( _rate <= 0 )
+    return true;
+  refill();
+  if ( _tokens < n )
+    return false;
+  _tokens -= n;
+  return true;
+}
+
+double TokenBucket::borrow (double n)
+{
+  if ( _rate <= 0 )
+    return 0;
+  refill();
+  _tokens -= n;
+  return _tokens < 0 ? -_tokens / _rate : 0;
+}
+
+double TokenBucket::tokens ()
+{
+  if ( _rate <= 0 )
+    return _burst;
+  refill();
+  return _tokens;
+}
+
+void TokenBucket::limit (double rate, double burst)
+{
+  refill();
+  _rate = rate;
+  _burst = burst;
+  if ( _tokens > _burst )
+    _tokens = _burst;
+}
@@ -0,0 +1,73 @@
+/*
+ * File:   tokenbucket.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _TOKENBUCKET_H
+#define	_TOKENBUCKET_H
+
+/** A token bucket: tokens flow in at a fixed rate up to a maximum
+ * (the burst). An action that costs n tokens may only proceed if the
+ * bucket holds at least n tokens. A TokenBucket is not synchronized,
+ * its owner must make sure only one thread uses it at a time.
+ */
+class TokenBucket
+{
+public:
+  /** Constructor for TokenBucket, the bucket starts full
+   * @param rate Number of tokens added per second, 0 means unlimited
+   * @param burst Maximum number of tokens in the bucket
+   */
+  TokenBucket (double rate = 0, double burst = 0);
+
+  /** Take tokens from the bucket if there are enough
+   * @param n Number of tokens to take
+   * @return A bool indicating if the tokens were taken
+   */
+  bool take (double n = 1);
+
+  /** Take tokens from the bucket, even if that leaves it in debt
+   * @param n Number of tokens to take
+   * @return Seconds to wait until the bucket is out of debt again
+   */
+  double borrow (double n = 1);
+
+  /**
+   * @return Number of tokens currently in the bucket
+   */
+  double tokens ();
+
+  /**
+   * @return A bool indicating if the bucket is full, i.e. it does not
+   *   remember anything anymore and may be discarded
+   */
+  bool full ()
+  {
+    return tokens() >= _burst;
+  }
+
+  /** Change the rate and burst of the bucket, keeping its tokens
+   * @param rate Number of tokens added per second, 0 means unlimited
+   * @param burst Maximum number of tokens in the bucket
+   */
+  void limit (double rate, double burst);
+
+  /**
+   * @return Seconds since some fixed point in the past
+   */
+  static double now ();
+
+private:
+  /** Add the tokens that flowed in since the last refill */
+  void refill ();
+
+  double _rate;
+  double _burst;
+  double _tokens;
+
+  /* Time of the last refill */
+  double _last;
+};
+
+#endif	/* _TOKENBUCKET_H */
@@ -0,0 +1,271 @@
+#ifdef POP3_TRACE
+
+#include <ctime>
+#include <cerrno>
+#include <cstdio>
+#include <csignal>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+namespace
+{
+  // Spans in the ring of a thread
+  const unsigned long ring_size(4096);
+
+  // The context of the spans of this thread
+  __thread unsigned long current_session(0);
+  __thread unsigned long current_command(0);
+}
+
+struct Trace::Ring
+{
+  Ring () : head (0), tail (0), dropped (0), owned (true), thread (0), next (0) { }
+
+  Event events[ring_size];
+  /* Number of spans written, only changed by the owner */
+  unsigned long head;
+  /* Number of spans taken, only changed by the dumper */
+  unsigned long tail;
+  /* Spans that did not fit since the dumper last looked */
+  unsigned long dropped;
+  /* Is a thread using the ring? */
+  bool owned;
+  /* The thread using it */
+  long thread;
+  Ring* next;
+};
+
+volatile bool Trace::_enabled(false);
+pthread_key_t Trace::_key;
+bool Trace::_keyed(false);
+Trace::Ring* Trace::_rings(0);
+Mutex Trace::_mutex;
+int Trace::Dumper::_signal_fd(-1);
+
+uint64_t Trace::now ()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t> (ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+Trace::Context::Context (unsigned long session, unsigned long command) :
+_session (current_session), _command (current_command)
+{
+  current_session = session;
+  current_command = command;
+}
+
+Trace::Context::~Context ()
+{
+  current_session = _session;
+  current_command = _command;
+}
+
+Trace::Ring* Trace::ring ()
+{
+  static __thread Ring* current(0);
+
+  if ( current )
+    return current;
+
+  Lock lock(_mutex);
+
+  if ( !_keyed )
+    _keyed = pthread_key_create(&_key, release) == 0;
+  // A ring of a thread that ended can be used once it is empty
+  for ( Ring* r = _rings; r && !current; r = r->next )
+    if ( !r->owned && r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) )
+      {
+        r->owned = true;
+        current = r;
+      }
+  if ( !current )
+    {
+      current = new Ring;
+      current->next = _rings;
+      _rings = current;
+    }
+  current->thread = syscall(SYS_gettid);
+  if ( _keyed )
+    pthread_setspecific(_key, current);
+  return current;
+}
+
+void Trace::release (void* ring)
+{
+  Lock lock(_mutex);
+
+  static_cast<Ring*> (ring)->owned = false;
+}
+
+void Trace::record (const char* name, uint64_t begin, uint64_t end)
+{
+  if ( !_enabled )
+    return;
+
+  Ring* r(ring());
+  unsigned long head(r->head);
+
+  if ( head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= ring_size )
+    {
+      __sync_fetch_and_add(&r->dropped, 1);
+      return;
+    }
+
+  Event& event(r->events[head % ring_size]);
+
+  event.begin = begin;
+  event.end = end;
+  event.name = name;
+  event.session = current_session;
+  event.command = current_command;
+  event.thread = r->thread;
+  // Publish the span to the dumper
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned long Trace::drain (std::deque<Event>& events)
+{
+  Ring* rings;
+  {
+    Lock lock(_mutex);
+
+    rings = _rings;
+  }
+
+  // Rings are only added in front, so the list from here on is fixed
+  unsigned long dropped(0);
+
+  for ( Ring* r = rings; r; r = r->next )
+    {
+      unsigned long head(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE));
+      unsigned long tail(r->tail);
+
+      for ( ; tail != head; ++tail )
+        events.push_back(r->events[tail % ring_size]);
+      __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+      dropped += __sync_fetch_and_and(&r->dropped, 0);
+    }
+  return dropped;
+}
+
+Trace::Dumper::Dumper (const std::string& path, size_t interval, size_t keep,
+                       size_t debug_level, Dv::Debugable* debug) :
+Dv::Thread::Thread (false, debug_level, debug), _path (path),
+_interval (interval), _keep (keep), _dropped (0), _dumps (0)
+{
+  struct sigaction action;
+
+  _signal_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  action.sa_handler = signalled;
+  if ( _signal_fd < 0 || sigaction(SIGUSR1, &action, 0) != 0 )
+    throw std::runtime_error("unable to handle SIGUSR1 for tracing");
+  _enabled = true;
+}
+
+Trace::Dumper::~Dumper ()
+{
+  _enabled = false;
+  signal(SIGUSR1, SIG_IGN);
+  close(_signal_fd);
+}
+
+void Trace::Dumper::signalled (int)
+{
+  uint64_t one(1);
+
+  // write(2) is safe in a signal handler
+  if ( write(_signal_fd, &one, sizeof (one)) != sizeof (one) )
+    ; // a dump is already asked for
+}
+
+int Trace::Dumper::main ()
+{
+  uint64_t next(now() + _interval * 1000000);
+
+  while ( !killed() )
+    {
+      struct pollfd pfd = { _signal_fd, POLLIN, 0 };
+      bool asked(poll(&pfd, 1, 100) > 0);
+
+      if ( asked )
+        {
+          uint64_t count;
+          if ( read(_signal_fd, &count, sizeof (count)) != sizeof (count) )
+            ; // someone else reset it
+        }
+      _dropped += drain(_kept);
+      // Only the most recent spans are kept
+      if ( _kept.size() > _keep )
+        {
+          _dropped += _kept.size() - _keep;
+          _kept.erase(_kept.begin(), _kept.end() - _keep);
+        }
+      if ( asked || (_interval && now() >= next) )
+        {
+          dump();
+          next = now() + _interval * 1000000;
+        }
+    }
+
+  // Write what was traced before the dumper was killed
+  _dropped += drain(_kept);
+  dump();
+  return 0;
+}
+
+void Trace::Dumper::dump ()
+{
+  if ( _kept.empty() && !_dropped )
+    return;
+
+  std::ostringstream name;
+
+  name << _path << "." << ++_dumps << ".json";
+
+  std::ofstream out(name.str().c_str());
+  char line[256];
+  pid_t pid(getpid());
+
+  if ( !out )
+    {
+      log() << "trace: unable to write " << name.str() << std::endl;
+      return;
+    }
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  for ( size_t i = 0; i < _kept.size(); i++ )
+    {
+      const Event& e(_kept[i]);
+
+      snprintf(line, sizeof (line),
+               "{\"name\":\"%s\",\"cat\":\"pop3\",\"ph\":\"X\",\"ts\":%llu,"
+               "\"dur\":%llu,\"pid\":%d,\"tid\":%ld,"
+               "\"args\":{\"session\":%lu,\"command\":%lu}},\n",
+               e.name, static_cast<unsigned long long> (e.begin),
+               static_cast<unsigned long long> (e.end - e.begin),
+               static_cast<int> (pid), e.thread, e.session, e.command);
+      out << line;
+    }
+  // The last element tells how many spans are missing
+  snprintf(line, sizeof (line),
+           "{\"name\":\"trace.dropped\",\"ph\":\"C\",\"ts\":%llu,\"pid\":%d,"
+           "\"args\":{\"spans\":%lu}}\n]}\n",
+           static_cast<unsigned long long> (now()), static_cast<int> (pid),
+           _dropped);
+  out << line;
+  _kept.clear();
+  _dropped = 0;
+}
+
+#endif	/* POP3_TRACE */
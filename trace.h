@@ -0,0 +1,203 @@
+/*
+ * File:   trace.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _TRACE_H
+#define	_TRACE_H
+
+/** Trace spans: where the time of a command goes, from reading it in
+ * the player to handling it in the manager and reading the message
+ * files. They are only compiled in with -DPOP3_TRACE (make
+ * TRACE=-DPOP3_TRACE); otherwise the macros below expand to nothing
+ * and their arguments are not even evaluated.
+ *
+ * TRACE_CONTEXT(session, command) tells the spans that follow on this
+ * thread, up to the end of the enclosing block, which session and
+ * which command of it they belong to. TRACE_SPAN(name) times the rest
+ * of the enclosing block. TRACE_RECORD(name, begin, end) records a span
+ * that was timed otherwise, in microseconds of CLOCK_MONOTONIC. Names
+ * must be string literals.
+ */
+#define TRACE_JOIN(prefix, line) prefix ## line
+#define TRACE_NAME(prefix, line) TRACE_JOIN(prefix, line)
+
+#ifdef POP3_TRACE
+
+#define TRACE_CONTEXT(session, command) \
+  Trace::Context TRACE_NAME(trace_context_, __LINE__) (session, command)
+#define TRACE_SPAN(name) Trace::Span TRACE_NAME(trace_span_, __LINE__) (name)
+#define TRACE_RECORD(name, begin, end) Trace::record (name, begin, end)
+
+#include <string>
+#include <deque>
+#include <cstddef>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <dvthread/thread.h>
+
+#include "sync.h"
+
+/** The spans are recorded like the records of the Logger: each thread
+ * copies them into a ring buffer of its own, without a lock. A
+ * Trace::Dumper thread takes them from all rings, keeps the most recent
+ * ones and writes them as a Chrome trace (JSON, as read by
+ * chrome://tracing and Perfetto) on a schedule and when the process
+ * receives SIGUSR1.
+ */
+class Trace
+{
+private:
+  /** A span as it is recorded */
+  struct Event
+  {
+    uint64_t begin;
+    uint64_t end;
+    const char* name;
+    unsigned long session;
+    unsigned long command;
+    /* The thread that recorded it */
+    long thread;
+  };
+
+public:
+  /**
+   * @return The time in microseconds, from CLOCK_MONOTONIC
+   */
+  static uint64_t now ();
+
+  /** Record a span of this thread, in the current context
+   * @param name What was done, a string literal
+   * @param begin When it began, see Trace::now
+   * @param end When it ended, see Trace::now
+   */
+  static void record (const char* name, uint64_t begin, uint64_t end);
+
+  /** Times its own lifetime, see TRACE_SPAN */
+  class Span
+  {
+  public:
+    Span (const char* name) : _name (name), _begin (now ()) { }
+
+    ~Span ()
+    {
+      record(_name, _begin, now());
+    }
+
+  private:
+    Span (const Span&);
+    Span& operator= (const Span&);
+
+    const char* _name;
+    uint64_t _begin;
+  };
+
+  /** Sets the context of the spans of this thread during its
+   * lifetime, see TRACE_CONTEXT */
+  class Context
+  {
+  public:
+    Context (unsigned long session, unsigned long command);
+    ~Context ();
+
+  private:
+    Context (const Context&);
+    Context& operator= (const Context&);
+
+    unsigned long _session;
+    unsigned long _command;
+  };
+
+  /** The thread that writes the spans. Spans are only recorded while
+   * it exists.
+   */
+  class Dumper : public Dv::Thread::Thread
+  {
+  public:
+    /** Constructor for Dumper, SIGUSR1 makes it write the spans
+     * @param path The spans are written to path.1.json, path.2.json, ...
+     * @param interval Seconds between two dumps, 0 to dump only on
+     *   SIGUSR1 and when the thread is killed
+     * @param keep Most spans kept for the next dump, older ones are
+     *   dropped
+     * @param debug_level only if the master debug level is larger
+     *   than this level will debug output be generated
+     * @param debug object (may be 0)
+     * @exception std::runtime_error If the signal cannot be handled
+     */
+    Dumper (const std::string& path, size_t interval, size_t keep,
+            size_t debug_level, Dv::Debugable* debug);
+
+    /** Destructor for Dumper
+     * Stops recording spans
+     */
+    ~Dumper ();
+
+  private:
+    Dumper (const Dumper&);
+    Dumper& operator= (const Dumper&);
+
+    /** Collect the spans until killed, then write what is left */
+    int main ();
+
+    /** Write the kept spans to the next file and forget them */
+    void dump ();
+
+    /** Make the dumper dump, called on SIGUSR1 */
+    static void signalled (int);
+
+    std::string _path;
+    size_t _interval;
+    size_t _keep;
+
+    /* The most recent spans, oldest first */
+    std::deque<Event> _kept;
+
+    /* Spans lost since the last dump, the rings or _kept were full */
+    unsigned long _dropped;
+
+    /* Number of the last file written */
+    unsigned long _dumps;
+
+    /* Readable when a dump is asked for */
+    static int _signal_fd;
+  };
+
+private:
+  struct Ring;
+
+  /** The ring of this thread, registered at first use */
+  static Ring* ring ();
+
+  /** Take the spans from all rings
+   * @param events The spans are appended to this
+   * @return The number of spans that were dropped since the last call
+   */
+  static unsigned long drain (std::deque<Event>& events);
+
+  /** Forget the ring of a thread that ends, see pthread_key_create */
+  static void release (void* ring);
+
+  /* Is a dumper running? */
+  static volatile bool _enabled;
+
+  /* Tells a thread that ends to release its ring */
+  static pthread_key_t _key;
+  static bool _keyed;
+
+  /* All rings, a ring is never freed but reused by a later thread */
+  static Ring* _rings;
+  static Mutex _mutex;
+};
+
+#else
+
+#define TRACE_CONTEXT(session, command) ((void) 0)
+#define TRACE_SPAN(name) ((void) 0)
+#define TRACE_RECORD(name, begin, end) ((void) 0)
+
+#endif	/* POP3_TRACE */
+
+#endif	/* _TRACE_H */
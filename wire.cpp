@@ -0,0 +1,260 @@
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include "wire.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WIRE_X86 1
+#include <immintrin.h>
+#endif
+
+/* The kernels below do the actual scanning. Each one exists in a scalar
+ * version and, on x86, in an SSE2 and an AVX2 version. The version to
+ * use is selected once, when the program starts. */
+namespace
+{
+  /** Find the first LF in [p, end)
+   * @return pointer to the LF or end if there is none
+   */
+  typedef const char* (*FindLf) (const char* p, const char* end);
+
+  /** Count the octets that must be inserted to encode [p, end):
+   * a CR for each LF that is not preceded by a CR and a '.' for each
+   * '.' at the start of a line.
+   * @param cr Was the octet before p a CR? Updated for the octet at end-1
+   * @param line_start Is p at the start of a line? Updated for end
+   */
+  typedef unsigned long (*CountExtra) (const char* p, const char* end,
+                                       bool& cr, bool& line_start);
+
+  const char* find_lf_scalar (const char* p, const char* end)
+  {
+    const void* lf(memchr(p, '\n', end - p));
+    return lf ? static_cast<const char*> (lf) : end;
+  }
+
+  unsigned long count_extra_scalar (const char* p, const char* end,
+                                    bool& cr, bool& line_start)
+  {
+    unsigned long extra(0);
+
+    for ( ; p < end; p++ )
+      {
+        if ( line_start && *p == '.' )
+          extra++;
+        if ( *p == '\n' && !cr )
+          extra++;
+        cr = (*p == '\r');
+        line_start = (*p == '\n');
+      }
+    return extra;
+  }
+
+#ifdef WIRE_X86
+  const char* find_lf_sse2 (const char* p, const char* end)
+  {
+    const __m128i lf(_mm_set1_epi8('\n'));
+
+    for ( ; end - p >= 16; p += 16 )
+      {
+        __m128i block(_mm_loadu_si128(reinterpret_cast<const __m128i*> (p)));
+        int mask(_mm_movemask_epi8(_mm_cmpeq_epi8(block, lf)));
+
+        if ( mask )
+          return p + __builtin_ctz(mask);
+      }
+    return find_lf_scalar(p, end);
+  }
+
+  unsigned long count_extra_sse2 (const char* p, const char* end,
+                                  bool& cr, bool& line_start)
+  {
+    const __m128i lf(_mm_set1_epi8('\n'));
+    const __m128i ret(_mm_set1_epi8('\r'));
+    const __m128i dot(_mm_set1_epi8('.'));
+    unsigned long extra(0);
+
+    for ( ; end - p >= 16; p += 16 )
+      {
+        __m128i block(_mm_loadu_si128(reinterpret_cast<const __m128i*> (p)));
+        unsigned int lfs(_mm_movemask_epi8(_mm_cmpeq_epi8(block, lf)));
+        unsigned int crs(_mm_movemask_epi8(_mm_cmpeq_epi8(block, ret)));
+        unsigned int dots(_mm_movemask_epi8(_mm_cmpeq_epi8(block, dot)));
+        // Bit i is set if octet i - 1 is a CR, resp. octet i starts a line
+        unsigned int after_cr(((crs << 1) | cr) & 0xffff);
+        unsigned int starts(((lfs << 1) | line_start) & 0xffff);
+
+        extra += __builtin_popcount(lfs & ~after_cr)
+                + __builtin_popcount(dots & starts);
+        cr = (crs >> 15) & 1;
+        line_start = (lfs >> 15) & 1;
+      }
+    return extra + count_extra_scalar(p, end, cr, line_start);
+  }
+
+  __attribute__ ((target("avx2")))
+  const char* find_lf_avx2 (const char* p, const char* end)
+  {
+    const __m256i lf(_mm256_set1_epi8('\n'));
+
+    for ( ; end - p >= 32; p += 32 )
+      {
+        __m256i block(_mm256_loadu_si256(reinterpret_cast<const __m256i*> (p)));
+        unsigned int mask(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, lf)));
+
+        if ( mask )
+          return p + __builtin_ctz(mask);
+      }
+    return find_lf_sse2(p, end);
+  }
+
+  __attribute__ ((target("avx2")))
+  unsigned long count_extra_avx2 (const char* p, const char* end,
+                                  bool& cr, bool& line_start)
+  {
+    const __m256i lf(_mm256_set1_epi8('\n'));
+    const __m256i ret(_mm256_set1_epi8('\r'));
+    const __m256i dot(_mm256_set1_epi8('.'));
+    unsigned long extra(0);
+
+    for ( ; end - p >= 32; p += 32 )
+      {
+        __m256i block(_mm256_loadu_si256(reinterpret_cast<const __m256i*> (p)));
+        unsigned long long lfs(static_cast<unsigned int>
+                               (_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, lf))));
+        unsigned long long crs(static_cast<unsigned int>
+                               (_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, ret))));
+        unsigned long long dots(static_cast<unsigned int>
+                                (_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, dot))));
+        // Bit i is set if octet i - 1 is a CR, resp. octet i starts a line
+        unsigned long long after_cr(((crs << 1) | cr) & 0xffffffffULL);
+        unsigned long long starts(((lfs << 1) | line_start) & 0xffffffffULL);
+
+        extra += __builtin_popcountll(lfs & ~after_cr)
+                + __builtin_popcountll(dots & starts);
+        cr = (crs >> 31) & 1;
+        line_start = (lfs >> 31) & 1;
+      }
+    return extra + count_extra_sse2(p, end, cr, line_start);
+  }
+#endif
+
+  FindLf select_find_lf ()
+  {
+#ifdef WIRE_X86
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") )
+      return find_lf_avx2;
+    if ( __builtin_cpu_supports("sse2") )
+      return find_lf_sse2;
+#endif
+    return find_lf_scalar;
+  }
+
+  CountExtra select_count_extra ()
+  {
+#ifdef WIRE_X86
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") )
+      return count_extra_avx2;
+    if ( __builtin_cpu_supports("sse2") )
+      return count_extra_sse2;
+#endif
+    return count_extra_scalar;
+  }
+
+  const FindLf find_lf(select_find_lf());
+  const CountExtra count_extra(select_count_extra());
+}
+
+WireEncoder::WireEncoder () :
+_line_start (true), _cr (false), _empty (true) { }
+
+void WireEncoder::encode (const char* data, size_t size, std::string& out)
+{
+  const char* p(data);
+  const char* end(data + size);
+
+  if ( size == 0 )
+    return;
+  _empty = false;
+  // Most messages need only a few extra octets
+  out.reserve(out.size() + size + size / 32 + 2);
+
+  while ( p < end )
+    {
+      if ( _line_start )
+        {
+          // Byte-stuff a line that starts with the termination octet
+          if ( *p == '.' )
+            out += '.';
+          _line_start = false;
+        }
+
+      const char* lf(find_lf(p, end));
+
+      if ( lf == end )
+        {
+          out.append(p, end - p);
+          _cr = (end[-1] == '\r');
+          break;
+        }
+
+      bool cr(lf > p ? lf[-1] == '\r' : _cr);
+
+      out.append(p, lf - p);
+      if ( !cr )
+        out += '\r';
+      out += '\n';
+      p = lf + 1;
+      _line_start = true;
+      _cr = false;
+    }
+}
+
+void WireEncoder::finish (std::string& out)
+{
+  if ( !_empty && !_line_start )
+    out += (_cr ? "\n" : "\r\n");
+  _line_start = true;
+  _cr = false;
+  _empty = true;
+}
+
+unsigned long WireEncoder::count (const char* data, size_t size)
+{
+  if ( size == 0 )
+    return 0;
+  _empty = false;
+  return size + count_extra(data, data + size, _cr, _line_start);
+}
+
+unsigned long WireEncoder::count_finish ()
+{
+  unsigned long extra(0);
+
+  if ( !_empty && !_line_start )
+    extra = (_cr ? 1 : 2);
+  _line_start = true;
+  _cr = false;
+  _empty = true;
+  return extra;
+}
+
+unsigned long WireEncoder::wire_size (const std::string& filepath)
+{
+  std::ifstream in_file(filepath.c_str(), std::ios::in | std::ios::binary);
+
+  if ( !in_file.is_open() )
+    throw std::runtime_error("unable to open message: " + filepath);
+
+  WireEncoder encoder;
+  std::vector<char> buffer(64 * 1024);
+  unsigned long size(0);
+
+  while ( in_file.read(&buffer[0], buffer.size()) || in_file.gcount() )
+    size += encoder.count(&buffer[0], in_file.gcount());
+  return size + encoder.count_finish();
+}
@@ -0,0 +1,76 @@
+/*
+ * File:   wire.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _WIRE_H
+#define	_WIRE_H
+
+#include <string>
+#include <cstddef>
+
+/** The WireEncoder converts the text of a message into its wire form
+ * as required by RFC 1939: every line ends in CRLF and every line that
+ * starts with a '.' gets an extra '.' in front of it.
+ *
+ * The encoder is a streaming transformer: a message can be fed to it
+ * in chunks of any size, a line ending or a leading dot that straddles
+ * two chunks is handled correctly. Lines that already end in CRLF are
+ * left alone, a lone LF is replaced by CRLF.
+ *
+ * The scanning for line ends is vectorized (AVX2 or SSE2, chosen at
+ * run time) with a scalar fallback.
+ */
+class WireEncoder
+{
+public:
+  WireEncoder ();
+
+  /** Encode a chunk of message text
+   * @param data The text to encode
+   * @param size The number of octets in data
+   * @param out String the wire form of data is appended to
+   */
+  void encode (const char* data, size_t size, std::string& out);
+
+  /** Finish the message: make sure the last line ends in CRLF.
+   * The encoder can be reused for a new message afterwards.
+   * @param out String the remaining wire octets are appended to
+   */
+  void finish (std::string& out);
+
+  /** Count the wire octets of a chunk of message text without
+   * producing them. Uses (and updates) the same state as encode, so
+   * the count of a message fed in chunks is exact.
+   * @param data The text to count
+   * @param size The number of octets in data
+   * @return The number of octets encode would have produced
+   */
+  unsigned long count (const char* data, size_t size);
+
+  /** Finish counting a message
+   * @return The number of octets finish would have produced
+   */
+  unsigned long count_finish ();
+
+  /** The number of wire octets of a message file
+   * @param filepath String representing the path to the message file
+   * @return The exact size in octets of the message on the wire
+   *   (without the terminating ".CRLF" line)
+   * @exception std::runtime_error If the message file can't be opened
+   */
+  static unsigned long wire_size (const std::string& filepath);
+
+private:
+  /* Is the next octet the first one of a line? */
+  bool _line_start;
+
+  /* Was the previous octet a CR? */
+  bool _cr;
+
+  /* Was any octet seen since the start of the message? */
+  bool _empty;
+};
+
+#endif	/* _WIRE_H */
@@ -0,0 +1,167 @@
+/*
+ * File:   wirebench.cpp
+ * Author: Wouter Van Rossem
+ *
+ * Checks the WireEncoder against a byte-at-a-time reference encoder and
+ * measures how fast it encodes and counts, in GB/s. The text is made up
+ * (lines of random length, some starting with a '.', some ending in
+ * CRLF) unless message files are given.
+ *
+ *   wirebench [megabytes [file...]]
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <iterator>
+#include <string>
+#include <cstdlib>
+#include <time.h>
+
+#include "wire.h"
+
+/** The wire form of a message, one octet at a time, see WireEncoder
+ * @param text The text of the message
+ * @return Its wire form
+ */
+static std::string
+reference (const std::string& text)
+{
+  std::string out;
+  bool line_start(true);
+
+  for ( size_t i = 0; i < text.size(); i++ )
+    {
+      if ( line_start && text[i] == '.' )
+        out += '.';
+      if ( text[i] == '\n' && (i == 0 || text[i - 1] != '\r') )
+        out += '\r';
+      out += text[i];
+      line_start = (text[i] == '\n');
+    }
+  if ( !text.empty() && !line_start )
+    out += (text[text.size() - 1] == '\r' ? "\n" : "\r\n");
+  return out;
+}
+
+/** Make up the text of a message
+ * @param size The number of octets, about
+ * @return The text
+ */
+static std::string
+make_text (size_t size)
+{
+  std::string text;
+
+  while ( text.size() < size )
+    {
+      size_t length(rand() % 120);
+
+      if ( rand() % 20 == 0 )
+        text += '.';
+      for ( size_t i = 0; i < length; i++ )
+        text += static_cast<char> (' ' + rand() % 95);
+      text += (rand() % 2 ? "\r\n" : "\n");
+    }
+  return text;
+}
+
+/**
+ * @return Seconds since some fixed time
+ */
+static double
+seconds ()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Encode a text in chunks of random size and compare it with the
+ * reference, also the count
+ * @return A bool indicating if the encoder agrees
+ */
+static bool
+check (const std::string& text)
+{
+  WireEncoder encoder, counter;
+  std::string out;
+  unsigned long count(0);
+
+  for ( size_t i = 0; i < text.size(); )
+    {
+      size_t n(std::min(text.size() - i, static_cast<size_t> (1 + rand() % 4096)));
+
+      encoder.encode(text.data() + i, n, out);
+      count += counter.count(text.data() + i, n);
+      i += n;
+    }
+  encoder.finish(out);
+  count += counter.count_finish();
+  return out == reference(text) && count == out.size();
+}
+
+int
+main (int argc, char* argv[])
+{
+  size_t megabytes(argc > 1 ? atoi(argv[1]) : 1024);
+  std::string text;
+
+  for ( int i = 2; i < argc; i++ )
+    {
+      std::ifstream in(argv[i], std::ios::in | std::ios::binary);
+
+      text.append(std::istreambuf_iterator<char> (in), std::istreambuf_iterator<char> ());
+    }
+  if ( text.empty() )
+    text = make_text(1024 * 1024);
+
+  // Edge cases first: dots and line endings at the borders of chunks
+  const char* edges[] = { "", ".", "\n", "\r", "\r\n", ".\r\n.", "a\n.\n..\r\n", "\n\n\r" };
+
+  for ( size_t i = 0; i < sizeof (edges) / sizeof (edges[0]); i++ )
+    if ( !check(edges[i]) )
+      {
+        std::cerr << "wirebench: encoder differs from the reference" << std::endl;
+        return 1;
+      }
+  for ( int round = 0; round < 16; round++ )
+    if ( !check(round ? make_text(rand() % 100000) : text) )
+      {
+        std::cerr << "wirebench: encoder differs from the reference" << std::endl;
+        return 1;
+      }
+
+  size_t rounds(std::max(static_cast<size_t> (1), megabytes * 1024 * 1024 / text.size()));
+  double octets(static_cast<double> (rounds) * text.size());
+  WireEncoder encoder;
+  std::string out;
+  unsigned long count(0);
+  double begin(seconds());
+
+  for ( size_t i = 0; i < rounds; i++ )
+    {
+      out.clear();
+      encoder.encode(text.data(), text.size(), out);
+      encoder.finish(out);
+    }
+
+  double encoded(seconds());
+
+  for ( size_t i = 0; i < rounds; i++ )
+    {
+      count += encoder.count(text.data(), text.size());
+      count += encoder.count_finish();
+    }
+
+  double counted(seconds());
+
+  std::cout << std::fixed << std::setprecision(2)
+          << "encode: " << octets / (encoded - begin) / 1e9 << " GB/s\n"
+          << "count:  " << octets / (counted - encoded) / 1e9 << " GB/s\n"
+          << "(" << rounds << " x " << text.size() << " octets, "
+          << count / rounds << " on the wire)" << std::endl;
+  return 0;
+}
@@ -0,0 +1,161 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "wirecache.h"
+#include "wire.h"
+
+std::string WireCache::wire_path (const std::string& filepath)
+{
+  std::string::size_type slash(filepath.rfind('/'));
+
+  if ( slash == std::string::npos )
+    return ".wire/" + filepath;
+  return filepath.substr(0, slash + 1) + ".wire" + filepath.substr(slash);
+}
+
+bool WireCache::lookup (const std::string& filepath, unsigned long& size)
+{
+  struct stat message, wire;
+
+  if ( stat(wire_path(filepath).c_str(), &wire) != 0
+       || stat(filepath.c_str(), &message) != 0
+       || wire.st_mtime < message.st_mtime )
+    return false;
+  size = wire.st_size;
+  return true;
+}
+
+std::string WireCache::temporary (const std::string& wirepath)
+{
+  std::string tmp_path(wirepath + ".XXXXXX");
+  int fd(mkstemp(&tmp_path[0]));
+
+  if ( fd < 0 )
+    return "";
+  close(fd);
+  return tmp_path;
+}
+
+bool WireCache::make_directory (const std::string& filepath)
+{
+  std::string path(wire_path(filepath));
+  std::string dir(path.substr(0, path.rfind('/')));
+
+  return mkdir(dir.c_str(), 0700) == 0 || errno == EEXIST;
+}
+
+bool WireCache::convert (const std::string& filepath)
+{
+  std::ifstream in_file(filepath.c_str(), std::ios::in | std::ios::binary);
+
+  if ( !in_file.is_open() || !make_directory(filepath) )
+    return false;
+
+  // Write to a temporary file first, so a wire form is always complete
+  std::string path(wire_path(filepath));
+  std::string tmp_path(temporary(path));
+
+  if ( tmp_path.empty() )
+    return false;
+
+  std::ofstream out_file(tmp_path.c_str(), std::ios::out | std::ios::binary);
+
+  if ( !out_file.is_open() )
+    {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+
+  WireEncoder encoder;
+  std::vector<char> buffer(64 * 1024);
+  std::string wire;
+
+  while ( in_file.read(&buffer[0], buffer.size()) || in_file.gcount() )
+    {
+      wire.clear();
+      encoder.encode(&buffer[0], in_file.gcount(), wire);
+      out_file << wire;
+    }
+  wire.clear();
+  encoder.finish(wire);
+  out_file << wire;
+  out_file.close();
+
+  if ( !out_file || rename(tmp_path.c_str(), path.c_str()) != 0 )
+    {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+  return true;
+}
+
+void WireCache::remove (const std::string& filepath)
+{
+  unlink(wire_path(filepath).c_str());
+}
+
+WireConverter::WireConverter (const std::string& top, size_t interval,
+                              size_t debug_level, Dv::Debugable* debug) :
+Dv::Thread::Thread (false, debug_level, debug), _top (top),
+_interval (interval ? interval : 1) { }
+
+size_t WireConverter::pass (const std::string& path)
+{
+  DIR *dp(opendir(path.c_str()));
+  struct dirent *ep;
+  std::vector<std::string> dirs;
+  size_t converted(0);
+
+  if ( dp == NULL )
+    return 0;
+
+  while ( (ep = readdir(dp)) && !killed() )
+    {
+      // Skip ".", ".." and the .wire directories themselves
+      if ( ep->d_name[0] == '.' )
+        continue;
+
+      std::string entry(path + "/" + ep->d_name);
+      struct stat st;
+      unsigned long size;
+
+      if ( stat(entry.c_str(), &st) != 0 )
+        continue;
+      // Messages in the tmp directory of a Maildir are still being delivered
+      if ( S_ISDIR(st.st_mode) )
+        {
+          if ( std::string(ep->d_name) != "tmp" )
+            dirs.push_back(entry);
+        }
+      else if ( S_ISREG(st.st_mode) && !WireCache::lookup(entry, size)
+                && WireCache::convert(entry) )
+        converted++;
+    }
+  closedir(dp);
+
+  for ( size_t i = 0; i < dirs.size() && !killed(); i++ )
+    converted += pass(dirs[i]);
+  return converted;
+}
+
+int WireConverter::main ()
+{
+  while ( !killed() )
+    {
+      size_t converted(pass(_top));
+
+      log() << "wire converter: " << converted << " messages converted"
+              << std::endl;
+      for ( size_t i = 0; i < _interval && !killed(); i++ )
+        sleep(1);
+    }
+  return 0;
+}
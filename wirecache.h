@@ -0,0 +1,102 @@
+/*
+ * File:   wirecache.h
+ * Author: Wouter Van Rossem
+ *
+ */
+
+#ifndef _WIRECACHE_H
+#define	_WIRECACHE_H
+
+#include <string>
+#include <cstddef>
+
+#include <dvthread/thread.h>
+
+/** The WireCache keeps the wire form (see WireEncoder) of messages on
+ * disk, so that the encoding is done once per message instead of once
+ * per RETR. The wire form of a message "dir/name" is stored as
+ * "dir/.wire/name"; since its name starts with a dot, the maildrop
+ * ignores the directory. The size of the file is the exact number of
+ * octets of the message on the wire.
+ *
+ * A wire copy is only used if it is at least as recent as the message.
+ */
+class WireCache
+{
+public:
+  /**
+   * @param filepath String representing the path to the message file
+   * @return The path to the wire form of the message
+   */
+  static std::string wire_path (const std::string& filepath);
+
+  /** Is there an up to date wire form of a message?
+   * @param filepath String representing the path to the message file
+   * @param size Set to the size of the wire form if there is one
+   * @return A bool indicating if there is an up to date wire form
+   */
+  static bool lookup (const std::string& filepath, unsigned long& size);
+
+  /** Write the wire form of a message
+   * @param filepath String representing the path to the message file
+   * @return A bool indicating if the operation has succeeded
+   */
+  static bool convert (const std::string& filepath);
+
+  /** Create an empty temporary file to write a wire form to. Its name
+   * is unique, so that several sessions (or processes) saving the same
+   * message never write to the same file; the finished file is renamed
+   * to the wire path.
+   * @param wirepath String representing the path to the wire form
+   * @return The path to the temporary file, "" if it cannot be created
+   */
+  static std::string temporary (const std::string& wirepath);
+
+  /** Create the directory holding the wire forms of a maildrop
+   * @param filepath String representing the path to a message file
+   * @return A bool indicating if the directory exists
+   */
+  static bool make_directory (const std::string& filepath);
+
+  /** Remove the wire form of a message, if any
+   * @param filepath String representing the path to the message file
+   */
+  static void remove (const std::string& filepath);
+};
+
+/** A thread that periodically converts all messages under the top
+ * directory that do not have an up to date wire form yet.
+ */
+class WireConverter : public Dv::Thread::Thread
+{
+public:
+  /** Constructor for WireConverter
+   * @param top String representing the top directory of the maildrops
+   * @param interval Seconds between two passes over top
+   * @param debug_level only if the master debug level is larger
+   *   than this level will debug output be generated
+   * @param debug object (may be 0)
+   */
+  WireConverter (const std::string& top, size_t interval, size_t debug_level,
+                 Dv::Debugable* debug);
+
+private:
+  WireConverter (const WireConverter&);
+  WireConverter& operator= (const WireConverter&);
+
+  virtual int main ();
+
+  /** Convert all messages in a directory and its subdirectories
+   * @param path String representing the path to the directory
+   * @return The number of messages converted
+   */
+  size_t pass (const std::string& path);
+
+  /* The top directory */
+  std::string _top;
+
+  /* Seconds between two passes */
+  size_t _interval;
+};
+
+#endif	/* _WIRECACHE_H */